@@ -16,8 +16,8 @@
 %language "c++"
 %define api.value.type {redgrep::Exp}
 %header
-%lex-param   {llvm::StringRef* str}
-%parse-param {llvm::StringRef* str} {redgrep::Exp* exp}
+%lex-param   {llvm::StringRef* str} {int flags}
+%parse-param {llvm::StringRef* str} {int flags} {redgrep::Exp* exp}
 
 %code requires {
 #include "llvm/ADT/StringRef.h"
@@ -25,9 +25,10 @@
 }
 
 %code {
+#include "unicode_groups.h"
 #include "utf.h"
 namespace yy {
-int yylex(redgrep::Exp* exp, llvm::StringRef* str);
+int yylex(redgrep::Exp* exp, llvm::StringRef* str, int flags);
 }  // namespace yy
 }
 
@@ -71,8 +72,19 @@ expression:
 
 %%
 
+// Outputs the next character of input. In Latin-1 mode, each byte is one
+// character; otherwise, input is decoded as UTF-8.
 static bool Character(llvm::StringRef* input,
+                      int flags,
                       Rune* character) {
+  if (flags & redgrep::kLatin1) {
+    if (input->empty()) {
+      return false;
+    }
+    *character = static_cast<unsigned char>(input->front());
+    *input = input->drop_front(1);
+    return true;
+  }
   int len = charntorune(character, input->data(), input->size());
   if (len > 0) {
     *input = input->drop_front(len);
@@ -81,8 +93,126 @@ static bool Character(llvm::StringRef* input,
   return false;
 }
 
+// Returns true iff character begins a class escape (e.g. \d or \p{Lu}).
+static bool IsClassEscape(Rune character) {
+  switch (character) {
+    case 'd':
+    case 'D':
+    case 's':
+    case 'S':
+    case 'w':
+    case 'W':
+    case 'p':
+    case 'P':
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Adds the runes matched by the class escape that begins with character to
+// ranges. The group is folded before it is negated so that e.g. \W matches
+// neither k nor K when folding case. If key is non-null, outputs the key for
+// redgrep::InternedClass().
+static bool ClassEscape(Rune character,
+                        llvm::StringRef* input,
+                        int flags,
+                        redgrep::RuneRanges* ranges,
+                        std::string* key) {
+  redgrep::RuneRanges group;
+  auto Add = [&group](const redgrep::RuneGroup& g) {
+    for (int i = 0; i < g.nranges; ++i) {
+      group.insert(std::make_pair(g.ranges[i].lo, g.ranges[i].hi));
+    }
+  };
+  bool negate = false;
+  std::string name_key;
+  switch (character) {
+    case 'D':
+    case 'S':
+    case 'W':
+      negate = true;
+      character = character - 'A' + 'a';
+      // FALLTHROUGH
+    case 'd':
+    case 's':
+    case 'w':
+      name_key = static_cast<char>(character);
+      for (int i = 0; i < redgrep::kNumPerlGroups; ++i) {
+        if (static_cast<Rune>(redgrep::kPerlGroups[i].name[0]) == character) {
+          Add(redgrep::kPerlGroups[i]);
+        }
+      }
+      break;
+    case 'P':
+      negate = true;
+      // FALLTHROUGH
+    case 'p': {
+      // Either \pN or \p{Name}, where {^Name} negates.
+      llvm::StringRef name;
+      if (input->startswith("{")) {
+        size_t len = input->find('}');
+        if (len == llvm::StringRef::npos) {
+          return false;
+        }
+        name = input->slice(1, len);
+        *input = input->drop_front(len + 1);
+        if (name.startswith("^")) {
+          name = name.drop_front(1);
+          negate = !negate;
+        }
+      } else if (!input->empty()) {
+        name = input->take_front(1);
+        *input = input->drop_front(1);
+      }
+      if (name.empty() || name.size() > 2) {
+        return false;
+      }
+      name_key = "p{" + name.str() + "}";
+      for (int i = 0; i < redgrep::kNumUnicodeGroups; ++i) {
+        if (llvm::StringRef(redgrep::kUnicodeGroups[i].name)
+                .startswith(name)) {
+          Add(redgrep::kUnicodeGroups[i]);
+        }
+      }
+      break;
+    }
+    default:
+      abort();
+  }
+  if (group.empty()) {
+    return false;
+  }
+  if (flags & redgrep::kFoldCase) {
+    redgrep::FoldCase(&group);
+  }
+  if (negate) {
+    // Merge overlapping and adjacent rune ranges, then take the gaps.
+    redgrep::RuneRanges gaps;
+    Rune next = 0;
+    for (const auto& range : group) {
+      if (range.first > next) {
+        gaps.insert(std::make_pair(next, range.first - 1));
+      }
+      next = std::max(next, range.second + 1);
+    }
+    if (next <= Runemax) {
+      gaps.insert(std::make_pair(next, static_cast<Rune>(Runemax)));
+    }
+    group.swap(gaps);
+  }
+  ranges->insert(group.begin(), group.end());
+  if (key != nullptr) {
+    *key = (negate ? "^" : "") + name_key;
+    *key += flags & redgrep::kFoldCase ? "/i" : "";
+    *key += flags & redgrep::kLatin1 ? "/U" : "";
+  }
+  return true;
+}
+
 static bool CharacterClass(llvm::StringRef* input,
-                           std::set<Rune>* characters,
+                           int flags,
+                           redgrep::RuneRanges* ranges,
                            bool* complement) {
   if (input->startswith("^")) {
     *input = input->drop_front(1);
@@ -90,38 +220,72 @@ static bool CharacterClass(llvm::StringRef* input,
   } else {
     *complement = false;
   }
+  // Outputs the next character, handling any escape sequence.
+  auto Next = [&input, flags](Rune* character) -> bool {
+    if (!Character(input, flags, character)) {
+      return false;
+    }
+    if (*character == '\\') {
+      if (!Character(input, flags, character)) {
+        return false;
+      }
+      switch (*character) {
+        case 'f':
+          *character = '\f';
+          break;
+        case 'n':
+          *character = '\n';
+          break;
+        case 'r':
+          *character = '\r';
+          break;
+        case 't':
+          *character = '\t';
+          break;
+        default:
+          break;
+      }
+    }
+    return true;
+  };
   Rune character;
-  while (Character(input, &character)) {
-    switch (character) {
-      case '\\':
-        if (!Character(input, &character)) {
+  while (!input->startswith("]")) {
+    if (input->startswith("\\")) {
+      llvm::StringRef tmp = input->drop_front(1);
+      if (Character(&tmp, flags, &character) && IsClassEscape(character)) {
+        *input = tmp;
+        if (!ClassEscape(character, input, flags, ranges, nullptr)) {
           return false;
         }
-        switch (character) {
-          case 'f':
-            character = '\f';
-            break;
-          case 'n':
-            character = '\n';
-            break;
-          case 'r':
-            character = '\r';
-            break;
-          case 't':
-            character = '\t';
-            break;
-          default:
-            break;
-        }
-        // FALLTHROUGH
-      default:
-        characters->insert(character);
-        break;
-      case ']':
-        return true;
+        continue;
+      }
+    }
+    if (!Next(&character)) {
+      return false;
+    }
+    // A hyphen between two characters denotes a range; anywhere else, it is
+    // just a hyphen.
+    Rune max = character;
+    if (input->startswith("-") && !input->startswith("-]")) {
+      *input = input->drop_front(1);
+      if (!Next(&max) || max < character) {
+        return false;
+      }
     }
+    ranges->insert(std::make_pair(character, max));
   }
-  return false;
+  *input = input->drop_front(1);
+  return true;
+}
+
+// Returns the class of runes (or, in Latin-1 mode, of bytes) in ranges.
+static redgrep::Exp Class(const redgrep::RuneRanges& ranges,
+                          bool complement,
+                          int flags) {
+  if (flags & redgrep::kLatin1) {
+    return redgrep::ByteClass(ranges, complement);
+  }
+  return redgrep::CharacterClass(ranges, complement);
 }
 
 static bool Quantifier(Rune character,
@@ -185,9 +349,9 @@ static bool Quantifier(Rune character,
 
 namespace yy {
 
-int yylex(redgrep::Exp* exp, llvm::StringRef* str) {
+int yylex(redgrep::Exp* exp, llvm::StringRef* str, int flags) {
   Rune character;
-  if (!Character(str, &character)) {
+  if (!Character(str, flags, &character)) {
     return 0;
   }
   typedef parser::token_type TokenType;
@@ -235,23 +399,45 @@ int yylex(redgrep::Exp* exp, llvm::StringRef* str) {
     case ')':
       return TokenType::RIGHT_PARENTHESIS;
     case '[': {
-      std::set<Rune> characters;
+      redgrep::RuneRanges ranges;
       bool complement;
-      if (!CharacterClass(str, &characters, &complement) ||
-          characters.empty()) {
+      if (!CharacterClass(str, flags, &ranges, &complement) ||
+          ranges.empty()) {
         return TokenType::ERROR;
       }
-      *exp = redgrep::CharacterClass(characters, complement);
+      if (flags & redgrep::kFoldCase) {
+        redgrep::FoldCase(&ranges);
+      }
+      *exp = Class(ranges, complement, flags);
       return TokenType::FUNDAMENTAL;
     }
     case '\\':
-      if (!Character(str, &character)) {
+      if (!Character(str, flags, &character)) {
         return TokenType::ERROR;
       }
       switch (character) {
         case 'C':
           *exp = redgrep::AnyByte();
           return TokenType::FUNDAMENTAL;
+        case 'd':
+        case 'D':
+        case 's':
+        case 'S':
+        case 'w':
+        case 'W':
+        case 'p':
+        case 'P': {
+          // The class is interned, so that patterns share its expansion.
+          redgrep::RuneRanges ranges;
+          std::string key;
+          if (!ClassEscape(character, str, flags, &ranges, &key)) {
+            return TokenType::ERROR;
+          }
+          *exp = redgrep::InternedClass(key, [&ranges, flags] {
+            return Class(ranges, false, flags);
+          });
+          return TokenType::FUNDAMENTAL;
+        }
         case 'f':
           character = '\f';
           break;
@@ -269,10 +455,27 @@ int yylex(redgrep::Exp* exp, llvm::StringRef* str) {
       }
       // FALLTHROUGH
     default:
-      *exp = redgrep::Character(character);
+      if (flags & redgrep::kFoldCase) {
+        redgrep::RuneRanges ranges;
+        ranges.insert(std::make_pair(character, character));
+        redgrep::FoldCase(&ranges);
+        if (ranges.size() > 1) {
+          *exp = Class(ranges, false, flags);
+          return TokenType::FUNDAMENTAL;
+        }
+      }
+      if (flags & redgrep::kLatin1) {
+        *exp = redgrep::Byte(character);
+      } else {
+        *exp = redgrep::Character(character);
+      }
       return TokenType::FUNDAMENTAL;
     case '.':
-      *exp = redgrep::AnyCharacter();
+      if (flags & redgrep::kLatin1) {
+        *exp = redgrep::AnyByte();
+      } else {
+        *exp = redgrep::AnyCharacter();
+      }
       return TokenType::FUNDAMENTAL;
   }
 }
@@ -18,8 +18,10 @@
 #include <stdio.h>
 
 #include <string>
+#include <tuple>
 
 #include "llvm-c/Disassembler.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
@@ -30,16 +32,25 @@ int main(int argc, char** argv) {
   if (argv1 == nullptr) {
     errx(1, "regular expression not specified");
   }
+  redgrep::CompileStats stats;
   redgrep::Exp exp;
-  if (!redgrep::Parse(argv1, &exp)) {
+  if (!redgrep::Parse(argv1, &exp, &stats)) {
     errx(1, "parse error");
   }
   redgrep::DFA dfa;
-  int nstates = redgrep::Compile(exp, &dfa);
-  printf("; dfa is %d states\n", nstates);
+  redgrep::Compile(exp, &dfa, &stats);
   redgrep::Fun fun;
-  int nbytes = redgrep::Compile(dfa, &fun);
-  printf("; fun is %d bytes\n", nbytes);
+  redgrep::Compile(dfa, &fun, &stats);
+  redgrep::Table table;
+  redgrep::Compile(dfa, &table, &stats);
+  std::string str;
+  redgrep::Dump(stats, &str);
+  llvm::StringRef rest(str);
+  while (!rest.empty()) {
+    llvm::StringRef line;
+    std::tie(line, rest) = rest.split('\n');
+    printf("; %s\n", line.str().c_str());
+  }
 
   std::string triple = fun.engine_->getTargetMachine()->getTargetTriple().str();
   std::string cpu(fun.engine_->getTargetMachine()->getTargetCPU());
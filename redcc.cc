@@ -0,0 +1,286 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <set>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBufferRef.h"
+#include "regexp.h"
+
+static constexpr char kUsage[] =
+  "Usage: %s [OPTION]... -o OUTPUT NAME=REGEXP...\n"
+  "\n"
+  "Options:\n"
+  "\n"
+  "  -o OUTPUT  write an object file (or an archive if OUTPUT ends in `.a'\n"
+  "             or C++ source code if OUTPUT ends in `.cc' or a header of\n"
+  "             constexpr tables and inline functions if OUTPUT ends in `.h')\n"
+  "  -H HEADER  write a header declaring the functions\n"
+  "  -t TRIPLE  target the given triple instead of the host\n"
+  "  -c CPU     target the given CPU instead of \"generic\"\n"
+  "  -O N       optimise at level N (0 to 3)\n"
+  "  -u N       unroll the functions N times\n"
+  "  -m N       fail if any DFA has more than N states\n"
+  "  -s         with C++ source code, emit a switch per DFA state rather than\n"
+  "             a loop over a transition table\n"
+  "\n"
+  "For each NAME=REGEXP, OUTPUT defines a function with the C signature\n"
+  "\n"
+  "  bool match_NAME(const char* data, size_t size);\n"
+  "\n"
+  "which returns whether REGEXP matches the data in its entirety.\n"
+  "\n";
+
+// Returns true iff name is a valid C identifier.
+static bool IsIdentifier(llvm::StringRef name) {
+  if (name.empty() || llvm::isDigit(name[0])) {
+    return false;
+  }
+  for (char c : name) {
+    if (!llvm::isAlnum(c) && c != '_') {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void WriteFile(const std::string& path, llvm::StringRef contents) {
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    err(1, "%s", path.c_str());
+  }
+  if (fwrite(contents.data(), 1, contents.size(), file) != contents.size() ||
+      fclose(file) != 0) {
+    err(1, "%s", path.c_str());
+  }
+}
+
+// Returns the include guard for the header.
+static std::string Guard(const std::string& path) {
+  llvm::StringRef base = path;
+  base = base.substr(base.rfind('/') + 1);
+  std::string guard;
+  for (char c : base) {
+    guard += llvm::isAlnum(c) ? llvm::toUpper(c) : '_';
+  }
+  guard += '_';
+  return guard;
+}
+
+// Returns the header declaring the functions.
+static std::string Header(const std::string& path,
+                          const std::vector<std::string>& functions) {
+  std::string guard = Guard(path);
+  std::string header;
+  header += "// Generated by redcc. DO NOT EDIT.\n\n";
+  header += "#ifndef " + guard + "\n";
+  header += "#define " + guard + "\n\n";
+  header += "#include <stdbool.h>\n";
+  header += "#include <stddef.h>\n\n";
+  header += "#ifdef __cplusplus\n";
+  header += "extern \"C\" {\n";
+  header += "#endif\n\n";
+  for (const std::string& function : functions) {
+    header += "bool " + function + "(const char* data, size_t size);\n";
+  }
+  header += "\n";
+  header += "#ifdef __cplusplus\n";
+  header += "}  // extern \"C\"\n";
+  header += "#endif\n\n";
+  header += "#endif  // " + guard + "\n";
+  return header;
+}
+
+// Returns the header defining the tables and the functions.
+static std::string StaticHeader(const std::string& path,
+                                const std::string& functions) {
+  std::string guard = Guard(path);
+  std::string header;
+  header += "// Generated by redcc. DO NOT EDIT.\n\n";
+  header += "#ifndef " + guard + "\n";
+  header += "#define " + guard + "\n\n";
+  header += "#include <stddef.h>\n\n";
+  header += "#include \"static_table.h\"\n";
+  header += functions;
+  header += "\n#endif  // " + guard + "\n";
+  return header;
+}
+
+// Returns the source file defining the functions.
+static std::string Source(const std::string& functions) {
+  std::string source;
+  source += "// Generated by redcc. DO NOT EDIT.\n\n";
+  source += "#include <stddef.h>\n";
+  source += "#include <string.h>\n\n";
+  source += "extern \"C\" {\n";
+  source += functions;
+  source += "\n}  // extern \"C\"\n";
+  return source;
+}
+
+int main(int argc, char** argv) {
+  // Parse options.
+  std::string opt_output;
+  std::string opt_header;
+  int opt_max_states = 0;
+  redgrep::SourceStyle opt_style = redgrep::kSourceTable;
+  redgrep::Lib lib;
+  while (true) {
+    int opt = getopt(argc, argv, "o:H:t:c:O:u:m:s");
+    if (opt == -1) {
+      break;
+    }
+    switch (opt) {
+      case 'o':
+        opt_output = optarg;
+        break;
+      case 'H':
+        opt_header = optarg;
+        break;
+      case 't':
+        lib.triple_ = optarg;
+        break;
+      case 'c':
+        lib.cpu_ = optarg;
+        break;
+      case 'O': {
+        int level = atoi(optarg);
+        if (level < redgrep::kOptNone || level > redgrep::kOptAggressive) {
+          errx(2, "invalid optimisation level");
+        }
+        lib.opt_level_ = static_cast<redgrep::OptLevel>(level);
+        break;
+      }
+      case 'u':
+        lib.unroll_ = atoi(optarg);
+        if (lib.unroll_ < 1) {
+          errx(2, "invalid unroll factor");
+        }
+        break;
+      case 'm':
+        opt_max_states = atoi(optarg);
+        if (opt_max_states < 1) {
+          errx(2, "invalid maximum number of states");
+        }
+        break;
+      case 's':
+        opt_style = redgrep::kSourceSwitch;
+        break;
+      default:
+        fprintf(stderr, kUsage, program_invocation_short_name);
+        return 2;
+    }
+  }
+
+  // Shift off parsed options.
+  argc -= optind;
+  argv += optind;
+
+  if (opt_output.empty() || argc == 0) {
+    fprintf(stderr, kUsage, program_invocation_short_name);
+    return 2;
+  }
+
+  bool opt_source = llvm::StringRef(opt_output).endswith(".cc");
+  bool opt_static = llvm::StringRef(opt_output).endswith(".h");
+  if (opt_static && !opt_header.empty()) {
+    errx(2, "OUTPUT is already a header");
+  }
+  std::string source;
+  std::vector<std::string> functions;
+  std::set<std::string> names;
+  for (int i = 0; i < argc; ++i) {
+    llvm::StringRef name, regexp;
+    std::tie(name, regexp) = llvm::StringRef(argv[i]).split('=');
+    if (!IsIdentifier(name)) {
+      errx(1, "invalid name: %s", name.str().c_str());
+    }
+    if (!names.insert(name.str()).second) {
+      errx(1, "duplicate name: %s", name.str().c_str());
+    }
+    redgrep::Exp exp;
+    if (!redgrep::Parse(regexp.str(), &exp)) {
+      errx(1, "parse error: %s", name.str().c_str());
+    }
+    redgrep::DFA dfa;
+    int nstates = redgrep::Compile(exp, &dfa);
+    if (opt_max_states > 0 && nstates > opt_max_states) {
+      errx(1, "%s: %d states exceeds the maximum of %d", name.str().c_str(),
+           nstates, opt_max_states);
+    }
+    std::string function = "match_" + name.str();
+    if (opt_source) {
+      std::string code;
+      redgrep::Generate(dfa, function, opt_style, &code);
+      source += "\n" + code;
+    } else if (opt_static) {
+      redgrep::Table table;
+      redgrep::Compile(dfa, &table);
+      std::string code;
+      redgrep::Serialize(table, "table_" + name.str(), &code);
+      source += "\n" + code;
+      source += "\ninline bool " + function;
+      source += "(const char* data, size_t size) {\n";
+      source += "  return redgrep::StaticMatch<table_" + name.str() +
+                ">(data, size);\n";
+      source += "}\n";
+    } else if (!redgrep::Compile(dfa, function, &lib)) {
+      errx(1, "failed to compile %s for %s", function.c_str(),
+           lib.triple_.c_str());
+    }
+    functions.push_back(function);
+  }
+
+  std::string object;
+  if (opt_source) {
+    WriteFile(opt_output, Source(source));
+  } else if (opt_static) {
+    WriteFile(opt_output, StaticHeader(opt_output, source));
+  } else if (!redgrep::Emit(&lib, &object)) {
+    errx(1, "failed to emit object file for %s", lib.triple_.c_str());
+  } else if (llvm::StringRef(opt_output).endswith(".a")) {
+    std::vector<llvm::NewArchiveMember> members;
+    members.emplace_back(llvm::MemoryBufferRef(object, "redcc.o"));
+    llvm::Error error = llvm::writeArchive(
+        opt_output, members, /*WriteSymtab=*/true,
+        llvm::Triple(lib.triple_).isOSDarwin()
+            ? llvm::object::Archive::K_DARWIN
+            : llvm::object::Archive::K_GNU,
+        /*Deterministic=*/true, /*Thin=*/false);
+    if (error) {
+      errx(1, "%s: %s", opt_output.c_str(),
+           llvm::toString(std::move(error)).c_str());
+    }
+  } else {
+    WriteFile(opt_output, object);
+  }
+  if (!opt_header.empty()) {
+    WriteFile(opt_header, Header(opt_header, functions));
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "llvm/ADT/StringRef.h"
+#include "redcc_test_object.h"
+#include "redcc_test_source.h"
+#include "redcc_test_static.h"
+#include "redcc_test_switch.h"
+#include "regexp.h"
+
+namespace redgrep {
+
+// Must be kept in sync with REDCC_TEST_PATTERNS in BUILD.bazel.
+struct Generated {
+  const char* backend;
+  const char* pattern;
+  bool (*function)(const char* data, size_t size);
+};
+
+#define GENERATED(name, pattern)                \
+  {"object", pattern, match_object_##name},     \
+  {"source", pattern, match_source_##name},     \
+  {"switch", pattern, match_switch_##name},     \
+  {"static", pattern, match_static_##name}
+
+static constexpr Generated kGenerated[] = {
+    GENERATED(memchr, "\\C*x(a|b)"),
+    GENERATED(counted, "(a|b)*abb(a|b){2}"),
+    GENERATED(complement, ".*a.*&!(.*b.*)"),
+    GENERATED(utf8, "[αβ]+x?"),
+    GENERATED(nullable, "a*"),
+    GENERATED(literals, "ab|abx|bxa"),
+};
+
+#undef GENERATED
+
+// Returns every string of at most maxlen bytes drawn from alphabet, followed
+// by some longer random strings.
+static std::vector<std::string> Inputs(llvm::StringRef alphabet, int maxlen) {
+  std::vector<std::string> inputs = {""};
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (static_cast<int>(inputs[i].size()) < maxlen) {
+      for (char c : alphabet) {
+        inputs.push_back(inputs[i] + c);
+      }
+    }
+  }
+  std::minstd_rand rand(20120101);
+  for (int i = 0; i < 1000; ++i) {
+    std::string input(rand() % 64, '\0');
+    for (char& c : input) {
+      c = alphabet[rand() % alphabet.size()];
+    }
+    inputs.push_back(input);
+  }
+  return inputs;
+}
+
+TEST(Generate, Match) {
+  // The bytes of "α" and "β" are included so that the UTF-8 pattern sees
+  // both valid and invalid sequences.
+  std::vector<std::string> inputs = Inputs("abx\n\xCE\xB1\xB2\xFF", 5);
+  for (const Generated& generated : kGenerated) {
+    Exp exp;
+    ASSERT_TRUE(Parse(generated.pattern, &exp)) << generated.pattern;
+    DFA dfa;
+    Compile(exp, &dfa);
+    for (const std::string& input : inputs) {
+      EXPECT_EQ(Match(dfa, input),
+                generated.function(input.data(), input.size()))
+          << generated.backend << " " << generated.pattern
+          << " on \"" << input << "\"";
+    }
+  }
+}
+
+}  // namespace redgrep
@@ -0,0 +1,104 @@
+# Copyright 2024 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Compiles regular expressions into a cc_library at build time."""
+
+def _quote(s):
+    # Quote for the shell, then escape for Make variable expansion.
+    return ("'" + s.replace("'", "'\\''") + "'").replace("$", "$$")
+
+def redgrep_library(
+        name,
+        patterns,
+        backend = "object",
+        max_states = None,
+        triple = None,
+        cpu = None,
+        opt_level = None,
+        source_switch = False,
+        **kwargs):
+    """Defines a cc_library with one matcher function per pattern.
+
+    The library provides one header, `<name>.h`, which declares
+
+        bool match_NAME(const char* data, size_t size);
+
+    for each NAME. The function returns whether the pattern matches the data
+    in its entirety.
+
+    Args:
+      name: The name of the cc_library.
+      patterns: A dict mapping each NAME to its pattern.
+      backend: "object" to compile ahead of time using LLVM, "source" to
+        generate C++ source code or "static" to generate constexpr tables
+        and inline functions in the header.
+      max_states: If set, the build fails if any DFA has more states.
+      triple: If set, the target triple for the "object" backend.
+        Defaults to the host.
+      cpu: If set, the target CPU for the "object" backend.
+        Defaults to "generic", so the output does not depend on the
+        machine that runs the build.
+      opt_level: If set, the optimisation level (0 to 3) for the "object"
+        backend.
+      source_switch: If True, the "source" backend emits a switch per DFA
+        state rather than a loop over a constexpr transition table.
+      **kwargs: Passed through to the cc_library.
+    """
+    if backend == "object":
+        srcs = [name + ".o"]
+    elif backend == "source":
+        srcs = [name + ".cc"]
+    elif backend == "static":
+        srcs = []
+    else:
+        fail("unknown backend: %r" % (backend,))
+    hdr = name + ".h"
+    outs = srcs + [hdr]
+
+    args = []
+    if max_states != None:
+        args.append("-m %d" % max_states)
+    if triple != None:
+        args.append("-t " + _quote(triple))
+    if cpu != None:
+        args.append("-c " + _quote(cpu))
+    if opt_level != None:
+        args.append("-O %d" % opt_level)
+    if source_switch:
+        args.append("-s")
+    if srcs:
+        args.append("-o $(location %s) -H $(location %s)" % (srcs[0], hdr))
+    else:
+        args.append("-o $(location %s)" % hdr)
+    for pattern_name, pattern in sorted(patterns.items()):
+        args.append(_quote(pattern_name + "=" + pattern))
+
+    native.genrule(
+        name = name + "_redcc",
+        outs = outs,
+        cmd = "$(location %s) %s" % (Label("//:redcc"), " ".join(args)),
+        tools = [Label("//:redcc")],
+        visibility = ["//visibility:private"],
+    )
+
+    deps = kwargs.pop("deps", [])
+    if backend == "static":
+        deps = deps + [Label("//:static_table")]
+    native.cc_library(
+        name = name,
+        srcs = srcs,
+        hdrs = [hdr],
+        deps = deps,
+        **kwargs
+    )
@@ -14,18 +14,91 @@
 
 #include "redgrep.h"
 
-RED::RED(llvm::StringRef str) {
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+
+// Searching a string for the literals costs about as much as matching it, so
+// the prefilter pays off only if most strings do not contain any of them. We
+// decide based on the first kSample strings: if more than a quarter of them
+// are candidates, the literals are too common.
+static constexpr size_t kSample = 256;
+
+RED::RED(llvm::StringRef str) : RED(str, redgrep::kParseDefault) {}
+
+RED::RED(llvm::StringRef str, int flags) : searched_(0), candidates_(0) {
   redgrep::Exp exp;
-  ok_ = redgrep::Parse(str, &exp);
+  ok_ = redgrep::Parse(str, flags, &exp, &stats_);
   if (ok()) {
-    redgrep::DFA dfa;
-    redgrep::Compile(exp, &dfa);
-    redgrep::Compile(dfa, &fun_);
+    redgrep::Compile(exp, &prefilter_);
+    redgrep::Compile(exp, &dfa_, &stats_);
+    redgrep::Compile(dfa_, &table_, &stats_);
   }
 }
 
 RED::~RED() {}
 
 bool RED::FullMatch(llvm::StringRef str, const RED& re) {
+  if (!re.prefilter_.literals_.empty()) {
+    // Once the sample is complete, the counts no longer change, so only
+    // loads happen here and the cache line stays shared between threads.
+    size_t searched = re.searched_.load(std::memory_order_relaxed);
+    if (searched < kSample ||
+        re.candidates_.load(std::memory_order_relaxed) <= kSample / 4) {
+      bool candidate =
+          redgrep::Search(re.prefilter_, str) != llvm::StringRef::npos;
+      if (searched < kSample) {
+        re.searched_.fetch_add(1, std::memory_order_relaxed);
+        if (candidate) {
+          re.candidates_.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      if (!candidate) {
+        return false;
+      }
+    }
+  }
+  std::call_once(re.fun_once_, [&re]() {
+    redgrep::Compile(re.dfa_, &re.fun_, &re.stats_);
+  });
   return redgrep::Match(re.fun_, str);
 }
+
+void RED::FullMatch(const std::vector<llvm::StringRef>& strs,
+                    const RED& re, std::vector<bool>* matches) {
+  if (re.prefilter_.literals_.empty()) {
+    redgrep::Match(re.table_, strs, matches);
+    return;
+  }
+  // Match only the strings that contain one of the literals, unless the first
+  // few strings show that the literals are common.
+  std::vector<llvm::StringRef> candidates;
+  std::vector<size_t> indices;
+  for (size_t i = 0; i < strs.size(); ++i) {
+    if (i == kSample && indices.size() > kSample / 4) {
+      redgrep::Match(re.table_, strs, matches);
+      return;
+    }
+    if (redgrep::Search(re.prefilter_, strs[i]) != llvm::StringRef::npos) {
+      candidates.push_back(strs[i]);
+      indices.push_back(i);
+    }
+  }
+  std::vector<bool> candidate_matches;
+  redgrep::Match(re.table_, candidates, &candidate_matches);
+  matches->assign(strs.size(), false);
+  for (size_t i = 0; i < indices.size(); ++i) {
+    (*matches)[indices[i]] = candidate_matches[i];
+  }
+}
+
+void RED::Scan(llvm::StringRef str, const RED& re,
+               std::vector<llvm::StringRef>* lines) {
+  if (!re.prefilter_.literals_.empty()) {
+    redgrep::Scan(re.table_, re.prefilter_, str, lines);
+    return;
+  }
+  redgrep::Scan(re.table_, str, lines);
+}
@@ -15,6 +15,10 @@
 #ifndef REDGREP_REDGREP_H_
 #define REDGREP_REDGREP_H_
 
+#include <atomic>
+#include <mutex>
+#include <vector>
+
 #include "llvm/ADT/StringRef.h"
 #include "regexp.h"
 
@@ -23,18 +27,56 @@
 class RED {
  public:
   explicit RED(llvm::StringRef str);
+  // As above, but with the given redgrep::ParseFlags.
+  RED(llvm::StringRef str, int flags);
   ~RED();
 
   // Returns true if the RED object is usable, false otherwise.
   // TODO(junyer): Plumb and expose errors from the parser.
   bool ok() const { return ok_; }
 
-  // Returns the result of matching str using re.
+  // Returns the statistics about compiling the regular expression.
+  // The function is compiled when FullMatch() first needs it, so until then,
+  // the LLVM stages are not included. Because that updates the statistics,
+  // stats() must not be called concurrently with the first FullMatch().
+  const redgrep::CompileStats& stats() const { return stats_; }
+
+  // Returns the result of matching str using re. Strings that do not contain
+  // one of the required literals (if any) are rejected without being matched,
+  // unless the first few strings show that the literals are common. The first
+  // call compiles the function for re, which takes much longer than matching.
   static bool FullMatch(llvm::StringRef str, const RED& re);
 
+  // Outputs the result of matching each of strs using re.
+  // This is intended for batches of short strings (e.g. records or lines),
+  // which are matched several at a time in order to hide memory latency.
+  // Unless the first few strings show that they are common, strings that do
+  // not contain one of the required literals (if any) are rejected without
+  // being matched.
+  static void FullMatch(const std::vector<llvm::StringRef>& strs,
+                        const RED& re, std::vector<bool>* matches);
+
+  // Outputs the lines of str that match using re. A line ends after each
+  // newline (and includes it) or at the end of str. This is equivalent to
+  // calling FullMatch() on each line, but much faster for large buffers,
+  // especially when every match must contain one of a few literals.
+  static void Scan(llvm::StringRef str, const RED& re,
+                   std::vector<llvm::StringRef>* lines);
+
  private:
   bool ok_;
-  redgrep::Fun fun_;
+  mutable redgrep::CompileStats stats_;
+  redgrep::DFA dfa_;
+  // Only FullMatch() for a single string uses fun_, so it is compiled from
+  // dfa_ on demand.
+  mutable std::once_flag fun_once_;
+  mutable redgrep::Fun fun_;
+  redgrep::Table table_;
+  redgrep::Prefilter prefilter_;
+  // How many strings FullMatch() has searched using prefilter_ and how many
+  // of those were candidates, up to the sample size.
+  mutable std::atomic<size_t> searched_;
+  mutable std::atomic<size_t> candidates_;
 
   RED(const RED&) = delete;
   RED& operator=(const RED&) = delete;
@@ -0,0 +1,353 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "llvm/ADT/StringRef.h"
+#include "regexp.h"
+
+namespace redgrep {
+
+// The corpus of patterns. Each benchmark takes an index into this array.
+static constexpr const char* kPatterns[] = {
+    // literal
+    "hello",
+    // alternation
+    "foo|bar|baz|qux|quux",
+    // conjunction and complement
+    ".*a.*&!(.*b.*)",
+    // counted repetition
+    "(ab){2,5}c",
+    // Unicode character class
+    "[αβγδεζηθ]+",
+    // typical grep usage
+    ".*(error|warn).*",
+    // typical grep usage with a conjunction and a complement
+    ".*(error|warn).*&!(.*ok.*)",
+};
+
+static constexpr int kNumPatterns = sizeof kPatterns / sizeof kPatterns[0];
+
+// Returns size bytes of text, mostly ASCII with some Greek for good measure.
+// Lines have words_per_line words on average. The text is deterministic so
+// that runs are comparable.
+static std::string Text(size_t size, int words_per_line = 8) {
+  static constexpr const char* kWords[] = {
+      "hello", "foo", "bar", "ab", "abab", "error", "warn", "αβγ", "ζηθ",
+      "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+  };
+  std::minstd_rand rand(20120101);
+  std::string text;
+  while (text.size() < size) {
+    text += kWords[rand() % (sizeof kWords / sizeof kWords[0])];
+    text += rand() % words_per_line == 0 ? '\n' : ' ';
+  }
+  text.resize(size);
+  return text;
+}
+
+// Splits text into lines, each including its newline (if any).
+static std::vector<llvm::StringRef> Lines(llvm::StringRef text) {
+  std::vector<llvm::StringRef> lines;
+  while (!text.empty()) {
+    llvm::StringRef line = text.split('\n').first;
+    line = text.take_front(line.size() + 1);
+    text = text.drop_front(line.size());
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+static void SetUp(benchmark::State& state, Exp* exp) {
+  const char* pattern = kPatterns[state.range(0)];
+  state.SetLabel(pattern);
+  if (!Parse(pattern, exp)) {
+    state.SkipWithError("parse error");
+  }
+}
+
+// As above, but also outputs the modes and the captures for the TNFA.
+// Returns false if the pattern failed to parse.
+static bool SetUp(benchmark::State& state, Exp* exp, TNFA* tnfa) {
+  const char* pattern = kPatterns[state.range(0)];
+  state.SetLabel(pattern);
+  if (!Parse(pattern, exp, &tnfa->modes_, &tnfa->captures_)) {
+    state.SkipWithError("parse error");
+    return false;
+  }
+  return true;
+}
+
+static void BM_Parse(benchmark::State& state) {
+  const char* pattern = kPatterns[state.range(0)];
+  state.SetLabel(pattern);
+  for (auto _ : state) {
+    Exp exp;
+    benchmark::DoNotOptimize(Parse(pattern, &exp));
+  }
+}
+BENCHMARK(BM_Parse)->DenseRange(0, kNumPatterns - 1);
+
+static void BM_Compile_DFA(benchmark::State& state) {
+  Exp exp;
+  SetUp(state, &exp);
+  size_t nstates = 0;
+  for (auto _ : state) {
+    DFA dfa;
+    nstates = Compile(exp, &dfa);
+  }
+  state.counters["states"] = nstates;
+}
+BENCHMARK(BM_Compile_DFA)->DenseRange(0, kNumPatterns - 1);
+
+static void BM_Compile_TNFA(benchmark::State& state) {
+  const char* pattern = kPatterns[state.range(0)];
+  state.SetLabel(pattern);
+  size_t nstates = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    Exp exp;
+    TNFA tnfa;
+    bool ok = Parse(pattern, &exp, &tnfa.modes_, &tnfa.captures_);
+    state.ResumeTiming();
+    if (!ok) {
+      state.SkipWithError("parse error");
+      break;
+    }
+    nstates = Compile(exp, &tnfa);
+  }
+  state.counters["states"] = nstates;
+}
+BENCHMARK(BM_Compile_TNFA)->DenseRange(0, kNumPatterns - 1);
+
+static void BM_Compile_Fun(benchmark::State& state) {
+  Exp exp;
+  SetUp(state, &exp);
+  DFA dfa;
+  Compile(exp, &dfa);
+  size_t nbytes = 0;
+  for (auto _ : state) {
+    Fun fun;
+    fun.opt_level_ = static_cast<OptLevel>(state.range(1));
+    nbytes = Compile(dfa, &fun);
+  }
+  state.counters["bytes"] = nbytes;
+}
+BENCHMARK(BM_Compile_Fun)
+    ->ArgsProduct({benchmark::CreateDenseRange(0, kNumPatterns - 1, 1),
+                   {kOptNone, kOptMinimal, kOptDefault, kOptAggressive}})
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_Compile_Table(benchmark::State& state) {
+  Exp exp;
+  SetUp(state, &exp);
+  DFA dfa;
+  Compile(exp, &dfa);
+  size_t nbytes = 0;
+  int nclasses = 0;
+  for (auto _ : state) {
+    Table table;
+    nbytes = Compile(dfa, &table);
+    nclasses = table.nclasses_;
+  }
+  state.counters["bytes"] = nbytes;
+  state.counters["classes"] = nclasses;
+}
+BENCHMARK(BM_Compile_Table)->DenseRange(0, kNumPatterns - 1);
+
+// Matching is anchored, so the Match benchmarks match each line in turn, as
+// grep would; matching the text as a whole would mostly measure early exits.
+// The interpreters are slow, so give them much less text.
+static constexpr size_t kSmallText = 1 << 10;
+static constexpr size_t kLargeText = 1 << 20;
+
+static void BM_Match_Exp(benchmark::State& state) {
+  Exp exp;
+  SetUp(state, &exp);
+  std::string text = Text(kSmallText);
+  std::vector<llvm::StringRef> lines = Lines(text);
+  for (auto _ : state) {
+    for (llvm::StringRef line : lines) {
+      benchmark::DoNotOptimize(Match(exp, line));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_Match_Exp)->DenseRange(0, kNumPatterns - 1);
+
+static void BM_Match_DFA(benchmark::State& state) {
+  Exp exp;
+  SetUp(state, &exp);
+  DFA dfa;
+  Compile(exp, &dfa);
+  std::string text = Text(kSmallText);
+  std::vector<llvm::StringRef> lines = Lines(text);
+  for (auto _ : state) {
+    for (llvm::StringRef line : lines) {
+      benchmark::DoNotOptimize(Match(dfa, line));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_Match_DFA)->DenseRange(0, kNumPatterns - 1);
+
+static void BM_Match_TNFA(benchmark::State& state) {
+  Exp exp;
+  TNFA tnfa;
+  if (!SetUp(state, &exp, &tnfa)) {
+    return;
+  }
+  Compile(exp, &tnfa);
+  std::string text = Text(kSmallText);
+  std::vector<int> offsets;
+  std::vector<llvm::StringRef> lines = Lines(text);
+  for (auto _ : state) {
+    for (llvm::StringRef line : lines) {
+      benchmark::DoNotOptimize(Match(tnfa, line, &offsets));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_Match_TNFA)->DenseRange(0, kNumPatterns - 1);
+
+static void BM_Match_Fun(benchmark::State& state) {
+  Exp exp;
+  SetUp(state, &exp);
+  DFA dfa;
+  Compile(exp, &dfa);
+  Fun fun;
+  Compile(dfa, &fun);
+  std::string text = Text(kLargeText);
+  std::vector<llvm::StringRef> lines = Lines(text);
+  for (auto _ : state) {
+    for (llvm::StringRef line : lines) {
+      benchmark::DoNotOptimize(Match(fun, line));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_Match_Fun)->DenseRange(0, kNumPatterns - 1);
+
+static void BM_Match_Fun_Unrolled(benchmark::State& state) {
+  Exp exp;
+  SetUp(state, &exp);
+  DFA dfa;
+  Compile(exp, &dfa);
+  Fun fun;
+  fun.unroll_ = state.range(1);
+  size_t nbytes = Compile(dfa, &fun);
+  std::string text = Text(kLargeText);
+  std::vector<llvm::StringRef> lines = Lines(text);
+  for (auto _ : state) {
+    for (llvm::StringRef line : lines) {
+      benchmark::DoNotOptimize(Match(fun, line));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+  state.counters["bytes"] = nbytes;
+}
+BENCHMARK(BM_Match_Fun_Unrolled)
+    ->ArgsProduct({benchmark::CreateDenseRange(0, kNumPatterns - 1, 1),
+                   {2, 4, 8}});
+
+static void BM_Match_Fun_Guided(benchmark::State& state) {
+  Exp exp;
+  SetUp(state, &exp);
+  DFA dfa;
+  Compile(exp, &dfa);
+  Table table;
+  Compile(dfa, &table);
+  std::string text = Text(kLargeText);
+  std::vector<llvm::StringRef> lines = Lines(text);
+  // Warm up using the table interpreter, then compile using the profile.
+  Profile profile;
+  for (llvm::StringRef line : lines) {
+    Match(table, line, &profile);
+  }
+  Fun fun;
+  fun.guide_ = &profile;
+  Compile(dfa, &fun);
+  for (auto _ : state) {
+    for (llvm::StringRef line : lines) {
+      benchmark::DoNotOptimize(Match(fun, line));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_Match_Fun_Guided)->DenseRange(0, kNumPatterns - 1);
+
+// The Table benchmarks also take the average number of words per line: the
+// batch interpreter should win by more as the lines get longer.
+static void BM_Match_Table(benchmark::State& state) {
+  Exp exp;
+  SetUp(state, &exp);
+  DFA dfa;
+  Compile(exp, &dfa);
+  Table table;
+  Compile(dfa, &table);
+  std::string text = Text(kLargeText, state.range(1));
+  std::vector<llvm::StringRef> lines = Lines(text);
+  for (auto _ : state) {
+    for (llvm::StringRef line : lines) {
+      benchmark::DoNotOptimize(Match(table, line));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_Match_Table)
+    ->ArgsProduct({benchmark::CreateDenseRange(0, kNumPatterns - 1, 1),
+                   {8, 64}});
+
+static void BM_Match_Table_Batch(benchmark::State& state) {
+  Exp exp;
+  SetUp(state, &exp);
+  DFA dfa;
+  Compile(exp, &dfa);
+  Table table;
+  Compile(dfa, &table);
+  std::string text = Text(kLargeText, state.range(1));
+  std::vector<llvm::StringRef> strs = Lines(text);
+  std::vector<bool> matches;
+  for (auto _ : state) {
+    Match(table, strs, &matches);
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_Match_Table_Batch)
+    ->ArgsProduct({benchmark::CreateDenseRange(0, kNumPatterns - 1, 1),
+                   {8, 64}});
+
+static void BM_Scan(benchmark::State& state) {
+  Exp exp;
+  SetUp(state, &exp);
+  DFA dfa;
+  Compile(exp, &dfa);
+  Table table;
+  Compile(dfa, &table);
+  std::string text = Text(kLargeText);
+  std::vector<llvm::StringRef> lines;
+  for (auto _ : state) {
+    lines.clear();
+    Scan(table, text, &lines);
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_Scan)->DenseRange(0, kNumPatterns - 1);
+
+}  // namespace redgrep
@@ -14,12 +14,23 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "llvm/ADT/StringRef.h"
 #include "redgrep.h"
@@ -29,10 +40,14 @@ static constexpr char kUsage[] =
   "\n"
   "Options:\n"
   "\n"
+  "  -i  ignore case distinctions\n"
+  "  -U  match bytes rather than UTF-8 characters (in the pattern too)\n"
   "  -v  select non-matching lines\n"
   "  -n  print line number with output lines\n"
   "  -H  print the file name for each match\n"
   "  -h  suppress the file name prefix on output\n"
+  "  -j N  use N threads to grep files (or chunks of a file) concurrently\n"
+  "  -S  print statistics about compiling REGEXP to standard error\n"
   "\n"
   "Similar to the way in which find(1) lets you construct expressions,\n"
   "REGEXP may comprise multiple subexpressions as separate arguments:\n"
@@ -52,20 +67,262 @@ static constexpr char kUsage[] =
   "line and may end with `$' in order to anchor it to the end of the line.\n"
   "\n";
 
+// Calls work(i) for each i in [0, n) using up to jobs threads and calls done(i)
+// for each i in order on this thread as soon as work(i) has returned. The
+// threads take the next i as and when they are ready for it.
+template <typename Work, typename Done>
+static void ParallelFor(int n, int jobs, const Work& work, const Done& done) {
+  if (jobs == 1 || n == 1) {
+    for (int i = 0; i < n; ++i) {
+      work(i);
+      done(i);
+    }
+    return;
+  }
+  std::vector<bool> finished(n, false);
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::atomic<int> next(0);
+  std::vector<std::thread> workers;
+  for (int j = 0; j < std::min(jobs, n); ++j) {
+    workers.emplace_back([&]() {
+      for (int i = next++; i < n; i = next++) {
+        work(i);
+        std::lock_guard<std::mutex> lock(mutex);
+        finished[i] = true;
+        cond.notify_one();
+      }
+    });
+  }
+  for (int i = 0; i < n; ++i) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [&finished, i]() -> bool { return finished[i]; });
+    }
+    done(i);
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+// Represents the outcome of grepping a file.
+struct Result {
+  Result() : matched(false), error(0) {}
+
+  bool matched;
+  int error;
+  std::string output;
+};
+
+// Represents the matching lines in a chunk of a file.
+struct Chunk {
+  llvm::StringRef str;
+  std::vector<llvm::StringRef> lines;
+  std::vector<size_t> numbers;  // Relative to the beginning of the chunk.
+  size_t newlines;
+};
+
+// The size of the chunks that the threads scan. Smaller inputs aren't split.
+static constexpr size_t kChunkSize = 8 << 20;
+
+// Greps the file named file (or stdin if file is "-") using re. Large inputs
+// are split into chunks at newline boundaries, which up to jobs threads scan.
+// If stream is non-null, writes the matching lines to stream as we go, straight
+// from the buffer. Otherwise, appends them to result->output.
+static void GrepFile(const RED& re, const char* file, int jobs,
+                     bool with_filename, bool line_number,
+                     FILE* stream, Result* result) {
+  bool file_is_stdin = (file[0] == '-' &&
+                        file[1] == '\0');
+  const char* name = (file_is_stdin
+                      ? "(standard input)"
+                      : file);
+  std::string& output = result->output;
+  size_t n = 1;
+  // Outputs the matching lines in str, which must comprise complete lines.
+  // The line numbers are counted per chunk, then summed in order: n is the
+  // number of the first line.
+  auto Grep = [&](llvm::StringRef str) {
+    std::vector<Chunk> chunks;
+    while (!str.empty()) {
+      size_t size = str.size();
+      if (jobs > 1 && size > kChunkSize) {
+        size = str.find('\n', kChunkSize - 1) + 1;
+        if (size == 0) {
+          size = str.size();
+        }
+      }
+      chunks.emplace_back();
+      chunks.back().str = str.take_front(size);
+      str = str.drop_front(size);
+    }
+    auto Work = [&chunks, &re, line_number](int i) {
+      Chunk& chunk = chunks[i];
+      RED::Scan(chunk.str, re, &chunk.lines);
+      if (line_number) {
+        const char* counted = chunk.str.data();
+        size_t newlines = 0;
+        for (llvm::StringRef line : chunk.lines) {
+          newlines += std::count(counted, line.data(), '\n');
+          counted = line.data();
+          chunk.numbers.push_back(newlines);
+        }
+        newlines += std::count(counted, chunk.str.data() + chunk.str.size(),
+                               '\n');
+        chunk.newlines = newlines;
+      }
+    };
+    auto Done = [&](int i) {
+      Chunk& chunk = chunks[i];
+      for (size_t j = 0; j < chunk.lines.size(); ++j) {
+        llvm::StringRef line = chunk.lines[j];
+        result->matched = true;
+        if (stream != nullptr) {
+          if (with_filename) {
+            fprintf(stream, "%s:", name);
+          }
+          if (line_number) {
+            fprintf(stream, "%zu:", n + chunk.numbers[j]);
+          }
+          fwrite(line.data(), 1, line.size(), stream);
+          continue;
+        }
+        if (with_filename) {
+          output += name;
+          output += ':';
+        }
+        if (line_number) {
+          output += std::to_string(n + chunk.numbers[j]);
+          output += ':';
+        }
+        output.append(line.data(), line.size());
+      }
+      if (line_number) {
+        n += chunk.newlines;
+      }
+      // Release the memory now rather than later.
+      std::vector<llvm::StringRef>().swap(chunk.lines);
+    };
+    ParallelFor(chunks.size(), jobs, Work, Done);
+  };
+  // GNU grep lets you specify "-" more than once. We don't close stdin, so
+  // subsequent reads will simply hit the end of the file.
+  int fd = (file_is_stdin
+            ? STDIN_FILENO
+            : open(file, O_RDONLY));
+  if (fd == -1) {
+    result->error = errno;
+    return;
+  }
+  // Regular files are mapped and scanned in place. Anything else is read in
+  // large, page-aligned blocks, carrying any incomplete line at the end of a
+  // block over to the next block. We keep reading into a block for as long as
+  // more input is ready, so that with more than one thread, the block can be
+  // split into a chunk per thread (up to the number of CPUs). As soon as we
+  // would have to wait, whatever has been read is scanned, which keeps the
+  // output flowing from a pipe.
+  struct stat st;
+  off_t offset;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      (offset = lseek(fd, 0, SEEK_CUR)) != -1 && offset < st.st_size) {
+    size_t size = st.st_size;
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      madvise(addr, size, MADV_SEQUENTIAL);
+      llvm::StringRef str(static_cast<const char*>(addr), size);
+      Grep(str.drop_front(offset));
+      munmap(addr, size);
+      lseek(fd, 0, SEEK_END);
+      if (!file_is_stdin) {
+        close(fd);
+      }
+      return;
+    }
+  }
+  static constexpr size_t kPageSize = 4096;
+  static constexpr size_t kBlockSize = 1 << 20;
+  size_t block_size = kBlockSize;
+  if (jobs > 1) {
+    size_t ncpus = std::max(std::thread::hardware_concurrency(), 1u);
+    block_size = std::min<size_t>(jobs, ncpus) * kChunkSize;
+  }
+  size_t capacity = block_size;
+  char* data = static_cast<char*>(aligned_alloc(kPageSize, capacity));
+  if (data == nullptr) {
+    err(2, "aligned_alloc");
+  }
+  size_t len = 0;
+  for (;;) {
+    if (len == capacity) {
+      // Grow the buffer for an incredibly long line.
+      capacity *= 2;
+      char* tmp = static_cast<char*>(aligned_alloc(kPageSize, capacity));
+      if (tmp == nullptr) {
+        err(2, "aligned_alloc");
+      }
+      memcpy(tmp, data, len);
+      free(data);
+      data = tmp;
+    }
+    ssize_t nread = read(fd, data + len, capacity - len);
+    if (nread == -1 && errno == EINTR) {
+      continue;
+    }
+    if (nread == -1) {
+      result->error = errno;
+    }
+    if (nread <= 0) {
+      // Scan the last line even if it didn't end with a newline.
+      Grep(llvm::StringRef(data, len));
+      break;
+    }
+    len += nread;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (len < block_size && poll(&pfd, 1, 0) == 1) {
+      continue;
+    }
+    // Scan only complete lines.
+    const void* ptr = memrchr(data, '\n', len);
+    if (ptr == nullptr) {
+      continue;
+    }
+    size_t size = reinterpret_cast<const char*>(ptr) - data + 1;
+    Grep(llvm::StringRef(data, size));
+    // Move the incomplete line (if any) to the beginning.
+    memmove(data, data + size, len - size);
+    len -= size;
+  }
+  free(data);
+  if (!file_is_stdin) {
+    close(fd);
+  }
+}
+
 int main(int argc, char** argv) {
   // Parse options.
+  bool opt_ignore_case = false;
+  bool opt_latin1 = false;
   bool opt_invert_match = false;
   bool opt_line_number = false;
+  int opt_jobs = 1;
+  bool opt_stats = false;
   enum {
     kAlways, kMaybe, kNever,
   } opt_with_filename = kMaybe;
   bool escape = false;
   while (!escape) {
-    int opt = getopt(argc, argv, "+vnHhe:");
+    int opt = getopt(argc, argv, "+iUvnHhj:Se:");
     if (opt == -1) {
       break;
     }
     switch (opt) {
+      case 'i':
+        opt_ignore_case = true;
+        break;
+      case 'U':
+        opt_latin1 = true;
+        break;
       case 'v':
         opt_invert_match = true;
         break;
@@ -78,6 +335,15 @@ int main(int argc, char** argv) {
       case 'h':
         opt_with_filename = kNever;
         break;
+      case 'j':
+        opt_jobs = atoi(optarg);
+        if (opt_jobs < 1) {
+          errx(2, "invalid number of jobs");
+        }
+        break;
+      case 'S':
+        opt_stats = true;
+        break;
       case 'e':
         argv[--optind] = optarg;
         escape = true;
@@ -163,11 +429,24 @@ int main(int argc, char** argv) {
     re_str = "!(" + re_str + ")";
   }
 
-  RED re(re_str);
+  int flags = redgrep::kParseDefault;
+  if (opt_ignore_case) {
+    flags |= redgrep::kFoldCase;
+  }
+  if (opt_latin1) {
+    flags |= redgrep::kLatin1;
+  }
+  RED re(re_str, flags);
   if (!re.ok()) {
     errx(2, "parse error");
   }
 
+  if (opt_stats) {
+    std::string str;
+    redgrep::Dump(re.stats(), &str);
+    fwrite(str.data(), 1, str.size(), stderr);
+  }
+
   // Parse files.
   char const *const *files = argv;
   int nfiles = argc;
@@ -178,44 +457,52 @@ int main(int argc, char** argv) {
   }
 
   // Grep!
+  bool with_filename = (opt_with_filename == kAlways ||
+                        (opt_with_filename == kMaybe && nfiles > 1));
   bool matched = false;
-  char* data = nullptr;
-  size_t size = 0;
-  for (int i = 0; i < nfiles; ++i) {
-    bool file_is_stdin = (files[i][0] == '-' &&
-                          files[i][1] == '\0');
-    FILE* file = (file_is_stdin
-                  // GNU grep lets you specify "-" more than once. To emulate
-                  // this, we dup stdin here so that we don't close it later.
-                  ? fdopen(dup(fileno(stdin)), "r")
-                  : fopen(files[i], "r"));
-    if (file == nullptr) {
+  auto Report = [&matched, &files](int i, const Result& result) {
+    if (result.error != 0) {
+      errno = result.error;
       warn("%s", files[i]);
-      continue;
     }
-    for (int n = 1;; ++n) {
-      ssize_t len = getline(&data, &size, file);
-      if (len == -1) {
+    matched |= result.matched;
+  };
+  if (nfiles == 1) {
+    // Use the threads to scan chunks of the file instead.
+    Result result;
+    GrepFile(re, files[0], opt_jobs, with_filename, opt_line_number, stdout,
+             &result);
+    Report(0, result);
+  } else {
+    // Unless the threads would grep files concurrently, output as we go.
+    // Otherwise, the output is buffered per file and written out in order.
+    std::vector<Result> results(nfiles);
+    FILE* stream = opt_jobs == 1 ? stdout : nullptr;
+    // When grepping files concurrently, only the first "-" reads stdin; any
+    // others would hit the end of the file anyway, but this way they can't
+    // race with the first one.
+    int first_stdin = -1;
+    for (int i = 0; i < nfiles; ++i) {
+      if (strcmp(files[i], "-") == 0) {
+        first_stdin = i;
         break;
       }
-      llvm::StringRef str(data, len);
-      if (RED::FullMatch(str, re)) {
-        matched = true;
-        if (opt_with_filename == kAlways ||
-            (opt_with_filename == kMaybe && nfiles > 1)) {
-          printf("%s:", (file_is_stdin
-                         ? "(standard input)"
-                         : files[i]));
-        }
-        if (opt_line_number) {
-          printf("%d:", n);
-        }
-        printf("%.*s", static_cast<int>(len), data);
-      }
     }
-    fclose(file);
+    auto Work = [&](int i) {
+      if (opt_jobs == 1 || strcmp(files[i], "-") != 0 || i == first_stdin) {
+        GrepFile(re, files[i], 1, with_filename, opt_line_number, stream,
+                 &results[i]);
+      }
+    };
+    auto Done = [&](int i) {
+      const std::string& output = results[i].output;
+      fwrite(output.data(), 1, output.size(), stdout);
+      Report(i, results[i]);
+      // Release the memory now rather than later.
+      std::string().swap(results[i].output);
+    };
+    ParallelFor(nfiles, opt_jobs, Work, Done);
   }
-  free(data);
 
   // As per GNU grep, "The exit status is 0 if selected lines are found, and 1
   // if not found. If an error occurred the exit status is 2."
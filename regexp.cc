@@ -14,24 +14,35 @@
 
 #include "regexp.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
+#include <algorithm>
+#include <atomic>
 #include <bitset>
+#include <chrono>
+#include <initializer_list>
 #include <list>
 #include <map>
 #include <mutex>
 #include <set>
+#include <string>
 #include <tuple>
 #include <utility>
 #include <vector>
 
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/MCJIT.h"
 #include "llvm/ExecutionEngine/RuntimeDyld.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
@@ -40,68 +51,154 @@
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/MC/TargetRegistry.h"
 #include "llvm/Object/Binary.h"
 #include "llvm/Object/ObjectFile.h"
 #include "llvm/Object/SymbolSize.h"
 #include "llvm/Object/SymbolicFile.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/Casting.h"
+#include "llvm/Support/CodeGen.h"
 #include "llvm/Support/ErrorOr.h"
 #include "llvm/Support/Host.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
 #include "parser.tab.hh"
+#include "unicode_casefold.h"
 #include "utf.h"
 
 namespace redgrep {
 
 #define CAST_TO_INTPTR_T(ptr) reinterpret_cast<intptr_t>(ptr)
 
+// The number of Expression nodes constructed on this thread less the number
+// destroyed on this thread, for CompileStats. Each stage samples the change
+// since it began, which is what it is keeping alive. It is signed because an
+// Expression may be destroyed on a different thread from the one on which it
+// was constructed.
+static thread_local ptrdiff_t live_expressions = 0;
+
+// Returns kinds() for an expression of kind with subexpressions.
+static int KindsOf(Kind kind, const std::list<Exp>& subexpressions) {
+  int kinds = 1 << kind;
+  for (const Exp& sub : subexpressions) {
+    kinds |= sub->kinds();
+  }
+  return kinds;
+}
+
 Expression::Expression(Kind kind)
     : kind_(kind),
       data_(0),
-      norm_(true) {}
+      norm_(true),
+      kinds_(1 << kind) {
+  ++live_expressions;
+}
 
 Expression::Expression(Kind kind, const std::tuple<int, Exp, Mode, bool>& group)
     : kind_(kind),
       data_(CAST_TO_INTPTR_T((new std::tuple<int, Exp, Mode, bool>(group)))),
-      norm_(false) {}
+      norm_(false),
+      kinds_(1 << kind | std::get<1>(group)->kinds()) {
+  ++live_expressions;
+}
 
 Expression::Expression(Kind kind, int byte)
     : kind_(kind),
       data_(byte),
-      norm_(true) {}
+      norm_(true),
+      kinds_(1 << kind) {
+  ++live_expressions;
+}
 
 Expression::Expression(Kind kind, const std::pair<int, int>& byte_range)
     : kind_(kind),
       data_(CAST_TO_INTPTR_T((new std::pair<int, int>(byte_range)))),
-      norm_(true) {}
+      norm_(true),
+      kinds_(1 << kind) {
+  ++live_expressions;
+}
 
 Expression::Expression(Kind kind, const std::list<Exp>& subexpressions, bool norm)
     : kind_(kind),
       data_(CAST_TO_INTPTR_T((new std::list<Exp>(subexpressions)))),
-      norm_(norm) {}
+      norm_(norm),
+      kinds_(KindsOf(kind, subexpressions)) {
+  ++live_expressions;
+}
 
-Expression::Expression(Kind kind, const std::pair<std::set<Rune>, bool>& character_class)
+Expression::Expression(Kind kind,
+                       const std::pair<RuneRanges, bool>& character_class)
     : kind_(kind),
-      data_(CAST_TO_INTPTR_T((new std::pair<std::set<Rune>, bool>(character_class)))),
-      norm_(false) {}
+      data_(CAST_TO_INTPTR_T(
+          (new std::pair<RuneRanges, bool>(character_class)))),
+      norm_(false),
+      kinds_(1 << kind) {
+  ++live_expressions;
+}
 
-Expression::Expression(Kind kind, const std::tuple<Exp, int, int>& quantifier)
+Expression::Expression(Kind kind, const std::tuple<Exp, int, int>& quantifier,
+                       bool norm)
     : kind_(kind),
       data_(CAST_TO_INTPTR_T((new std::tuple<Exp, int, int>(quantifier)))),
-      norm_(false) {}
+      norm_(norm),
+      kinds_(1 << kind | std::get<0>(quantifier)->kinds()) {
+  ++live_expressions;
+}
+
+// The subexpressions that the outermost ~Expression() on this thread has yet
+// to release, or nullptr if there is no such ~Expression(). Releasing them one
+// at a time means that destroying a deep expression (e.g. the Concatenations
+// for a long literal) does not recurse once per level.
+static thread_local std::vector<Exp>* pending_release = nullptr;
+
+// Defers releasing sub if that would destroy an expression that has
+// subexpressions of its own. Otherwise, leaves sub to be released as usual.
+static inline void DeferRelease(Exp* sub) {
+  if (sub->use_count() != 1) {
+    return;
+  }
+  switch ((*sub)->kind()) {
+    case kGroup:
+    case kKleeneClosure:
+    case kConcatenation:
+    case kComplement:
+    case kConjunction:
+    case kDisjunction:
+    case kQuantifier:
+      pending_release->push_back(std::move(*sub));
+      break;
+
+    default:
+      break;
+  }
+}
 
 Expression::~Expression() {
+  --live_expressions;
+  std::vector<Exp> pending;
+  bool outermost = pending_release == nullptr;
+  if (outermost) {
+    pending_release = &pending;
+  }
   switch (kind()) {
     case kEmptySet:
     case kEmptyString:
       break;
 
-    case kGroup:
-      delete reinterpret_cast<std::tuple<int, Exp, Mode, bool>*>(data());
+    case kGroup: {
+      auto* group = reinterpret_cast<std::tuple<int, Exp, Mode, bool>*>(data());
+      DeferRelease(&std::get<1>(*group));
+      delete group;
       break;
+    }
 
     case kAnyByte:
       break;
@@ -117,17 +214,35 @@ Expression::~Expression() {
     case kConcatenation:
     case kComplement:
     case kConjunction:
-    case kDisjunction:
-      delete reinterpret_cast<std::list<Exp>*>(data());
+    case kDisjunction: {
+      auto* subexpressions = reinterpret_cast<std::list<Exp>*>(data());
+      for (Exp& sub : *subexpressions) {
+        DeferRelease(&sub);
+      }
+      delete subexpressions;
       break;
+    }
 
     case kCharacterClass:
-      delete reinterpret_cast<std::pair<std::set<Rune>, bool>*>(data());
+      delete reinterpret_cast<std::pair<RuneRanges, bool>*>(data());
       break;
 
-    case kQuantifier:
-      delete reinterpret_cast<std::tuple<Exp, int, int>*>(data());
+    case kQuantifier: {
+      auto* quantifier = reinterpret_cast<std::tuple<Exp, int, int>*>(data());
+      DeferRelease(&std::get<0>(*quantifier));
+      delete quantifier;
       break;
+    }
+  }
+  if (outermost) {
+    while (!pending.empty()) {
+      // This might destroy the last reference, which would then push the
+      // subexpressions of that Expression onto pending.
+      Exp sub = std::move(pending.back());
+      pending.pop_back();
+      sub.reset();
+    }
+    pending_release = nullptr;
   }
 }
 
@@ -147,89 +262,141 @@ const std::list<Exp>& Expression::subexpressions() const {
   return *reinterpret_cast<std::list<Exp>*>(data());
 }
 
-const std::pair<std::set<Rune>, bool>& Expression::character_class() const {
-  return *reinterpret_cast<std::pair<std::set<Rune>, bool>*>(data());
+const std::pair<RuneRanges, bool>& Expression::character_class() const {
+  return *reinterpret_cast<std::pair<RuneRanges, bool>*>(data());
 }
 
 const std::tuple<Exp, int, int>& Expression::quantifier() const {
   return *reinterpret_cast<std::tuple<Exp, int, int>*>(data());
 }
 
-int Expression::Compare(Exp x, Exp y) {
-  if (x->kind() < y->kind()) {
+// Returns -1, 0 or +1 when x is less than, equal to or greater than y.
+template <typename T>
+static inline int CompareValues(const T& x, const T& y) {
+  if (x < y) {
     return -1;
   }
-  if (x->kind() > y->kind()) {
+  if (x > y) {
     return +1;
   }
-  switch (x->kind()) {
-    case kEmptySet:
-    case kEmptyString:
-      return 0;
-
-    case kGroup:
-      if (x->group() < y->group()) {
-        return -1;
-      }
-      if (x->group() > y->group()) {
-        return +1;
-      }
-      return 0;
+  return 0;
+}
 
-    case kAnyByte:
-      return 0;
+int Expression::Compare(Exp x, Exp y) {
+  // Compare iteratively so that deep expressions do not overflow the stack.
+  // Each item is either a pair of expressions to compare or, if x is nullptr,
+  // the (nonzero) result to return if everything before it compared equal.
+  struct Item {
+    const Expression* x;
+    const Expression* y;
+    int result;
+  };
+  llvm::SmallVector<Item, 16> stack;
+  stack.push_back({x.get(), y.get(), 0});
+  while (!stack.empty()) {
+    Item item = stack.pop_back_val();
+    if (item.x == nullptr) {
+      return item.result;
+    }
+    // Interned expressions are shared, so this is often the case.
+    if (item.x == item.y) {
+      continue;
+    }
+    int compare = CompareValues(item.x->kind(), item.y->kind());
+    if (compare != 0) {
+      return compare;
+    }
+    switch (item.x->kind()) {
+      case kEmptySet:
+      case kEmptyString:
+        break;
 
-    case kByte:
-      if (x->byte() < y->byte()) {
-        return -1;
-      }
-      if (x->byte() > y->byte()) {
-        return +1;
+      case kGroup: {
+        // Compare the number, then the subexpression, then the rest.
+        const auto& xgroup = item.x->group();
+        const auto& ygroup = item.y->group();
+        compare = CompareValues(std::get<0>(xgroup), std::get<0>(ygroup));
+        if (compare != 0) {
+          return compare;
+        }
+        int compare_rest =
+            CompareValues(std::make_pair(std::get<2>(xgroup),
+                                         std::get<3>(xgroup)),
+                          std::make_pair(std::get<2>(ygroup),
+                                         std::get<3>(ygroup)));
+        if (compare_rest != 0) {
+          stack.push_back({nullptr, nullptr, compare_rest});
+        }
+        stack.push_back({std::get<1>(xgroup).get(),
+                         std::get<1>(ygroup).get(), 0});
+        break;
       }
-      return 0;
 
-    case kByteRange:
-      if (x->byte_range() < y->byte_range()) {
-        return -1;
-      }
-      if (x->byte_range() > y->byte_range()) {
-        return +1;
-      }
-      return 0;
+      case kAnyByte:
+        break;
 
-    case kKleeneClosure:
-    case kConcatenation:
-    case kComplement:
-    case kConjunction:
-    case kDisjunction: {
-      // Perform a lexicographical compare.
-      std::list<Exp>::const_iterator xi = x->subexpressions().begin();
-      std::list<Exp>::const_iterator yi = y->subexpressions().begin();
-      while (xi != x->subexpressions().end() &&
-             yi != y->subexpressions().end()) {
-        int compare = Compare(*xi, *yi);
+      case kByte:
+        compare = CompareValues(item.x->byte(), item.y->byte());
         if (compare != 0) {
           return compare;
         }
-        ++xi;
-        ++yi;
-      }
-      if (xi == x->subexpressions().end() &&
-          yi != y->subexpressions().end()) {
-        return -1;
+        break;
+
+      case kByteRange:
+        compare = CompareValues(item.x->byte_range(), item.y->byte_range());
+        if (compare != 0) {
+          return compare;
+        }
+        break;
+
+      case kKleeneClosure:
+      case kConcatenation:
+      case kComplement:
+      case kConjunction:
+      case kDisjunction: {
+        // Perform a lexicographical compare: the pairs of subexpressions in
+        // order and then, if they all compare equal, the sizes.
+        const std::list<Exp>& xsubs = item.x->subexpressions();
+        const std::list<Exp>& ysubs = item.y->subexpressions();
+        int compare_size = CompareValues(xsubs.size(), ysubs.size());
+        if (compare_size != 0) {
+          stack.push_back({nullptr, nullptr, compare_size});
+        }
+        auto xi = xsubs.rbegin();
+        auto yi = ysubs.rbegin();
+        if (xsubs.size() > ysubs.size()) {
+          std::advance(xi, xsubs.size() - ysubs.size());
+        } else {
+          std::advance(yi, ysubs.size() - xsubs.size());
+        }
+        for (; xi != xsubs.rend(); ++xi, ++yi) {
+          stack.push_back({xi->get(), yi->get(), 0});
+        }
+        break;
       }
-      if (xi != x->subexpressions().end() &&
-          yi == y->subexpressions().end()) {
-        return +1;
+
+      case kCharacterClass:
+        abort();
+
+      case kQuantifier: {
+        // Compare the subexpression, then the repetition.
+        const auto& xquantifier = item.x->quantifier();
+        const auto& yquantifier = item.y->quantifier();
+        int compare_repetition =
+            CompareValues(std::make_pair(std::get<1>(xquantifier),
+                                         std::get<2>(xquantifier)),
+                          std::make_pair(std::get<1>(yquantifier),
+                                         std::get<2>(yquantifier)));
+        if (compare_repetition != 0) {
+          stack.push_back({nullptr, nullptr, compare_repetition});
+        }
+        stack.push_back({std::get<0>(xquantifier).get(),
+                         std::get<0>(yquantifier).get(), 0});
+        break;
       }
-      return 0;
     }
-
-    case kCharacterClass:
-    case kQuantifier:
-      break;
   }
-  abort();
+  return 0;
 }
 
 Exp EmptySet() {
@@ -247,9 +414,62 @@ Exp Group(const std::tuple<int, Exp, Mode, bool>& group) {
   return exp;
 }
 
+// An expression that is built and normalised once per process and then shared
+// by every pattern. Its partitions are computed once, on first use.
+struct Interned {
+  Exp exp;
+  std::once_flag once;
+  std::list<std::bitset<256>> partitions;
+};
+
+enum {
+  kInternedAnyByte,
+  kInternedAnyCharacter,
+  kNumInterned,
+};
+
+// InternedClass() registers the classes after the fixed entries, up to this
+// many entries in total. Once the table is full, classes are built afresh.
+static constexpr int kMaxInterned = 64;
+
+// The number of entries that have been registered. An entry is complete
+// before it is counted, so readers need not take a lock.
+static std::atomic<int> ninterned(kNumInterned);
+
+static Interned* InternedExpressions() {
+  static Interned* interned = [] {
+    Interned* interned = new Interned[kMaxInterned];
+    interned[kInternedAnyByte].exp = Exp(new Expression(kAnyByte));
+    Exp b1 = ByteRange(0x00, 0x7F);  // 0xxxxxxx
+    Exp bx = ByteRange(0x80, 0xBF);  // 10xxxxxx
+    Exp b2 = ByteRange(0xC2, 0xDF);  // 110xxxxx
+    Exp b3 = ByteRange(0xE0, 0xEF);  // 1110xxxx
+    Exp b4 = ByteRange(0xF0, 0xF4);  // 11110xxx
+    interned[kInternedAnyCharacter].exp =
+        Normalised(Disjunction(b1,
+                               Concatenation(b2, bx),
+                               Concatenation(b3, bx, bx),
+                               Concatenation(b4, bx, bx, bx)));
+    return interned;
+  }();
+  return interned;
+}
+
+// Returns the Interned for exp or nullptr if exp is not interned.
+// Note that this compares pointers, not values.
+static Interned* FindInterned(Exp exp) {
+  Interned* interned = InternedExpressions();
+  int n = ninterned.load(std::memory_order_acquire);
+  for (int i = 0; i < n; ++i) {
+    if (interned[i].exp.get() == exp.get()) {
+      return &interned[i];
+    }
+  }
+  return nullptr;
+}
+
 Exp AnyByte() {
-  Exp exp(new Expression(kAnyByte));
-  return exp;
+  return InternedExpressions()[kInternedAnyByte].exp;
 }
 
 Exp Byte(int byte) {
@@ -287,26 +507,18 @@ Exp Disjunction(const std::list<Exp>& subexpressions, bool norm) {
   return exp;
 }
 
-Exp CharacterClass(const std::pair<std::set<Rune>, bool>& character_class) {
+Exp CharacterClass(const std::pair<RuneRanges, bool>& character_class) {
   Exp exp(new Expression(kCharacterClass, character_class));
   return exp;
 }
 
-Exp Quantifier(const std::tuple<Exp, int, int>& quantifier) {
-  Exp exp(new Expression(kQuantifier, quantifier));
+Exp Quantifier(const std::tuple<Exp, int, int>& quantifier, bool norm) {
+  Exp exp(new Expression(kQuantifier, quantifier, norm));
   return exp;
 }
 
 Exp AnyCharacter() {
-  Exp b1 = ByteRange(0x00, 0x7F);  // 0xxxxxxx
-  Exp bx = ByteRange(0x80, 0xBF);  // 10xxxxxx
-  Exp b2 = ByteRange(0xC2, 0xDF);  // 110xxxxx
-  Exp b3 = ByteRange(0xE0, 0xEF);  // 1110xxxx
-  Exp b4 = ByteRange(0xF0, 0xF4);  // 11110xxx
-  return Disjunction(b1,
-                     Concatenation(b2, bx),
-                     Concatenation(b3, bx, bx),
-                     Concatenation(b4, bx, bx, bx));
+  return InternedExpressions()[kInternedAnyCharacter].exp;
 }
 
 Exp Character(Rune character) {
@@ -333,312 +545,680 @@ Exp Character(Rune character) {
   abort();
 }
 
-Exp Normalised(Exp exp) {
-  if (exp->norm()) {
-    return exp;
+Exp ByteClass(const RuneRanges& ranges, bool complement) {
+  std::bitset<256> bs;
+  for (const auto& range : ranges) {
+    for (Rune i = range.first; i <= range.second && i <= 0xFF; ++i) {
+      bs.set(i);
+    }
   }
-  switch (exp->kind()) {
-    case kEmptySet:
-    case kEmptyString:
-      return exp;
+  if (complement) {
+    bs.flip();
+  }
+  std::list<Exp> subs;
+  int i = 0;
+  while (i < 256) {
+    if (!bs.test(i)) {
+      ++i;
+      continue;
+    }
+    int j = i;
+    while (j + 1 < 256 && bs.test(j + 1)) {
+      ++j;
+    }
+    subs.push_back(i == j ? Byte(i) : ByteRange(i, j));
+    i = j + 1;
+  }
+  if (subs.empty()) {
+    return EmptySet();
+  }
+  if (subs.size() == 1) {
+    return subs.front();
+  }
+  return Disjunction(subs, false);
+}
 
-    case kGroup: {
-      int num; Exp sub; Mode mode; bool capture;
-      std::tie(num, sub, mode, capture) = exp->group();
-      sub = Normalised(sub);
-      if (sub->kind() == kEmptySet) {
-        return EmptySet();
+// The subexpressions of an expression, or the results for them, in order.
+typedef llvm::SmallVector<Exp, 2> Subexpressions;
+
+// Rewrites exp, which depends on subs, using an explicit stack rather than
+// recursion. See Rewrite() below.
+template <typename Rewriter>
+static Exp RewriteIteratively(Exp exp, Subexpressions subs,
+                              Rewriter* rewriter) {
+  struct Frame {
+    Exp exp;
+    Subexpressions subs;
+    size_t next = 0;
+    Subexpressions results;
+  };
+  llvm::SmallVector<Frame, 8> stack;
+  stack.emplace_back();
+  stack.back().exp = std::move(exp);
+  stack.back().subs = std::move(subs);
+  Exp result;
+  while (true) {
+    Frame* top = &stack.back();
+    if (result != nullptr) {
+      Exp cut = rewriter->Cut(top->exp, result);
+      if (cut != nullptr) {
+        result = cut;
+        stack.pop_back();
+        if (stack.empty()) {
+          return result;
+        }
+        continue;
       }
-      if (sub->kind() == kEmptyString) {
-        return EmptyString();
+      top->results.push_back(std::move(result));
+      result = nullptr;
+    }
+    if (top->next < top->subs.size()) {
+      Exp sub = std::move(top->subs[top->next++]);
+      Subexpressions subs;
+      result = rewriter->Enter(&sub, &subs);
+      if (result == nullptr) {
+        stack.emplace_back();
+        stack.back().exp = std::move(sub);
+        stack.back().subs = std::move(subs);
       }
-      return Group(num, sub, mode, capture);
+      continue;
     }
+    result = rewriter->Leave(top->exp, &top->results);
+    stack.pop_back();
+    if (stack.empty()) {
+      return result;
+    }
+  }
+}
 
-    case kAnyByte:
-    case kByte:
-    case kByteRange:
-      return exp;
+// Recursion is cheaper than the explicit stack, so Rewrite() recurses until
+// this depth and only then switches to RewriteIteratively().
+static constexpr int kMaxRewriteDepth = 64;
 
-    case kKleeneClosure: {
-      Exp sub = Normalised(exp->sub());
-      // (r∗)∗ ≈ r∗
-      if (sub->kind() == kKleeneClosure) {
-        return sub;
-      }
-      // ∅∗ ≈ ε
-      if (sub->kind() == kEmptySet) {
-        return EmptyString();
-      }
-      // ε∗ ≈ ε
-      if (sub->kind() == kEmptyString) {
-        return EmptyString();
-      }
-      // \C∗ ≈ ¬∅
-      if (sub->kind() == kAnyByte) {
-        return Complement({EmptySet()}, true);
-      }
-      return KleeneClosure({sub}, true);
+// Rewrites exp bottom-up in bounded call stack, so that deep expressions (e.g.
+// the Concatenations for a long literal) can be rewritten on any thread. For
+// each expression, the rewriter implements:
+//
+//   Exp Enter(Exp* exp, Subexpressions* subs);
+//     Returns the result for *exp or, if *exp depends on subexpressions,
+//     outputs them and returns nullptr. May replace *exp.
+//   Exp Cut(const Exp& exp, const Exp& result);
+//     Returns the result for exp given the result for one of subs or returns
+//     nullptr to continue with the rest of subs.
+//   Exp Leave(const Exp& exp, Subexpressions* results);
+//     Returns the result for exp given the results for all of subs.
+template <typename Rewriter>
+static Exp Rewrite(Exp exp, Rewriter* rewriter, int depth = 0) {
+  Subexpressions subs;
+  Exp result = rewriter->Enter(&exp, &subs);
+  if (result != nullptr) {
+    return result;
+  }
+  if (depth == kMaxRewriteDepth) {
+    return RewriteIteratively(std::move(exp), std::move(subs), rewriter);
+  }
+  Subexpressions results;
+  for (Exp& sub : subs) {
+    result = Rewrite(std::move(sub), rewriter, depth + 1);
+    Exp cut = rewriter->Cut(exp, result);
+    if (cut != nullptr) {
+      return cut;
     }
+    results.push_back(std::move(result));
+  }
+  return rewriter->Leave(exp, &results);
+}
 
-    case kConcatenation: {
-      Exp head = exp->head();
-      Exp tail = exp->tail();
-      // (r · s) · t ≈ r · (s · t)
-      head = Normalised(head);
-      while (head->kind() == kConcatenation) {
-        tail = Concatenation(head->tail(), tail);
-        head = head->head();
-      }
-      tail = Normalised(tail);
-      // ∅ · r ≈ ∅
-      if (head->kind() == kEmptySet) {
-        return head;
-      }
-      // r · ∅ ≈ ∅
-      if (tail->kind() == kEmptySet) {
-        return tail;
-      }
-      // ε · r ≈ r
-      if (head->kind() == kEmptyString) {
-        return tail;
-      }
-      // r · ε ≈ r
-      if (tail->kind() == kEmptyString) {
-        return head;
-      }
-      return Concatenation({head, tail}, true);
+// Returns the normalised Concatenation of head and tail, which must both be
+// normalised. head must not be a Concatenation.
+static Exp NormalisedConcatenation(Exp head, Exp tail) {
+  // ∅ · r ≈ ∅
+  if (head->kind() == kEmptySet) {
+    return head;
+  }
+  // r · ∅ ≈ ∅
+  if (tail->kind() == kEmptySet) {
+    return tail;
+  }
+  // ε · r ≈ r
+  if (head->kind() == kEmptyString) {
+    return tail;
+  }
+  // r · ε ≈ r
+  if (tail->kind() == kEmptyString) {
+    return head;
+  }
+  return Concatenation({head, tail}, true);
+}
+
+class Normaliser {
+ public:
+  Normaliser() {}
+  ~Normaliser() {}
+
+  Exp Enter(Exp* exp, Subexpressions* subs) {
+    if ((*exp)->norm()) {
+      return *exp;
     }
+    switch ((*exp)->kind()) {
+      case kEmptySet:
+      case kEmptyString:
+        return *exp;
 
-    case kComplement: {
-      Exp sub = Normalised(exp->sub());
-      // ¬(¬r) ≈ r
-      if (sub->kind() == kComplement) {
-        return sub->sub();
-      }
-      return Complement({sub}, true);
+      case kGroup:
+        subs->push_back(std::get<1>((*exp)->group()));
+        return nullptr;
+
+      case kAnyByte:
+      case kByte:
+      case kByteRange:
+        return *exp;
+
+      case kKleeneClosure:
+      case kConcatenation:
+      case kComplement:
+      case kConjunction:
+      case kDisjunction:
+        subs->append((*exp)->subexpressions().begin(),
+                     (*exp)->subexpressions().end());
+        return nullptr;
+
+      case kCharacterClass:
+        break;
+
+      case kQuantifier:
+        subs->push_back(std::get<0>((*exp)->quantifier()));
+        return nullptr;
     }
+    abort();
+  }
 
-    case kConjunction: {
-      std::list<Exp> subs;
-      for (Exp sub : exp->subexpressions()) {
-        sub = Normalised(sub);
+  Exp Cut(const Exp& exp, const Exp& result) {
+    switch (exp->kind()) {
+      case kConcatenation:
+        // ∅ · r ≈ ∅
+        if (result->kind() == kEmptySet) {
+          return result;
+        }
+        return nullptr;
+
+      case kConjunction:
         // ∅ & r ≈ ∅
         // r & ∅ ≈ ∅
+        if (result->kind() == kEmptySet) {
+          return result;
+        }
+        return nullptr;
+
+      case kDisjunction:
+        // ¬∅ + r ≈ ¬∅
+        // r + ¬∅ ≈ ¬∅
+        if (result->kind() == kComplement &&
+            result->sub()->kind() == kEmptySet) {
+          return result;
+        }
+        return nullptr;
+
+      default:
+        return nullptr;
+    }
+  }
+
+  Exp Leave(const Exp& exp, Subexpressions* results) {
+    switch (exp->kind()) {
+      case kGroup: {
+        int num; Mode mode; bool capture;
+        std::tie(num, std::ignore, mode, capture) = exp->group();
+        Exp sub = results->front();
         if (sub->kind() == kEmptySet) {
+          return EmptySet();
+        }
+        if (sub->kind() == kEmptyString) {
+          return EmptyString();
+        }
+        return Group(num, sub, mode, capture);
+      }
+
+      case kKleeneClosure: {
+        Exp sub = results->front();
+        // (r∗)∗ ≈ r∗
+        if (sub->kind() == kKleeneClosure) {
           return sub;
         }
-        // (r & s) & t ≈ r & (s & t)
-        if (sub->kind() == kConjunction) {
-          std::list<Exp> copy = sub->subexpressions();
-          subs.splice(subs.end(), copy);
-        } else {
-          subs.push_back(sub);
+        // ∅∗ ≈ ε
+        if (sub->kind() == kEmptySet) {
+          return EmptyString();
+        }
+        // ε∗ ≈ ε
+        if (sub->kind() == kEmptyString) {
+          return EmptyString();
         }
+        // \C∗ ≈ ¬∅
+        if (sub->kind() == kAnyByte) {
+          return Complement({EmptySet()}, true);
+        }
+        return KleeneClosure({sub}, true);
       }
-      // r & s ≈ s & r
-      subs.sort();
-      // r & r ≈ r
-      subs.unique();
-      // ¬∅ & r ≈ r
-      // r & ¬∅ ≈ r
-      subs.remove_if([&subs](Exp sub) -> bool {
-        return (sub->kind() == kComplement &&
-                sub->sub()->kind() == kEmptySet &&
-                subs.size() > 1);
-      });
-      if (subs.size() == 1) {
-        return subs.front();
+
+      case kConcatenation: {
+        Exp head = results->front();
+        Exp tail = results->back();
+        // (r · s) · t ≈ r · (s · t)
+        // Both are normalised, so append the factors of head to tail.
+        std::vector<Exp> factors;
+        while (head->kind() == kConcatenation) {
+          factors.push_back(head->head());
+          head = head->tail();
+        }
+        tail = NormalisedConcatenation(head, tail);
+        while (!factors.empty()) {
+          tail = NormalisedConcatenation(factors.back(), tail);
+          factors.pop_back();
+        }
+        return tail;
       }
-      return Conjunction(subs, true);
-    }
 
-    case kDisjunction: {
-      std::list<Exp> subs;
-      for (Exp sub : exp->subexpressions()) {
-        sub = Normalised(sub);
-        // ¬∅ + r ≈ ¬∅
-        // r + ¬∅ ≈ ¬∅
+      case kComplement: {
+        Exp sub = results->front();
+        // ¬(¬r) ≈ r
+        if (sub->kind() == kComplement) {
+          return sub->sub();
+        }
+        return Complement({sub}, true);
+      }
+
+      case kConjunction: {
+        // A lone result is normalised already, so leave it be rather than
+        // splice, sort and rebuild its subexpressions. (For a Disjunction,
+        // this is the case for a trie node that ∂a reached from its parent.)
+        if (results->size() == 1) {
+          return results->front();
+        }
+        std::list<Exp> subs;
+        for (Exp sub : *results) {
+          // (r & s) & t ≈ r & (s & t)
+          if (sub->kind() == kConjunction) {
+            std::list<Exp> copy = sub->subexpressions();
+            subs.splice(subs.end(), copy);
+          } else {
+            subs.push_back(sub);
+          }
+        }
+        // r & s ≈ s & r
+        subs.sort();
+        // r & r ≈ r
+        subs.unique();
+        // ¬∅ & r ≈ r
+        // r & ¬∅ ≈ r
+        subs.remove_if([&subs](Exp sub) -> bool {
+          return (sub->kind() == kComplement &&
+                  sub->sub()->kind() == kEmptySet &&
+                  subs.size() > 1);
+        });
+        if (subs.size() == 1) {
+          return subs.front();
+        }
+        return Conjunction(subs, true);
+      }
+
+      case kDisjunction: {
+        // As above, leave a lone result be.
+        if (results->size() == 1) {
+          return results->front();
+        }
+        std::list<Exp> subs;
+        for (Exp sub : *results) {
+          // (r + s) + t ≈ r + (s + t)
+          if (sub->kind() == kDisjunction) {
+            std::list<Exp> copy = sub->subexpressions();
+            subs.splice(subs.end(), copy);
+          } else {
+            subs.push_back(sub);
+          }
+        }
+        // r + s ≈ s + r
+        subs.sort();
+        // r + r ≈ r
+        subs.unique();
+        // ∅ + r ≈ r
+        // r + ∅ ≈ r
+        subs.remove_if([&subs](Exp sub) -> bool {
+          return (sub->kind() == kEmptySet &&
+                  subs.size() > 1);
+        });
+        if (subs.size() == 1) {
+          return subs.front();
+        }
+        return Disjunction(subs, true);
+      }
+
+      case kQuantifier: {
+        int min; int max;
+        std::tie(std::ignore, min, max) = exp->quantifier();
+        Exp sub = results->front();
+        // r{n,m} ≈ r{0,m} if ν(r) = ε
+        if (IsNullable(sub)) {
+          min = 0;
+        }
+        // r{0,0} ≈ ε
+        if (max == 0) {
+          return EmptyString();
+        }
+        // ∅{0,m} ≈ ε
+        // ∅{n,m} ≈ ∅
+        if (sub->kind() == kEmptySet) {
+          return min == 0 ? EmptyString() : sub;
+        }
+        // ε{n,m} ≈ ε
+        if (sub->kind() == kEmptyString) {
+          return sub;
+        }
+        // (r∗){0,m} ≈ r∗
+        if (sub->kind() == kKleeneClosure) {
+          return sub;
+        }
+        // (¬∅){0,m} ≈ ¬∅
         if (sub->kind() == kComplement &&
             sub->sub()->kind() == kEmptySet) {
           return sub;
         }
-        // (r + s) + t ≈ r + (s + t)
-        if (sub->kind() == kDisjunction) {
-          std::list<Exp> copy = sub->subexpressions();
-          subs.splice(subs.end(), copy);
-        } else {
-          subs.push_back(sub);
+        // r{1,1} ≈ r
+        if (min == 1 && max == 1) {
+          return sub;
         }
+        // (r{n}){m} ≈ r{nm}
+        if (sub->kind() == kQuantifier && min == max &&
+            std::get<1>(sub->quantifier()) == std::get<2>(sub->quantifier())) {
+          min *= std::get<1>(sub->quantifier());
+          max = min;
+          sub = std::get<0>(sub->quantifier());
+        }
+        return Quantifier(std::make_tuple(sub, min, max), true);
       }
-      // r + s ≈ s + r
-      subs.sort();
-      // r + r ≈ r
-      subs.unique();
-      // ∅ + r ≈ r
-      // r + ∅ ≈ r
-      subs.remove_if([&subs](Exp sub) -> bool {
-        return (sub->kind() == kEmptySet &&
-                subs.size() > 1);
-      });
-      if (subs.size() == 1) {
-        return subs.front();
-      }
-      return Disjunction(subs, true);
+
+      default:
+        break;
     }
+    abort();
+  }
 
-    case kCharacterClass:
-    case kQuantifier:
-      break;
+ private:
+  Normaliser(const Normaliser&) = delete;
+  Normaliser& operator=(const Normaliser&) = delete;
+};
+
+Exp Normalised(Exp exp) {
+  if (exp->norm()) {
+    return exp;
   }
-  abort();
+  Normaliser normaliser;
+  return Rewrite(exp, &normaliser);
 }
 
 bool IsNullable(Exp exp) {
-  switch (exp->kind()) {
-    case kEmptySet:
-      // ν(∅) = ∅
-      return false;
+  // Evaluate iteratively so that deep expressions do not overflow the stack.
+  // Each frame is a Complement, Concatenation, Conjunction or Disjunction that
+  // awaits the nullability of a subexpression.
+  struct Frame {
+    const Expression* exp;
+    std::list<Exp>::const_iterator next;
+  };
+  llvm::SmallVector<Frame, 16> stack;
+  const Expression* x = exp.get();
+  while (true) {
+    bool value = false;
+    switch (x->kind()) {
+      case kEmptySet:
+        // ν(∅) = ∅
+        value = false;
+        break;
 
-    case kEmptyString:
-      // ν(ε) = ε
-      return true;
+      case kEmptyString:
+        // ν(ε) = ε
+        value = true;
+        break;
 
-    case kGroup:
-      return IsNullable(std::get<1>(exp->group()));
+      case kGroup:
+        x = std::get<1>(x->group()).get();
+        continue;
 
-    case kAnyByte:
-      // ν(\C) = ∅
-      return false;
+      case kAnyByte:
+        // ν(\C) = ∅
+        value = false;
+        break;
 
-    case kByte:
-      // ν(a) = ∅
-      return false;
+      case kByte:
+        // ν(a) = ∅
+        value = false;
+        break;
 
-    case kByteRange:
-      // ν(S) = ∅
-      return false;
+      case kByteRange:
+        // ν(S) = ∅
+        value = false;
+        break;
 
-    case kKleeneClosure:
-      // ν(r∗) = ε
-      return true;
+      case kKleeneClosure:
+        // ν(r∗) = ε
+        value = true;
+        break;
 
-    case kConcatenation:
-      // ν(r · s) = ν(r) & ν(s)
-      return IsNullable(exp->head()) && IsNullable(exp->tail());
+      case kConcatenation:
+        // ν(r · s) = ν(r) & ν(s)
+      case kConjunction:
+        // ν(r & s) = ν(r) & ν(s)
+      case kDisjunction:
+        // ν(r + s) = ν(r) + ν(s)
+        stack.push_back({x, x->subexpressions().begin()});
+        x = (stack.back().next++)->get();
+        continue;
 
-    case kComplement:
-      // ν(¬r) = ∅ if ν(r) = ε
-      //         ε if ν(r) = ∅
-      return !IsNullable(exp->sub());
+      case kComplement:
+        // ν(¬r) = ∅ if ν(r) = ε
+        //         ε if ν(r) = ∅
+        stack.push_back({x, x->subexpressions().begin()});
+        x = x->subexpressions().front().get();
+        continue;
 
-    case kConjunction:
-      // ν(r & s) = ν(r) & ν(s)
-      for (Exp sub : exp->subexpressions()) {
-        if (!IsNullable(sub)) {
-          return false;
-        }
-      }
-      return true;
+      case kCharacterClass:
+        abort();
 
-    case kDisjunction:
-      // ν(r + s) = ν(r) + ν(s)
-      for (Exp sub : exp->subexpressions()) {
-        if (IsNullable(sub)) {
-          return true;
+      case kQuantifier:
+        // ν(r{n,m}) = ε if n = 0
+        //             ν(r) otherwise
+        if (std::get<1>(x->quantifier()) == 0) {
+          value = true;
+          break;
         }
+        x = std::get<0>(x->quantifier()).get();
+        continue;
+    }
+    // Propagate the value until some frame needs another subexpression.
+    while (true) {
+      if (stack.empty()) {
+        return value;
+      }
+      Frame& frame = stack.back();
+      if (frame.exp->kind() == kComplement) {
+        value = !value;
+        stack.pop_back();
+        continue;
+      }
+      // Short-circuit on ε for a Disjunction and on ∅ for the others.
+      bool any = frame.exp->kind() == kDisjunction;
+      if (value == any || frame.next == frame.exp->subexpressions().end()) {
+        stack.pop_back();
+        continue;
       }
-      return false;
-
-    case kCharacterClass:
-    case kQuantifier:
       break;
+    }
+    x = (stack.back().next++)->get();
   }
-  abort();
 }
 
-Exp Derivative(Exp exp, int byte) {
-  switch (exp->kind()) {
-    case kEmptySet:
-      // ∂a∅ = ∅
-      return EmptySet();
+class Differentiator {
+ public:
+  explicit Differentiator(int byte) : byte_(byte) {}
+  ~Differentiator() {}
 
-    case kEmptyString:
-      // ∂aε = ∅
-      return EmptySet();
+  Exp Enter(Exp* exp, Subexpressions* subs) {
+    switch ((*exp)->kind()) {
+      case kEmptySet:
+        // ∂a∅ = ∅
+        return EmptySet();
 
-    case kGroup:
-      // This should never happen.
-      break;
+      case kEmptyString:
+        // ∂aε = ∅
+        return EmptySet();
 
-    case kAnyByte:
-      // ∂a\C = ε
-      return EmptyString();
+      case kGroup:
+        // This should never happen.
+        break;
 
-    case kByte:
-      // ∂aa = ε
-      // ∂ab = ∅ for b ≠ a
-      if (exp->byte() == byte) {
+      case kAnyByte:
+        // ∂a\C = ε
         return EmptyString();
-      } else {
-        return EmptySet();
-      }
 
-    case kByteRange:
-      // ∂aS = ε if a ∈ S
-      //       ∅ if a ∉ S
-      if (exp->byte_range().first <= byte &&
-          byte <= exp->byte_range().second) {
-        return EmptyString();
-      } else {
-        return EmptySet();
-      }
+      case kByte:
+        // ∂aa = ε
+        // ∂ab = ∅ for b ≠ a
+        if ((*exp)->byte() == byte_) {
+          return EmptyString();
+        } else {
+          return EmptySet();
+        }
 
-    case kKleeneClosure:
-      // ∂a(r∗) = ∂ar · r∗
-      return Concatenation(Derivative(exp->sub(), byte),
-                           exp);
+      case kByteRange:
+        // ∂aS = ε if a ∈ S
+        //       ∅ if a ∉ S
+        if ((*exp)->byte_range().first <= byte_ &&
+            byte_ <= (*exp)->byte_range().second) {
+          return EmptyString();
+        } else {
+          return EmptySet();
+        }
 
-    case kConcatenation:
-      // ∂a(r · s) = ∂ar · s + ν(r) · ∂as
-      if (IsNullable(exp->head())) {
-        return Disjunction(Concatenation(Derivative(exp->head(), byte),
-                                         exp->tail()),
-                           Derivative(exp->tail(), byte));
-      } else {
-        return Concatenation(Derivative(exp->head(), byte),
-                             exp->tail());
-      }
+      case kKleeneClosure:
+      case kComplement:
+      case kConjunction:
+        subs->append((*exp)->subexpressions().begin(),
+                     (*exp)->subexpressions().end());
+        return nullptr;
 
-    case kComplement:
-      // ∂a(¬r) = ¬(∂ar)
-      return Complement(Derivative(exp->sub(), byte));
+      case kDisjunction:
+        // ∂a(S · r) = ∂aS · r = ∅ for a ∉ S, so skip those alternatives
+        // rather than build and normalise them away. In a trie of literals,
+        // that is all but (at most) one alternative of each node, so the cost
+        // of each derivative no longer depends on the number of literals.
+        for (const Exp& sub : (*exp)->subexpressions()) {
+          if (!Excludes(sub.get())) {
+            subs->push_back(sub);
+          }
+        }
+        if (subs->empty()) {
+          return EmptySet();
+        }
+        return nullptr;
 
-    case kConjunction: {
-      // ∂a(r & s) = ∂ar & ∂as
-      std::list<Exp> subs;
-      for (Exp sub : exp->subexpressions()) {
-        sub = Derivative(sub, byte);
-        subs.push_back(sub);
-      }
-      return Conjunction(subs, false);
+      case kConcatenation:
+        subs->push_back((*exp)->head());
+        if (IsNullable((*exp)->head())) {
+          subs->push_back((*exp)->tail());
+        }
+        return nullptr;
+
+      case kCharacterClass:
+        break;
+
+      case kQuantifier:
+        // ∂a(r{0,0}) = ∂aε = ∅
+        if (std::get<2>((*exp)->quantifier()) == 0) {
+          return EmptySet();
+        }
+        subs->push_back(std::get<0>((*exp)->quantifier()));
+        return nullptr;
     }
+    abort();
+  }
 
-    case kDisjunction: {
-      // ∂a(r + s) = ∂ar + ∂as
-      std::list<Exp> subs;
-      for (Exp sub : exp->subexpressions()) {
-        sub = Derivative(sub, byte);
-        subs.push_back(sub);
+  Exp Cut(const Exp&, const Exp&) {
+    return nullptr;
+  }
+
+  Exp Leave(const Exp& exp, Subexpressions* results) {
+    switch (exp->kind()) {
+      case kKleeneClosure:
+        // ∂a(r∗) = ∂ar · r∗
+        return Concatenation(results->front(), exp);
+
+      case kConcatenation:
+        // ∂a(r · s) = ∂ar · s + ν(r) · ∂as
+        if (results->size() == 2) {
+          return Disjunction(Concatenation(results->front(), exp->tail()),
+                             results->back());
+        } else {
+          return Concatenation(results->front(), exp->tail());
+        }
+
+      case kComplement:
+        // ∂a(¬r) = ¬(∂ar)
+        return Complement(results->front());
+
+      case kConjunction:
+        // ∂a(r & s) = ∂ar & ∂as
+        return Conjunction(std::list<Exp>(results->begin(), results->end()),
+                           false);
+
+      case kDisjunction:
+        // ∂a(r + s) = ∂ar + ∂as
+        return Disjunction(std::list<Exp>(results->begin(), results->end()),
+                           false);
+
+      case kQuantifier: {
+        // ∂a(r{n,m}) = ∂ar · r{n-1,m-1} if ν(r) = ∅
+        //              ∂ar · r{0,m-1}   if ν(r) = ε
+        // where n-1 is clamped to 0
+        Exp sub; int min; int max;
+        std::tie(sub, min, max) = exp->quantifier();
+        if (min == 0 || IsNullable(sub)) {
+          min = 1;
+        }
+        return Concatenation(results->front(),
+                             Quantifier(sub, min - 1, max - 1));
       }
-      return Disjunction(subs, false);
+
+      default:
+        break;
     }
+    abort();
+  }
 
-    case kCharacterClass:
-    case kQuantifier:
-      break;
+ private:
+  // Returns true iff exp is a Byte or a ByteRange that does not contain byte_
+  // or is a Concatenation whose head is such.
+  bool Excludes(const Expression* exp) const {
+    if (exp->kind() == kConcatenation) {
+      exp = exp->subexpressions().front().get();
+    }
+    switch (exp->kind()) {
+      case kByte:
+        return exp->byte() != byte_;
+      case kByteRange:
+        return byte_ < exp->byte_range().first ||
+               exp->byte_range().second < byte_;
+      default:
+        return false;
+    }
   }
-  abort();
+
+  int byte_;
+
+  Differentiator(const Differentiator&) = delete;
+  Differentiator& operator=(const Differentiator&) = delete;
+};
+
+Exp Derivative(Exp exp, int byte) {
+  Differentiator differentiator(byte);
+  return Rewrite(exp, &differentiator);
 }
 
 Outer Denormalised(Exp exp) {
@@ -965,7 +1545,23 @@ static void Intersection(const std::list<std::bitset<256>>& x,
   }
 }
 
+static void PartitionsImpl(Exp exp, std::list<std::bitset<256>>* partitions);
+
 void Partitions(Exp exp, std::list<std::bitset<256>>* partitions) {
+  Interned* interned = FindInterned(exp);
+  if (interned != nullptr) {
+    std::call_once(interned->once, [interned] {
+      PartitionsImpl(interned->exp, &interned->partitions);
+    });
+    partitions->insert(partitions->end(),
+                       interned->partitions.begin(),
+                       interned->partitions.end());
+    return;
+  }
+  PartitionsImpl(exp, partitions);
+}
+
+static void PartitionsImpl(Exp exp, std::list<std::bitset<256>>* partitions) {
   switch (exp->kind()) {
     case kEmptySet:
       // C(∅) = {Σ}
@@ -1046,7 +1642,29 @@ void Partitions(Exp exp, std::list<std::bitset<256>>* partitions) {
       }
       return;
 
-    case kDisjunction:
+    case kDisjunction: {
+      // C(S₁ + … + Sₙ) = {Σ \ S, S} where S = S₁ ∪ … ∪ Sₙ
+      // This keeps e.g. the case folding of a byte in one partition.
+      std::bitset<256> bs;
+      for (Exp sub : exp->subexpressions()) {
+        if (sub->kind() == kByte) {
+          bs.set(sub->byte());
+        } else if (sub->kind() == kByteRange) {
+          for (int i = sub->byte_range().first;
+               i <= sub->byte_range().second;
+               ++i) {
+            bs.set(i);
+          }
+        } else {
+          bs.reset();
+          break;
+        }
+      }
+      if (bs.any()) {
+        partitions->push_back(bs);
+        partitions->push_back(bs);
+        return;
+      }
       // C(r + s) = C(r) ∧ C(s)
       for (Exp sub : exp->subexpressions()) {
         if (partitions->empty()) {
@@ -1059,57 +1677,89 @@ void Partitions(Exp exp, std::list<std::bitset<256>>* partitions) {
         }
       }
       return;
+    }
 
     case kCharacterClass:
-    case kQuantifier:
       break;
+
+    case kQuantifier:
+      // C(r{n,m}) = C(r)
+      Partitions(std::get<0>(exp->quantifier()), partitions);
+      return;
   }
   abort();
 }
 
-// A simple framework for implementing the post-parse rewrites.
+// Returns true iff subs are the very subexpressions of exp.
+static bool SameSubexpressions(const Exp& exp, const std::list<Exp>& subs) {
+  return std::equal(subs.begin(), subs.end(),
+                    exp->subexpressions().begin(),
+                    exp->subexpressions().end(),
+                    [](const Exp& x, const Exp& y) { return x.get() == y.get(); });
+}
+
+// A simple framework for implementing the post-parse rewrites. Walk() uses
+// Rewrite(), so PreWalk() sees each expression on the way down and the other
+// hooks see it on the way up, along with its walked subexpressions.
 class Walker {
  public:
-  Walker() {}
+  // kinds is the bitmask of the kinds (as per Expression::kinds()) that the
+  // subclass rewrites. Walk() leaves intact any expression without them.
+  explicit Walker(int kinds) : kinds_(kinds) {}
+  Walker() : Walker(~0) {}
   virtual ~Walker() {}
 
-  virtual Exp WalkGroup(Exp exp) {
-    int num; Exp sub; Mode mode; bool capture;
-    std::tie(num, sub, mode, capture) = exp->group();
-    sub = Walk(sub);
+  int kinds() const { return kinds_; }
+
+  // Returns the expression whose subexpressions should be walked, which is
+  // exp by default. Setting *stop skips them and uses that expression as is.
+  virtual Exp PreWalk(Exp exp, bool*) {
+    return exp;
+  }
+
+  // By default, the hooks rebuild exp only if its subexpressions changed.
+
+  virtual Exp WalkGroup(Exp exp, Exp sub) {
+    int num; Exp old; Mode mode; bool capture;
+    std::tie(num, old, mode, capture) = exp->group();
+    if (sub.get() == old.get()) {
+      return exp;
+    }
     return Group(num, sub, mode, capture);
   }
 
-  virtual Exp WalkKleeneClosure(Exp exp) {
-    Exp sub = Walk(exp->sub());
+  virtual Exp WalkKleeneClosure(Exp exp, Exp sub) {
+    if (sub.get() == exp->sub().get()) {
+      return exp;
+    }
     return KleeneClosure(sub);
   }
 
-  virtual Exp WalkConcatenation(Exp exp) {
-    Exp head = Walk(exp->head());
-    Exp tail = Walk(exp->tail());
+  virtual Exp WalkConcatenation(Exp exp, Exp head, Exp tail) {
+    if (head.get() == exp->head().get() &&
+        tail.get() == exp->tail().get()) {
+      return exp;
+    }
     return Concatenation(head, tail);
   }
 
-  virtual Exp WalkComplement(Exp exp) {
-    Exp sub = Walk(exp->sub());
+  virtual Exp WalkComplement(Exp exp, Exp sub) {
+    if (sub.get() == exp->sub().get()) {
+      return exp;
+    }
     return Complement(sub);
   }
 
-  virtual Exp WalkConjunction(Exp exp) {
-    std::list<Exp> subs;
-    for (Exp sub : exp->subexpressions()) {
-      sub = Walk(sub);
-      subs.push_back(sub);
+  virtual Exp WalkConjunction(Exp exp, const std::list<Exp>& subs) {
+    if (SameSubexpressions(exp, subs)) {
+      return exp;
     }
     return Conjunction(subs, false);
   }
 
-  virtual Exp WalkDisjunction(Exp exp) {
-    std::list<Exp> subs;
-    for (Exp sub : exp->subexpressions()) {
-      sub = Walk(sub);
-      subs.push_back(sub);
+  virtual Exp WalkDisjunction(Exp exp, const std::list<Exp>& subs) {
+    if (SameSubexpressions(exp, subs)) {
+      return exp;
     }
     return Disjunction(subs, false);
   }
@@ -1118,99 +1768,158 @@ class Walker {
     return exp;
   }
 
-  virtual Exp WalkQuantifier(Exp exp) {
-    Exp sub; int min; int max;
-    std::tie(sub, min, max) = exp->quantifier();
-    sub = Walk(sub);
+  virtual Exp WalkQuantifier(Exp exp, Exp sub) {
+    Exp old; int min; int max;
+    std::tie(old, min, max) = exp->quantifier();
+    if (sub.get() == old.get()) {
+      return exp;
+    }
     return Quantifier(sub, min, max);
   }
 
   Exp Walk(Exp exp) {
-    switch (exp->kind()) {
+    return Rewrite(exp, this);
+  }
+
+ private:
+  template <typename Rewriter>
+  friend Exp Rewrite(Exp exp, Rewriter* rewriter, int depth);
+  template <typename Rewriter>
+  friend Exp RewriteIteratively(Exp exp, Subexpressions subs,
+                                Rewriter* rewriter);
+
+  Exp Enter(Exp* exp, Subexpressions* subs) {
+    // Interned expressions are shared by every pattern, so leave them intact.
+    if (((*exp)->kinds() & kinds_) == 0 || FindInterned(*exp) != nullptr) {
+      return *exp;
+    }
+    switch ((*exp)->kind()) {
       case kEmptySet:
       case kEmptyString:
-        return exp;
+      case kAnyByte:
+      case kByte:
+      case kByteRange:
+        return *exp;
 
-      case kGroup:
-        return WalkGroup(exp);
+      case kCharacterClass:
+        return WalkCharacterClass(*exp);
 
+      default:
+        break;
+    }
+    bool stop = false;
+    *exp = PreWalk(*exp, &stop);
+    if (stop) {
+      return *exp;
+    }
+    switch ((*exp)->kind()) {
+      case kEmptySet:
+      case kEmptyString:
       case kAnyByte:
       case kByte:
       case kByteRange:
-        return exp;
+        return *exp;
+
+      case kGroup:
+        subs->push_back(std::get<1>((*exp)->group()));
+        return nullptr;
+
+      case kKleeneClosure:
+      case kConcatenation:
+      case kComplement:
+      case kConjunction:
+      case kDisjunction:
+        subs->append((*exp)->subexpressions().begin(),
+                     (*exp)->subexpressions().end());
+        return nullptr;
+
+      case kCharacterClass:
+        return WalkCharacterClass(*exp);
+
+      case kQuantifier:
+        subs->push_back(std::get<0>((*exp)->quantifier()));
+        return nullptr;
+    }
+    abort();
+  }
+
+  Exp Cut(const Exp&, const Exp&) {
+    return nullptr;
+  }
+
+  Exp Leave(const Exp& exp, Subexpressions* results) {
+    switch (exp->kind()) {
+      case kGroup:
+        return WalkGroup(exp, results->front());
 
       case kKleeneClosure:
-        return WalkKleeneClosure(exp);
+        return WalkKleeneClosure(exp, results->front());
 
       case kConcatenation:
-        return WalkConcatenation(exp);
+        return WalkConcatenation(exp, results->front(), results->back());
 
       case kComplement:
-        return WalkComplement(exp);
+        return WalkComplement(exp, results->front());
 
       case kConjunction:
-        return WalkConjunction(exp);
+        return WalkConjunction(
+            exp, std::list<Exp>(results->begin(), results->end()));
 
       case kDisjunction:
-        return WalkDisjunction(exp);
-
-      case kCharacterClass:
-        return WalkCharacterClass(exp);
+        return WalkDisjunction(
+            exp, std::list<Exp>(results->begin(), results->end()));
 
       case kQuantifier:
-        return WalkQuantifier(exp);
+        return WalkQuantifier(exp, results->front());
+
+      default:
+        break;
     }
     abort();
   }
 
- private:
+  const int kinds_;
+
   Walker(const Walker&) = delete;
   Walker& operator=(const Walker&) = delete;
 };
 
 class FlattenConjunctionsAndDisjunctions : public Walker {
  public:
-  FlattenConjunctionsAndDisjunctions() {}
+  // kinds is the bitmask of any other kinds that a subclass rewrites.
+  explicit FlattenConjunctionsAndDisjunctions(int kinds = 0)
+      : Walker(kinds | 1 << kConjunction | 1 << kDisjunction) {}
   ~FlattenConjunctionsAndDisjunctions() override {}
 
-  inline void FlattenImpl(Exp exp, std::list<Exp>* subs) {
+  // Flatten the subexpressions of the same kind (and theirs, and so on) on the
+  // way down, so that the other hooks never see them. In most cases, exp is a
+  // left-skewed binary tree, so this uses an explicit stack.
+  Exp PreWalk(Exp exp, bool*) override {
     Kind kind = exp->kind();
-    // In most cases, exp is a left-skewed binary tree.
-    while (exp->kind() == kind &&
-           exp->subexpressions().size() == 2) {
-      subs->push_front(exp->tail());
-      exp = exp->head();
-    }
-    if (exp->kind() == kind) {
-      std::list<Exp> copy = exp->subexpressions();
-      subs->splice(subs->begin(), copy);
-    } else {
-      subs->push_front(exp);
+    if (kind != kConjunction && kind != kDisjunction) {
+      return exp;
+    }
+    if (std::none_of(exp->subexpressions().begin(),
+                     exp->subexpressions().end(),
+                     [kind](const Exp& sub) { return sub->kind() == kind; })) {
+      return exp;
     }
-    std::list<Exp>::iterator i = subs->begin();
-    while (i != subs->end()) {
-      Exp sub = *i;
-      sub = Walk(sub);
+    std::list<Exp> subs;
+    std::vector<Exp> stack(exp->subexpressions().rbegin(),
+                           exp->subexpressions().rend());
+    while (!stack.empty()) {
+      Exp sub = std::move(stack.back());
+      stack.pop_back();
       if (sub->kind() == kind) {
-        std::list<Exp> copy = sub->subexpressions();
-        subs->splice(i, copy);
-        i = subs->erase(i);
+        stack.insert(stack.end(), sub->subexpressions().rbegin(),
+                     sub->subexpressions().rend());
       } else {
-        *i = sub;
-        ++i;
+        subs.push_back(std::move(sub));
       }
     }
-  }
-
-  Exp WalkConjunction(Exp exp) override {
-    std::list<Exp> subs;
-    FlattenImpl(exp, &subs);
-    return Conjunction(subs, false);
-  }
-
-  Exp WalkDisjunction(Exp exp) override {
-    std::list<Exp> subs;
-    FlattenImpl(exp, &subs);
+    if (kind == kConjunction) {
+      return Conjunction(subs, false);
+    }
     return Disjunction(subs, false);
   }
 
@@ -1221,11 +1930,10 @@ class FlattenConjunctionsAndDisjunctions : public Walker {
 
 class StripGroups : public Walker {
  public:
-  StripGroups() {}
+  StripGroups() : Walker(1 << kGroup) {}
   ~StripGroups() override {}
 
-  Exp WalkGroup(Exp exp) override {
-    Exp sub = Walk(std::get<1>(exp->group()));
+  Exp WalkGroup(Exp, Exp sub) override {
     return sub;
   }
 
@@ -1234,26 +1942,24 @@ class StripGroups : public Walker {
   StripGroups& operator=(const StripGroups&) = delete;
 };
 
-class ApplyGroups : public Walker {
+// Flattens the Conjunctions and Disjunctions as well, which means that it sees
+// each flattened Disjunction once and so applies Groups to it once.
+class ApplyGroups : public FlattenConjunctionsAndDisjunctions {
  public:
-  ApplyGroups() {}
+  ApplyGroups() : FlattenConjunctionsAndDisjunctions(1 << kComplement) {}
   ~ApplyGroups() override {}
 
-  Exp WalkComplement(Exp exp) override {
-    Exp sub = Walk(exp->sub());
+  Exp WalkComplement(Exp, Exp sub) override {
     sub = Complement(sub);
     return Group(-1, sub, kMaximal, false);
   }
 
-  Exp WalkDisjunction(Exp exp) override {
-    // Applying Groups to AnyCharacter would break the .∗ ≈ ¬∅ rewrite.
-    if (exp == AnyCharacter()) {
-      return exp;
-    }
+  // Note that Walk() never reaches here for AnyCharacter, which is interned:
+  // applying Groups to it would break the .∗ ≈ ¬∅ rewrite.
+  Exp WalkDisjunction(Exp, const std::list<Exp>& walked) override {
     // Applying Groups to the subexpressions will identify the leftmost.
     std::list<Exp> subs;
-    for (Exp sub : exp->subexpressions()) {
-      sub = Walk(sub);
+    for (Exp sub : walked) {
       sub = Group(-1, sub, kPassive, false);
       subs.push_back(sub);
     }
@@ -1268,10 +1974,14 @@ class ApplyGroups : public Walker {
 class NumberGroups : public Walker {
  public:
   NumberGroups(std::vector<Mode>* modes, std::vector<int>* captures)
-      : num_(0), modes_(modes), captures_(captures) {}
+      : Walker(1 << kGroup), num_(0), modes_(modes), captures_(captures) {}
   ~NumberGroups() override {}
 
-  Exp WalkGroup(Exp exp) override {
+  // Number the Groups on the way down so that they are in pre-order.
+  Exp PreWalk(Exp exp, bool*) override {
+    if (exp->kind() != kGroup) {
+      return exp;
+    }
     Exp sub; Mode mode; bool capture;
     std::tie(std::ignore, sub, mode, capture) = exp->group();
     int num = num_++;
@@ -1279,7 +1989,6 @@ class NumberGroups : public Walker {
     if (capture) {
       captures_->push_back(num);
     }
-    sub = Walk(sub);
     return Group(num, sub, mode, capture);
   }
 
@@ -1292,17 +2001,177 @@ class NumberGroups : public Walker {
   NumberGroups& operator=(const NumberGroups&) = delete;
 };
 
+// Returns true iff ranges already contains every rune in [lo, hi].
+static bool ContainsRange(const RuneRanges& ranges,
+                          Rune lo, Rune hi) {
+  for (const auto& range : ranges) {
+    if (range.first > lo) {
+      break;
+    }
+    if (range.second >= lo) {
+      lo = range.second + 1;
+      if (lo > hi) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Adds [lo, hi] and its simple case folding to ranges. As in RE2, this adds the
+// image of the range under kCaseFold and then recurses on that image until it
+// has gone around every orbit, which is when the image is already present.
+static void AddFoldedRange(RuneRanges* ranges,
+                           Rune lo, Rune hi, int depth) {
+  // The longest orbit has four runes, so this should be unreachable.
+  if (depth > 10) {
+    abort();
+  }
+  if (ContainsRange(*ranges, lo, hi)) {
+    return;
+  }
+  ranges->insert(std::make_pair(lo, hi));
+  const CaseFold* begin = kCaseFold;
+  const CaseFold* end = kCaseFold + kNumCaseFold;
+  while (lo <= hi) {
+    const CaseFold* fold = std::lower_bound(
+        begin, end, lo,
+        [](const CaseFold& fold, Rune rune) { return fold.hi < rune; });
+    if (fold == end || fold->lo > hi) {
+      break;
+    }
+    lo = std::max(lo, fold->lo);
+    Rune lo1 = lo;
+    Rune hi1 = std::min(hi, fold->hi);
+    switch (fold->delta) {
+      case kEvenOdd:
+        lo1 -= lo1 % 2 == 1 ? 1 : 0;
+        hi1 += hi1 % 2 == 0 ? 1 : 0;
+        break;
+      case kOddEven:
+        lo1 -= lo1 % 2 == 0 ? 1 : 0;
+        hi1 += hi1 % 2 == 1 ? 1 : 0;
+        break;
+      default:
+        lo1 += fold->delta;
+        hi1 += fold->delta;
+        break;
+    }
+    AddFoldedRange(ranges, lo1, hi1, depth + 1);
+    lo = fold->hi + 1;
+  }
+}
+
+void FoldCase(RuneRanges* ranges) {
+  RuneRanges folded;
+  for (const auto& range : *ranges) {
+    AddFoldedRange(&folded, range.first, range.second, 0);
+  }
+  ranges->swap(folded);
+}
+
+// Represents a sequence of byte ranges, one per byte of the UTF-8 encoding.
+typedef std::vector<std::pair<int, int>> ByteRanges;
+
+// Outputs the sequences of byte ranges that match the runes in [lo, hi].
+// As in RE2 and in Rust's utf8-ranges, split the range at the boundaries
+// between encoding lengths and then until every byte range after the first
+// spans either one byte or all of the continuation bytes.
+static void SplitRuneRange(Rune lo, Rune hi, std::vector<ByteRanges>* seqs) {
+  // Surrogates are not valid in UTF-8.
+  if (lo <= 0xDFFF && hi >= 0xD800) {
+    if (lo < 0xD800) {
+      SplitRuneRange(lo, 0xD7FF, seqs);
+    }
+    if (hi > 0xDFFF) {
+      SplitRuneRange(0xE000, hi, seqs);
+    }
+    return;
+  }
+  for (Rune max : {0x7F, 0x7FF, 0xFFFF}) {
+    if (lo <= max && max < hi) {
+      SplitRuneRange(lo, max, seqs);
+      SplitRuneRange(max + 1, hi, seqs);
+      return;
+    }
+  }
+  for (int i = 1; i < 4; ++i) {
+    Rune m = (1 << (6 * i)) - 1;
+    if ((lo & ~m) != (hi & ~m)) {
+      if ((lo & m) != 0) {
+        SplitRuneRange(lo, lo | m, seqs);
+        SplitRuneRange((lo | m) + 1, hi, seqs);
+        return;
+      }
+      if ((hi & m) != m) {
+        SplitRuneRange(lo, (hi & ~m) - 1, seqs);
+        SplitRuneRange(hi & ~m, hi, seqs);
+        return;
+      }
+    }
+  }
+  char lo_buf[4];
+  char hi_buf[4];
+  int len = runetochar(lo_buf, &lo);
+  runetochar(hi_buf, &hi);
+  ByteRanges seq;
+  for (int i = 0; i < len; ++i) {
+    seq.push_back(std::make_pair(static_cast<unsigned char>(lo_buf[i]),
+                                 static_cast<unsigned char>(hi_buf[i])));
+  }
+  seqs->push_back(seq);
+}
+
+// Returns the Disjunction of seqs[begin, end), which must be sorted, from the
+// byte ranges at depth onwards. Sequences that share a byte range at depth
+// share it in the expression too, so the derivatives have less work to do.
+static Exp LowerByteRanges(const std::vector<ByteRanges>& seqs,
+                           size_t begin, size_t end, size_t depth) {
+  std::list<Exp> subs;
+  size_t i = begin;
+  while (i < end) {
+    size_t j = i + 1;
+    while (j < end && seqs[j][depth] == seqs[i][depth]) {
+      ++j;
+    }
+    int min, max;
+    std::tie(min, max) = seqs[i][depth];
+    Exp sub = min == max ? Byte(min) : ByteRange(min, max);
+    if (depth + 1 < seqs[i].size()) {
+      sub = Concatenation(sub, LowerByteRanges(seqs, i, j, depth + 1));
+    }
+    subs.push_back(sub);
+    i = j;
+  }
+  if (subs.size() == 1) {
+    return subs.front();
+  }
+  return Disjunction(subs, false);
+}
+
 class ExpandCharacterClasses : public Walker {
  public:
-  ExpandCharacterClasses() {}
+  ExpandCharacterClasses() : Walker(1 << kCharacterClass) {}
   ~ExpandCharacterClasses() override {}
 
+  // Lowers the rune ranges to sequences of byte ranges rather than to one
+  // sequence of bytes per rune, which matters for large (e.g. CJK) classes.
   Exp WalkCharacterClass(Exp exp) override {
-    std::list<Exp> subs;
-    for (Rune character : exp->character_class().first) {
-      subs.push_back(Character(character));
+    // Merge overlapping and adjacent rune ranges.
+    std::vector<std::pair<Rune, Rune>> ranges;
+    for (const auto& range : exp->character_class().first) {
+      if (!ranges.empty() && range.first <= ranges.back().second + 1) {
+        ranges.back().second = std::max(ranges.back().second, range.second);
+      } else {
+        ranges.push_back(range);
+      }
+    }
+    std::vector<ByteRanges> seqs;
+    for (const auto& range : ranges) {
+      SplitRuneRange(range.first, range.second, &seqs);
     }
-    Exp tmp = Disjunction(subs, false);
+    Exp tmp = seqs.empty() ? EmptySet()
+                           : LowerByteRanges(seqs, 0, seqs.size(), 0);
     if (exp->character_class().second) {
       tmp = Conjunction(Complement(tmp), AnyCharacter());
     }
@@ -1314,16 +2183,45 @@ class ExpandCharacterClasses : public Walker {
   ExpandCharacterClasses& operator=(const ExpandCharacterClasses&) = delete;
 };
 
+Exp InternedClass(const std::string& key, const std::function<Exp()>& build) {
+  static std::mutex mutex;
+  static std::map<std::string, int>* classes = new std::map<std::string, int>;
+  Interned* interned = InternedExpressions();
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = classes->find(key);
+  if (it != classes->end()) {
+    return interned[it->second].exp;
+  }
+  int n = ninterned.load(std::memory_order_relaxed);
+  if (n == kMaxInterned) {
+    return build();
+  }
+  interned[n].exp = Normalised(ExpandCharacterClasses().Walk(build()));
+  classes->insert(std::make_pair(key, n));
+  ninterned.store(n + 1, std::memory_order_release);
+  return interned[n].exp;
+}
+
+// Expands the quantifiers into Concatenations, Disjunctions and KleeneClosures
+// for the TNFA path. The DFA path has derivatives of quantifiers, so it expands
+// only the quantifiers whose expansions are no larger (e.g. r? and r+) and it
+// can afford a much higher limit on the (product of the) repetitions.
 class ExpandQuantifiers : public Walker {
  public:
-  ExpandQuantifiers(bool* exceeded)
-      : exceeded_(exceeded), stack_({1000}) {}
+  ExpandQuantifiers(bool* exceeded, bool expand)
+      : Walker(1 << kQuantifier),
+        exceeded_(exceeded),
+        expand_(expand),
+        stack_({expand ? 1000 : 100000}) {}
   ~ExpandQuantifiers() override {}
 
-  Exp WalkQuantifier(Exp exp) override {
-    Exp sub; int min; int max;
-    std::tie(sub, min, max) = exp->quantifier();
-    // Validate the repetition.
+  // Validates the repetition on the way down.
+  Exp PreWalk(Exp exp, bool* stop) override {
+    if (exp->kind() != kQuantifier) {
+      return exp;
+    }
+    int min; int max;
+    std::tie(std::ignore, min, max) = exp->quantifier();
     int limit = stack_.back();
     int rep = max;
     if (rep == -1) {
@@ -1332,16 +2230,29 @@ class ExpandQuantifiers : public Walker {
     if (rep > 0) {
       limit /= rep;
     }
-    if (limit == 0) {
+    if (limit == 0 || *exceeded_) {
       *exceeded_ = true;
+      *stop = true;
       return exp;
     }
     stack_.push_back(limit);
-    sub = Walk(sub);
+    return exp;
+  }
+
+  Exp WalkQuantifier(Exp exp, Exp sub) override {
+    int min; int max;
+    std::tie(std::ignore, min, max) = exp->quantifier();
     stack_.pop_back();
     if (*exceeded_) {
       return exp;
     }
+    if (!expand_ && (min > 1 || max > 1)) {
+      // r{n,} ≈ r{n} · r∗
+      if (max == -1) {
+        return Concatenation(Quantifier(sub, min, min), KleeneClosure(sub));
+      }
+      return Quantifier(sub, min, max);
+    }
     // Perform the repetition.
     Exp tmp;
     if (max == -1) {
@@ -1362,37 +2273,346 @@ class ExpandQuantifiers : public Walker {
 
  private:
   bool* exceeded_;
+  bool expand_;
   std::vector<int> stack_;
 
   ExpandQuantifiers(const ExpandQuantifiers&) = delete;
   ExpandQuantifiers& operator=(const ExpandQuantifiers&) = delete;
 };
 
+// Outputs the bytes of exp and returns true iff exp is a literal, which is to
+// say EmptyString, a Byte or a Concatenation of a Byte and a literal.
+static bool IsLiteral(const Expression* exp, std::string* literal) {
+  while (exp->kind() == kConcatenation &&
+         exp->subexpressions().front()->kind() == kByte) {
+    literal->push_back(
+        static_cast<char>(exp->subexpressions().front()->byte()));
+    exp = exp->subexpressions().back().get();
+  }
+  switch (exp->kind()) {
+    case kEmptyString:
+      return true;
+    case kByte:
+      literal->push_back(static_cast<char>(exp->byte()));
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Appends to subs the alternatives for literals, which must be sorted and
+// unique, as a trie: literals that share a prefix share it in the expression
+// too. As in Daciuk et al.'s incremental construction for sorted input, keep
+// the nodes along the path of the previous literal open and close those that
+// the next literal leaves, so this is linear in the total length.
+static void LowerLiterals(const std::vector<std::string>& literals,
+                          std::list<Exp>* subs) {
+  struct Node {
+    int byte;
+    bool terminal;
+    std::list<Exp> subs;
+  };
+  std::vector<Node> path;
+  path.push_back({-1, false, {}});
+  // Closes the deepest node and appends it to its parent.
+  auto close = [&path]() {
+    Node node = std::move(path.back());
+    path.pop_back();
+    if (node.terminal) {
+      node.subs.push_front(EmptyString());
+    }
+    Exp exp = node.subs.size() == 1 ? node.subs.front()
+                                    : Disjunction(node.subs, false);
+    if (exp->kind() != kEmptyString) {
+      exp = Concatenation(Byte(node.byte), exp);
+    } else {
+      exp = Byte(node.byte);
+    }
+    path.back().subs.push_back(exp);
+  };
+  const std::string* prev = nullptr;
+  for (const std::string& literal : literals) {
+    size_t prefix = 0;
+    if (prev != nullptr) {
+      while (prefix < prev->size() && prefix < literal.size() &&
+             (*prev)[prefix] == literal[prefix]) {
+        ++prefix;
+      }
+    }
+    while (path.size() > prefix + 1) {
+      close();
+    }
+    for (size_t i = prefix; i < literal.size(); ++i) {
+      path.push_back({static_cast<unsigned char>(literal[i]), false, {}});
+    }
+    path.back().terminal = true;
+    prev = &literal;
+  }
+  while (path.size() > 1) {
+    close();
+  }
+  if (path.back().terminal) {
+    subs->push_back(EmptyString());
+  }
+  subs->splice(subs->end(), path.back().subs);
+}
+
+// Factors the literal alternatives of each Disjunction into a trie for the DFA
+// path, where Disjunction is commutative. Otherwise, the derivatives of a large
+// alternation of keywords would have to normalise every keyword at every step.
+class FactorLiterals : public Walker {
+ public:
+  FactorLiterals() : Walker(1 << kDisjunction) {}
+  ~FactorLiterals() override {}
+
+  Exp WalkDisjunction(Exp exp, const std::list<Exp>& walked) override {
+    std::vector<std::string> literals;
+    std::list<Exp> subs;
+    for (const Exp& sub : walked) {
+      std::string literal;
+      if (IsLiteral(sub.get(), &literal)) {
+        literals.push_back(std::move(literal));
+      } else {
+        subs.push_back(sub);
+      }
+    }
+    std::sort(literals.begin(), literals.end());
+    // Leave exp be unless some literals have a prefix in common.
+    bool shared = false;
+    for (size_t i = 1; i < literals.size() && !shared; ++i) {
+      const std::string& prev = literals[i - 1];
+      shared = prev == literals[i] ||
+               (!prev.empty() && prev[0] == literals[i][0]);
+    }
+    if (!shared) {
+      return Walker::WalkDisjunction(exp, walked);
+    }
+    literals.erase(std::unique(literals.begin(), literals.end()),
+                   literals.end());
+    LowerLiterals(literals, &subs);
+    if (subs.size() == 1) {
+      return subs.front();
+    }
+    return Disjunction(subs, false);
+  }
+
+ private:
+  FactorLiterals(const FactorLiterals&) = delete;
+  FactorLiterals& operator=(const FactorLiterals&) = delete;
+};
+
+// Fuses walkers into one walk by handing each expression to the walker whose
+// kinds include its kind. This is equivalent to walking them in turn so long
+// as their kinds are disjoint and no walker builds expressions of the kinds of
+// the walkers after it.
+class Pipeline : public Walker {
+ public:
+  explicit Pipeline(std::initializer_list<Walker*> walkers)
+      : Walker(UnionOfKinds(walkers)), walkers_() {
+    for (Walker* walker : walkers) {
+      for (int kind = 0; kind <= kQuantifier; ++kind) {
+        if (walker->kinds() & (1 << kind)) {
+          if (walkers_[kind] != nullptr) {
+            abort();
+          }
+          walkers_[kind] = walker;
+        }
+      }
+    }
+  }
+  ~Pipeline() override {}
+
+  Exp PreWalk(Exp exp, bool* stop) override {
+    Walker* walker = walkers_[exp->kind()];
+    return walker != nullptr ? walker->PreWalk(exp, stop) : exp;
+  }
+
+  Exp WalkGroup(Exp exp, Exp sub) override {
+    Walker* walker = walkers_[kGroup];
+    return walker != nullptr ? walker->WalkGroup(exp, sub)
+                             : Walker::WalkGroup(exp, sub);
+  }
+
+  Exp WalkKleeneClosure(Exp exp, Exp sub) override {
+    Walker* walker = walkers_[kKleeneClosure];
+    return walker != nullptr ? walker->WalkKleeneClosure(exp, sub)
+                             : Walker::WalkKleeneClosure(exp, sub);
+  }
+
+  Exp WalkConcatenation(Exp exp, Exp head, Exp tail) override {
+    Walker* walker = walkers_[kConcatenation];
+    return walker != nullptr ? walker->WalkConcatenation(exp, head, tail)
+                             : Walker::WalkConcatenation(exp, head, tail);
+  }
+
+  Exp WalkComplement(Exp exp, Exp sub) override {
+    Walker* walker = walkers_[kComplement];
+    return walker != nullptr ? walker->WalkComplement(exp, sub)
+                             : Walker::WalkComplement(exp, sub);
+  }
+
+  Exp WalkConjunction(Exp exp, const std::list<Exp>& subs) override {
+    Walker* walker = walkers_[kConjunction];
+    return walker != nullptr ? walker->WalkConjunction(exp, subs)
+                             : Walker::WalkConjunction(exp, subs);
+  }
+
+  Exp WalkDisjunction(Exp exp, const std::list<Exp>& subs) override {
+    Walker* walker = walkers_[kDisjunction];
+    return walker != nullptr ? walker->WalkDisjunction(exp, subs)
+                             : Walker::WalkDisjunction(exp, subs);
+  }
+
+  Exp WalkCharacterClass(Exp exp) override {
+    Walker* walker = walkers_[kCharacterClass];
+    return walker != nullptr ? walker->WalkCharacterClass(exp)
+                             : Walker::WalkCharacterClass(exp);
+  }
+
+  Exp WalkQuantifier(Exp exp, Exp sub) override {
+    Walker* walker = walkers_[kQuantifier];
+    return walker != nullptr ? walker->WalkQuantifier(exp, sub)
+                             : Walker::WalkQuantifier(exp, sub);
+  }
+
+ private:
+  static int UnionOfKinds(std::initializer_list<Walker*> walkers) {
+    int kinds = 0;
+    for (Walker* walker : walkers) {
+      kinds |= walker->kinds();
+    }
+    return kinds;
+  }
+
+  Walker* walkers_[kQuantifier + 1];
+
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+};
+
+CompileStats::CompileStats()
+    : parse_time_(0),
+      rewrite_time_(0),
+      partitions_time_(0),
+      derivative_time_(0),
+      normalised_time_(0),
+      optimize_time_(0),
+      codegen_time_(0),
+      derivatives_(0),
+      cache_hits_(0),
+      peak_expressions_(0),
+      nstates_(0),
+      nclasses_(0),
+      nbytes_(0) {}
+
+CompileStats::~CompileStats() {}
+
+// Adds the time elapsed during its lifetime to *seconds.
+class StageTimer {
+ public:
+  explicit StageTimer(double* seconds)
+      : seconds_(seconds), start_(std::chrono::steady_clock::now()) {}
+
+  ~StageTimer() {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_;
+    *seconds_ += elapsed.count();
+  }
+
+ private:
+  double* seconds_;
+  std::chrono::steady_clock::time_point start_;
+
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+};
+
+// Updates the peak with the Expression nodes that the stage that began when
+// live_expressions was baseline has constructed and not yet destroyed.
+static void SampleExpressions(ptrdiff_t baseline, CompileStats* stats) {
+  ptrdiff_t live = live_expressions - baseline;
+  if (live > 0) {
+    stats->peak_expressions_ =
+        std::max(stats->peak_expressions_, static_cast<size_t>(live));
+  }
+}
+
 bool Parse(llvm::StringRef str, Exp* exp) {
-  yy::parser parser(&str, exp);
-  if (parser.parse() != 0) {
-    return false;
+  CompileStats stats;
+  return Parse(str, kParseDefault, exp, &stats);
+}
+
+bool Parse(llvm::StringRef str, Exp* exp, CompileStats* stats) {
+  return Parse(str, kParseDefault, exp, stats);
+}
+
+bool Parse(llvm::StringRef str, int flags, Exp* exp) {
+  CompileStats stats;
+  return Parse(str, flags, exp, &stats);
+}
+
+bool Parse(llvm::StringRef str, int flags, Exp* exp, CompileStats* stats) {
+  ptrdiff_t baseline = live_expressions;
+  {
+    StageTimer timer(&stats->parse_time_);
+    yy::parser parser(&str, flags, exp);
+    if (parser.parse() != 0) {
+      return false;
+    }
   }
-  *exp = FlattenConjunctionsAndDisjunctions().Walk(*exp);
-  *exp = StripGroups().Walk(*exp);
-  *exp = ExpandCharacterClasses().Walk(*exp);
+  SampleExpressions(baseline, stats);
+  StageTimer timer(&stats->rewrite_time_);
+  FlattenConjunctionsAndDisjunctions flatten;
+  StripGroups strip;
+  ExpandCharacterClasses classes;
   bool exceeded = false;
-  *exp = ExpandQuantifiers(&exceeded).Walk(*exp);
+  ExpandQuantifiers quantifiers(&exceeded, false);
+  *exp = Pipeline({&flatten, &strip, &classes, &quantifiers}).Walk(*exp);
+  // FactorLiterals needs the Disjunctions to be flattened already.
+  *exp = FactorLiterals().Walk(*exp);
+  SampleExpressions(baseline, stats);
   return !exceeded;
 }
 
 bool Parse(llvm::StringRef str, Exp* exp,
            std::vector<Mode>* modes, std::vector<int>* captures) {
-  yy::parser parser(&str, exp);
-  if (parser.parse() != 0) {
-    return false;
+  CompileStats stats;
+  return Parse(str, kParseDefault, exp, modes, captures, &stats);
+}
+
+bool Parse(llvm::StringRef str, Exp* exp,
+           std::vector<Mode>* modes, std::vector<int>* captures,
+           CompileStats* stats) {
+  return Parse(str, kParseDefault, exp, modes, captures, stats);
+}
+
+bool Parse(llvm::StringRef str, int flags, Exp* exp,
+           std::vector<Mode>* modes, std::vector<int>* captures) {
+  CompileStats stats;
+  return Parse(str, flags, exp, modes, captures, &stats);
+}
+
+bool Parse(llvm::StringRef str, int flags, Exp* exp,
+           std::vector<Mode>* modes, std::vector<int>* captures,
+           CompileStats* stats) {
+  ptrdiff_t baseline = live_expressions;
+  {
+    StageTimer timer(&stats->parse_time_);
+    yy::parser parser(&str, flags, exp);
+    if (parser.parse() != 0) {
+      return false;
+    }
   }
-  *exp = FlattenConjunctionsAndDisjunctions().Walk(*exp);
+  SampleExpressions(baseline, stats);
+  StageTimer timer(&stats->rewrite_time_);
+  // ApplyGroups builds Groups, so it can't be fused with NumberGroups.
   *exp = ApplyGroups().Walk(*exp);
-  *exp = NumberGroups(modes, captures).Walk(*exp);
-  *exp = ExpandCharacterClasses().Walk(*exp);
+  NumberGroups number(modes, captures);
+  ExpandCharacterClasses classes;
   bool exceeded = false;
-  *exp = ExpandQuantifiers(&exceeded).Walk(*exp);
+  ExpandQuantifiers quantifiers(&exceeded, true);
+  *exp = Pipeline({&number, &classes, &quantifiers}).Walk(*exp);
+  SampleExpressions(baseline, stats);
   return !exceeded;
 }
 
@@ -1411,7 +2631,8 @@ bool Match(Exp exp, llvm::StringRef str) {
 // Outputs the FA compiled from exp.
 // If tagged is true, uses Antimirov partial derivatives to construct a TNFA.
 // Otherwise, uses Brzozowski derivatives to construct a DFA.
-inline size_t CompileImpl(Exp exp, bool tagged, FA* fa) {
+inline size_t CompileImpl(Exp exp, bool tagged, FA* fa, CompileStats* stats) {
+  ptrdiff_t baseline = live_expressions;
   std::map<Exp, int> states;
   std::list<Exp> queue;
   auto LookupOrInsert = [&states, &queue](Exp exp) -> int {
@@ -1426,7 +2647,10 @@ inline size_t CompileImpl(Exp exp, bool tagged, FA* fa) {
   while (!queue.empty()) {
     exp = queue.front();
     queue.pop_front();
-    exp = Normalised(exp);
+    {
+      StageTimer timer(&stats->normalised_time_);
+      exp = Normalised(exp);
+    }
     int curr = LookupOrInsert(exp);
     if (exp->kind() == kEmptySet) {
       fa->error_ = curr;
@@ -1444,7 +2668,10 @@ inline size_t CompileImpl(Exp exp, bool tagged, FA* fa) {
       fa->accepting_[curr] = false;
     }
     std::list<std::bitset<256>>* partitions = &fa->partitions_[curr];
-    Partitions(exp, partitions);
+    {
+      StageTimer timer(&stats->partitions_time_);
+      Partitions(exp, partitions);
+    }
     for (std::list<std::bitset<256>>::const_iterator i = partitions->begin();
          i != partitions->end();
          ++i) {
@@ -1458,11 +2685,25 @@ inline size_t CompileImpl(Exp exp, bool tagged, FA* fa) {
       }
       if (tagged) {
         TNFA* tnfa = reinterpret_cast<TNFA*>(fa);
-        Outer outer = Partial(exp, byte);
+        Outer outer;
+        {
+          StageTimer timer(&stats->derivative_time_);
+          outer = Partial(exp, byte);
+        }
+        ++stats->derivatives_;
+        SampleExpressions(baseline, stats);
         std::set<std::pair<int, Bindings>> seen;
         for (const auto& j : *outer) {
-          Exp par = Normalised(j.first);
+          Exp par;
+          {
+            StageTimer timer(&stats->normalised_time_);
+            par = Normalised(j.first);
+          }
+          size_t nstates = states.size();
           int next = LookupOrInsert(par);
+          if (states.size() == nstates) {
+            ++stats->cache_hits_;
+          }
           if (seen.count(std::make_pair(next, j.second)) == 0) {
             seen.insert(std::make_pair(next, j.second));
             if (i == partitions->begin()) {
@@ -1481,9 +2722,22 @@ inline size_t CompileImpl(Exp exp, bool tagged, FA* fa) {
         }
       } else {
         DFA* dfa = reinterpret_cast<DFA*>(fa);
-        Exp der = Derivative(exp, byte);
-        der = Normalised(der);
+        Exp der;
+        {
+          StageTimer timer(&stats->derivative_time_);
+          der = Derivative(exp, byte);
+        }
+        ++stats->derivatives_;
+        SampleExpressions(baseline, stats);
+        {
+          StageTimer timer(&stats->normalised_time_);
+          der = Normalised(der);
+        }
+        size_t nstates = states.size();
         int next = LookupOrInsert(der);
+        if (states.size() == nstates) {
+          ++stats->cache_hits_;
+        }
         if (i == partitions->begin()) {
           // Set the "default" transition.
           dfa->transition_[std::make_pair(curr, byte)] = next;
@@ -1497,15 +2751,26 @@ inline size_t CompileImpl(Exp exp, bool tagged, FA* fa) {
       }
     }
   }
+  stats->nstates_ += states.size();
   return states.size();
 }
 
 size_t Compile(Exp exp, DFA* dfa) {
-  return CompileImpl(exp, false, dfa);
+  CompileStats stats;
+  return Compile(exp, dfa, &stats);
+}
+
+size_t Compile(Exp exp, DFA* dfa, CompileStats* stats) {
+  return CompileImpl(exp, false, dfa, stats);
 }
 
 size_t Compile(Exp exp, TNFA* tnfa) {
-  return CompileImpl(exp, true, tnfa);
+  CompileStats stats;
+  return Compile(exp, tnfa, &stats);
+}
+
+size_t Compile(Exp exp, TNFA* tnfa, CompileStats* stats) {
+  return CompileImpl(exp, true, tnfa, stats);
 }
 
 bool Match(const DFA& dfa, llvm::StringRef str) {
@@ -1644,11 +2909,55 @@ bool Match(const TNFA& tnfa, llvm::StringRef str,
   return false;
 }
 
+Profile::Profile()
+    : memchr_hits_(0),
+      memchr_misses_(0),
+      skipped_(0),
+      consumed_(0) {}
+
+Profile::~Profile() {}
+
+void Dump(const Profile& profile, std::string* str) {
+  str->clear();
+  *str += "memchr hits " + std::to_string(profile.memchr_hits_);
+  *str += " misses " + std::to_string(profile.memchr_misses_);
+  *str += " skipped " + std::to_string(profile.skipped_);
+  *str += " consumed " + std::to_string(profile.consumed_) + "\n";
+  std::vector<int> states(profile.visits_.size());
+  for (int i = 0; i < static_cast<int>(states.size()); ++i) {
+    states[i] = i;
+  }
+  std::stable_sort(states.begin(), states.end(), [&profile](int x, int y) {
+    return profile.visits_[x] > profile.visits_[y];
+  });
+  for (int i : states) {
+    *str += "state " + std::to_string(i);
+    *str += " visits " + std::to_string(profile.visits_[i]) + "\n";
+  }
+}
+
+void Dump(const CompileStats& stats, std::string* str) {
+  char buf[1024];
+  snprintf(buf, sizeof buf,
+           "%zu states, %zu byte classes, %zu bytes of machine code\n"
+           "%zu derivatives, %zu cache hits, %zu peak expressions\n"
+           "parse %.6fs, rewrite %.6fs\n"
+           "partitions %.6fs, derivative %.6fs, normalised %.6fs\n"
+           "optimize %.6fs, codegen %.6fs\n",
+           stats.nstates_, stats.nclasses_, stats.nbytes_,
+           stats.derivatives_, stats.cache_hits_, stats.peak_expressions_,
+           stats.parse_time_, stats.rewrite_time_,
+           stats.partitions_time_, stats.derivative_time_,
+           stats.normalised_time_,
+           stats.optimize_time_, stats.codegen_time_);
+  *str = buf;
+}
+
 typedef bool NativeMatch(const char*, size_t);
 
 static llvm::FunctionType* getNativeMatchFnTy(llvm::LLVMContext& context) {
   return llvm::FunctionType::get(llvm::Type::getInt1Ty(context),
-                                 {llvm::PointerType::getUnqual(context),
+                                 {llvm::Type::getInt8PtrTy(context),
                                   llvm::Type::getScalarTy<size_t>(context)},
                                  false);
 }
@@ -1660,6 +2969,10 @@ Fun::Fun() {
     llvm::InitializeNativeTargetAsmPrinter();
     llvm::InitializeNativeTargetAsmParser();
   });
+  profile_ = nullptr;
+  guide_ = nullptr;
+  unroll_ = 1;
+  opt_level_ = kOptDefault;
   context_.reset(new llvm::LLVMContext);
   module_ = new llvm::Module("M", *context_);
   engine_.reset(llvm::EngineBuilder(std::unique_ptr<llvm::Module>(module_))
@@ -1672,120 +2985,410 @@ Fun::Fun() {
 
 Fun::~Fun() {}
 
+// Scales the counts down to branch weights, which are only 32 bits.
+static std::vector<uint32_t> BranchWeights(
+    const std::vector<uint64_t>& counts) {
+  uint64_t max = *std::max_element(counts.begin(), counts.end());
+  uint64_t scale = max / UINT32_MAX + 1;
+  std::vector<uint32_t> weights;
+  weights.reserve(counts.size());
+  for (uint64_t count : counts) {
+    weights.push_back(count / scale);
+  }
+  return weights;
+}
+
+// The BasicBlocks for one DFA state in one copy of the automaton: the first
+// checks the bounds; the second consumes a byte and switches to the next DFA
+// state. index is the offset of the byte from the end of the string and next
+// is the offset of the byte after it.
+struct StateBlocks {
+  llvm::BasicBlock* bb0;
+  llvm::BasicBlock* bb1;
+  llvm::PHINode* index;
+  llvm::Value* next;
+};
+
+// Uses the profile to guide the optimisation passes and code generation.
+// The BasicBlocks of the DFA states are laid out in descending order of
+// visits and each branch gets weights. In addition, for each hot DFA state,
+// the dominant bytes are peeled off the switch into a chain of comparisons.
+// The last copy of the automaton is the one that checks for the end of the
+// string; any others are unrolled copies.
+static void GuideFunction(const Profile& guide,
+                          const std::vector<std::vector<StateBlocks>>& copies,
+                          llvm::Function* function) {
+  llvm::LLVMContext& context = function->getContext();  // for convenience
+  llvm::IRBuilder<> bb(context);
+  llvm::MDBuilder md(context);
+  int nstates = copies[0].size();
+  if (guide.visits_.size() < static_cast<size_t>(nstates) ||
+      guide.transitions_.size() < static_cast<size_t>(nstates) * 256) {
+    // The profile is for some other DFA.
+    return;
+  }
+  uint64_t total = 0;
+  for (int curr = 0; curr < nstates; ++curr) {
+    total += guide.visits_[curr];
+  }
+  if (total == 0) {
+    return;
+  }
+
+  // Lay out the DFA states, keeping the entry BasicBlock first.
+  std::vector<int> order(nstates);
+  for (int curr = 0; curr < nstates; ++curr) {
+    order[curr] = curr;
+  }
+  std::stable_sort(order.begin(), order.end(), [&guide](int x, int y) {
+    return guide.visits_[x] > guide.visits_[y];
+  });
+  llvm::BasicBlock* last = &function->getEntryBlock();
+  for (const auto& states : copies) {
+    for (int curr : order) {
+      states[curr].bb0->moveAfter(last);
+      states[curr].bb1->moveAfter(states[curr].bb0);
+      last = states[curr].bb1;
+    }
+  }
+
+  for (const auto& states : copies) {
+    for (int curr = 0; curr < nstates; ++curr) {
+      llvm::BasicBlock* bb0 = states[curr].bb0;
+      llvm::BasicBlock* bb1 = states[curr].bb1;
+      const uint64_t* transitions = &guide.transitions_[curr * 256];
+      uint64_t outgoing = 0;
+      for (int byte = 0; byte < 256; ++byte) {
+        outgoing += transitions[byte];
+      }
+      uint64_t visits = std::max(guide.visits_[curr], outgoing);
+
+      // Weight the end of the string against the next byte.
+      llvm::BranchInst* bra =
+          llvm::cast<llvm::BranchInst>(bb0->getTerminator());
+      if (&states == &copies.back() && bra->isConditional()) {
+        bra->setMetadata(llvm::LLVMContext::MD_prof, md.createBranchWeights(
+            BranchWeights({visits - outgoing, outgoing})));
+      }
+
+      // Peel off the dominant bytes of a hot DFA state: while one byte
+      // accounts for at least half of the remaining transitions, compare
+      // against it before falling through to the switch. At most four bytes
+      // are peeled.
+      llvm::SwitchInst* swi =
+          llvm::cast<llvm::SwitchInst>(bb1->getTerminator());
+      if (visits * 10 >= total) {
+        llvm::BasicBlock* from = bb1;
+        uint64_t remaining = outgoing;
+        for (int npeeled = 0; npeeled < 4 && swi->getNumCases() > 0;
+             ++npeeled) {
+          auto hottest = swi->case_begin();
+          for (auto i = swi->case_begin(); i != swi->case_end(); ++i) {
+            if (transitions[i->getCaseValue()->getZExtValue()] >
+                transitions[hottest->getCaseValue()->getZExtValue()]) {
+              hottest = i;
+            }
+          }
+          llvm::ConstantInt* value = hottest->getCaseValue();
+          llvm::BasicBlock* dest = hottest->getCaseSuccessor();
+          uint64_t count = transitions[value->getZExtValue()];
+          if (count == 0 || count * 2 < remaining) {
+            break;
+          }
+          llvm::BasicBlock* rest = from->splitBasicBlock(swi);
+          from->getTerminator()->eraseFromParent();
+          bb.SetInsertPoint(from);
+          llvm::BranchInst* cmp = bb.CreateCondBr(
+              bb.CreateICmpEQ(swi->getCondition(), value), dest, rest);
+          cmp->setMetadata(llvm::LLVMContext::MD_prof, md.createBranchWeights(
+              BranchWeights({count, remaining - count})));
+          swi->removeCase(hottest);
+          from = rest;
+          remaining -= count;
+        }
+      }
+
+      // Weight the default transition and the cases that remain.
+      std::vector<uint64_t> counts(1, 0);
+      std::bitset<256> cases;
+      for (auto i : swi->cases()) {
+        int byte = i.getCaseValue()->getZExtValue();
+        cases.set(byte);
+        counts.push_back(transitions[byte]);
+      }
+      for (int byte = 0; byte < 256; ++byte) {
+        if (!cases.test(byte)) {
+          counts[0] += transitions[byte];
+        }
+      }
+      swi->setMetadata(llvm::LLVMContext::MD_prof,
+                       md.createBranchWeights(BranchWeights(counts)));
+    }
+  }
+}
+
+// Outputs the byte to scan for with memchr(3) if the DFA begins by scanning
+// memory for a byte (or -1 if not) and the result if it is not found.
+static void FindMemchr(const DFA& dfa, int* memchr_byte, bool* memchr_fail) {
+  *memchr_byte = -1;
+  bool loops = false;
+  int ncases = 0;
+  int byte = -1;
+  for (auto i = dfa.transition_.lower_bound(std::make_pair(0, -1));
+       i != dfa.transition_.end() && i->first.first == 0;
+       ++i) {
+    if (i->first.second == -1) {
+      loops = i->second == 0;
+    } else {
+      ++ncases;
+      byte = i->first.second;
+    }
+  }
+  if (loops && ncases == 1) {
+    // What is the byte that we are trying to find?
+    *memchr_byte = byte;
+    // What should we return if we fail to find it?
+    *memchr_fail = dfa.IsAccepting(0);
+  }
+}
+
+// Describes the function to generate. Fun and Lib each fill one in.
+struct Codegen {
+  llvm::Function* function;
+  Profile* profile;
+  const Profile* guide;
+  int unroll;
+  // If true, the function calls memchr(3) itself. Otherwise, the caller is
+  // expected to do so using memchr_byte and memchr_fail.
+  bool call_memchr;
+  int memchr_byte;
+  bool memchr_fail;
+};
+
 // Generates the function for the DFA.
-static void GenerateFunction(const DFA& dfa, Fun* fun) {
-  llvm::LLVMContext& context = *fun->context_;  // for convenience
+// The function is generated in SSA form: the offset of the next byte from the
+// end of the string flows through PHINodes, counting up from -size, so that the
+// end of the string is reached at zero. (Comparing a pointer against the end
+// of the string instead makes jump threading simplify the comparison for every
+// incoming edge of every DFA state, which costs far more compile time.) When
+// unrolling, each group of bytes needs only one bounds check.
+static void GenerateFunction(const DFA& dfa, Codegen* codegen) {
+  llvm::Function* function = codegen->function;  // for convenience
+  llvm::LLVMContext& context = function->getContext();  // for convenience
   llvm::IRBuilder<> bb(context);
+  Profile* profile = codegen->profile;  // for convenience
+
+  auto sizeTy = llvm::Type::getScalarTy<size_t>(context);
+  auto int8PtrTy = llvm::Type::getInt8PtrTy(context);
+  auto int8Ty = llvm::Type::getInt8Ty(context);
+  auto int64Ty = llvm::Type::getInt64Ty(context);
+  auto int64PtrTy = llvm::Type::getInt64PtrTy(context);
 
-  // Create the entry BasicBlock and two automatic variables, then store the
-  // Function Arguments in the automatic variables.
+  // Create the entry BasicBlock and compute the end of the string.
   llvm::BasicBlock* entry =
-      llvm::BasicBlock::Create(context, "entry", fun->function_);
+      llvm::BasicBlock::Create(context, "entry", function);
   bb.SetInsertPoint(entry);
-  llvm::AllocaInst* data = bb.CreateAlloca(
-      llvm::PointerType::getUnqual(context), nullptr, "data");
-  llvm::AllocaInst* size = bb.CreateAlloca(
-      llvm::Type::getScalarTy<size_t>(context), nullptr, "size");
-  llvm::Function::arg_iterator arg = fun->function_->arg_begin();
-  bb.CreateStore(&*arg++, data);
-  bb.CreateStore(&*arg++, size);
+  llvm::Function::arg_iterator arg = function->arg_begin();
+  llvm::Value* data = &*arg++;
+  llvm::Value* size = &*arg++;
+  llvm::Value* end = bb.CreateGEP(int8Ty, data, size, "end");
 
   // Create a BasicBlock that returns true.
   llvm::BasicBlock* return_true =
-      llvm::BasicBlock::Create(context, "return_true", fun->function_);
+      llvm::BasicBlock::Create(context, "return_true", function);
   bb.SetInsertPoint(return_true);
   bb.CreateRet(bb.getTrue());
 
   // Create a BasicBlock that returns false.
   llvm::BasicBlock* return_false =
-      llvm::BasicBlock::Create(context, "return_false", fun->function_);
+      llvm::BasicBlock::Create(context, "return_false", function);
   bb.SetInsertPoint(return_false);
   bb.CreateRet(bb.getFalse());
 
-  // Create two BasicBlocks per DFA state: the first branches if we have hit
-  // the end of the string; the second switches to the next DFA state after
-  // updating the automatic variables.
-  std::vector<std::pair<llvm::BasicBlock*, llvm::BasicBlock*>> states;
-  states.reserve(dfa.accepting_.size());
-  for (const auto& i : dfa.accepting_) {
-    llvm::BasicBlock* bb0 =
-        llvm::BasicBlock::Create(context, "", fun->function_);
-    llvm::BasicBlock* bb1 =
-        llvm::BasicBlock::Create(context, "", fun->function_);
-
-    auto sizeTy = llvm::Type::getScalarTy<size_t>(context);
-    auto int8PtrTy = llvm::PointerType::getUnqual(context);
-    auto int8Ty = llvm::Type::getInt8Ty(context);
-
-    bb.SetInsertPoint(bb0);
-    bb.CreateCondBr(
-        bb.CreateIsNull(bb.CreateLoad(sizeTy, size)),
-        i.second ? return_true : return_false,
-        bb1);
-
-    bb.SetInsertPoint(bb1);
-    llvm::LoadInst* bytep = bb.CreateLoad(int8PtrTy, data);
-    llvm::LoadInst* byte = bb.CreateLoad(int8Ty, bytep);
-    bb.CreateStore(
-        bb.CreateGEP(int8Ty, bytep, bb.getInt64(1)),
-        data);
+  // Emits code to increment the counter at the address.
+  auto Count = [&bb, int64Ty](llvm::Value* counter) {
     bb.CreateStore(
-        bb.CreateSub(bb.CreateLoad(sizeTy, size), bb.getInt64(1)),
-        size);
-    // Set the "default" transition to ourselves for now. We could look it up,
-    // but its BasicBlock might not exist yet, so we will just fix it up later.
-    bb.CreateSwitch(byte, bb0);
+        bb.CreateAdd(bb.CreateLoad(int64Ty, counter), bb.getInt64(1)),
+        counter);
+  };
+  auto Constant = [&bb, int64PtrTy](uint64_t* counter) {
+    return bb.CreateIntToPtr(
+        bb.getInt64(reinterpret_cast<uintptr_t>(counter)), int64PtrTy);
+  };
 
-    states.push_back(std::make_pair(bb0, bb1));
+  // Create the copies of the automaton. Without unrolling, there is just one
+  // copy, which checks for the end of the string before each byte. With
+  // unrolling by a factor of N, the first copy checks that at least N bytes
+  // remain: if so, it and the next N-1 copies consume them unchecked; if not,
+  // the last copy consumes the rest of the string byte by byte as before.
+  int unroll = std::max(codegen->unroll, 1);
+  int ncopies = unroll == 1 ? 1 : unroll + 1;
+  std::vector<std::vector<StateBlocks>> copies(ncopies);
+  for (int copy = 0; copy < ncopies; ++copy) {
+    copies[copy].reserve(dfa.accepting_.size());
+    for (int curr = 0; curr < static_cast<int>(dfa.accepting_.size());
+         ++curr) {
+      StateBlocks state;
+      state.bb0 = llvm::BasicBlock::Create(context, "", function);
+      state.bb1 = llvm::BasicBlock::Create(context, "", function);
+      bb.SetInsertPoint(state.bb0);
+      state.index = bb.CreatePHI(sizeTy, 0);
+      bb.SetInsertPoint(state.bb1);
+      if (profile != nullptr) {
+        // Count the visit. The address of the counter is a constant.
+        Count(Constant(&profile->visits_[curr]));
+      }
+      llvm::LoadInst* byte =
+          bb.CreateLoad(int8Ty, bb.CreateGEP(int8Ty, end, state.index));
+      if (profile != nullptr) {
+        // Count the transition. The address of the row of counters is a
+        // constant; the byte indexes into it.
+        Count(bb.CreateGEP(
+            int64Ty, Constant(&profile->transitions_[curr * 256]),
+            bb.CreateZExt(byte, int64Ty)));
+      }
+      state.next = bb.CreateAdd(state.index, llvm::ConstantInt::get(sizeTy, 1));
+      // Set the "default" transition to ourselves for now. We could look it
+      // up, but its BasicBlock might not exist yet, so we will just fix it up
+      // later.
+      bb.CreateSwitch(byte, state.bb0);
+      copies[copy].push_back(state);
+    }
   }
 
-  // Wire up the BasicBlocks.
+  // Find the DFA states that are sinks: every byte loops, so the result is
+  // already known. (The error state is the most common example.) Unless we
+  // are profiling, they return immediately.
+  std::vector<bool> sinks(dfa.accepting_.size(), profile == nullptr);
   for (const auto& i : dfa.transition_) {
-    // Get the current DFA state.
-    llvm::BasicBlock* bb1 = states[i.first.first].second;
-    llvm::SwitchInst* swi = llvm::cast<llvm::SwitchInst>(bb1->getTerminator());
-    // Get the next DFA state.
-    llvm::BasicBlock* bb0 = states[i.second].first;
-    if (i.first.second == -1) {
-      // Set the "default" transition.
-      swi->setDefaultDest(bb0);
-    } else {
-      swi->addCase(llvm::ConstantInt::get(llvm::Type::getInt8Ty(context),
-                                          i.first.second),
-                   bb0);
+    if (i.second != i.first.first) {
+      sinks[i.first.first] = false;
     }
   }
 
-  // Plug in the entry BasicBlock.
-  bb.SetInsertPoint(entry);
-  bb.CreateBr(states[0].first);
-
-  // Do we begin by scanning memory for a byte? If so, we can make memchr(3) do
-  // that for us. It will almost certainly be vectorised and thus much faster.
-  {
-    llvm::BasicBlock* bb0 = states[0].first;
-    llvm::BasicBlock* bb1 = states[0].second;
-    llvm::BranchInst* bra = llvm::cast<llvm::BranchInst>(bb0->getTerminator());
-    llvm::SwitchInst* swi = llvm::cast<llvm::SwitchInst>(bb1->getTerminator());
-    if (swi->getDefaultDest() == bb0 &&
-        swi->getNumCases() == 1) {
-      // What is the byte that we are trying to find?
-      fun->memchr_byte_ = swi->case_begin()->getCaseValue()->getZExtValue();
-      // What should we return if we fail to find it?
-      fun->memchr_fail_ = bra->getSuccessor(0) == return_true;
-    } else {
-      fun->memchr_byte_ = -1;
+  // Fill in the bounds checks.
+  for (int copy = 0; copy < ncopies; ++copy) {
+    for (int curr = 0; curr < static_cast<int>(dfa.accepting_.size());
+         ++curr) {
+      const StateBlocks& state = copies[copy][curr];
+      bb.SetInsertPoint(state.bb0);
+      if (sinks[curr]) {
+        bb.CreateBr(dfa.IsAccepting(curr) ? return_true : return_false);
+      } else if (copy == ncopies - 1) {
+        // Check for the end of the string.
+        llvm::BasicBlock* done =
+            dfa.IsAccepting(curr) ? return_true : return_false;
+        if (profile != nullptr) {
+          // Count the visit on the way out.
+          llvm::BasicBlock* count =
+              llvm::BasicBlock::Create(context, "", function);
+          bb.SetInsertPoint(count);
+          Count(Constant(&profile->visits_[curr]));
+          bb.CreateBr(done);
+          bb.SetInsertPoint(state.bb0);
+          done = count;
+        }
+        bb.CreateCondBr(bb.CreateIsNull(state.index), done, state.bb1);
+      } else if (copy == 0) {
+        // Check for enough bytes to consume unchecked.
+        llvm::Value* remaining = bb.CreateNeg(state.index);
+        bb.CreateCondBr(
+            bb.CreateICmpUGE(remaining, llvm::ConstantInt::get(sizeTy, unroll)),
+            state.bb1,
+            copies[ncopies - 1][curr].bb0);
+      } else {
+        bb.CreateBr(state.bb1);
+      }
     }
   }
 
-  // Optimise the module.
-  // NOTE(junyer): This was cargo-culted from Clang. Ordering matters!
-  llvm::LoopAnalysisManager lam;
+  // Wire up the BasicBlocks. Each copy switches to the next copy; the last of
+  // the unrolled copies switches back to the first and the last copy switches
+  // to itself.
+  for (int copy = 0; copy < ncopies; ++copy) {
+    int next_copy = copy == ncopies - 1 ? copy : (copy + 1) % unroll;
+    for (const auto& i : dfa.transition_) {
+      // Get the current DFA state.
+      llvm::BasicBlock* bb1 = copies[copy][i.first.first].bb1;
+      llvm::SwitchInst* swi =
+          llvm::cast<llvm::SwitchInst>(bb1->getTerminator());
+      // Get the next DFA state.
+      llvm::BasicBlock* bb0 = copies[next_copy][i.second].bb0;
+      if (i.first.second == -1) {
+        // Set the "default" transition.
+        swi->setDefaultDest(bb0);
+      } else {
+        swi->addCase(llvm::ConstantInt::get(int8Ty, i.first.second), bb0);
+      }
+    }
+  }
+
+  // Do we begin by scanning memory for a byte? If so, we can make memchr(3) do
+  // that for us. It will almost certainly be vectorised and thus much faster.
+  FindMemchr(dfa, &codegen->memchr_byte, &codegen->memchr_fail);
+
+  // Plug in the entry BasicBlock.
+  bb.SetInsertPoint(entry);
+  llvm::Value* start;
+  if (codegen->call_memchr && codegen->memchr_byte != -1) {
+    llvm::FunctionCallee memchr = function->getParent()->getOrInsertFunction(
+        "memchr", llvm::FunctionType::get(
+                      int8PtrTy, {int8PtrTy, bb.getInt32Ty(), sizeTy}, false));
+    llvm::Value* found = bb.CreateCall(
+        memchr, {data, bb.getInt32(codegen->memchr_byte), size});
+    start = bb.CreateSub(bb.CreatePtrToInt(found, sizeTy),
+                         bb.CreatePtrToInt(end, sizeTy));
+    bb.CreateCondBr(bb.CreateIsNull(found),
+                    codegen->memchr_fail ? return_true : return_false,
+                    copies[0][0].bb0);
+  } else {
+    start = bb.CreateNeg(size);
+    bb.CreateBr(copies[0][0].bb0);
+  }
+
+  if (codegen->guide != nullptr) {
+    GuideFunction(*codegen->guide, copies, function);
+  }
+
+  // Now that the control flow is final, fill in the PHINodes. The offset
+  // flows in from the entry BasicBlock, from the bounds check of the first
+  // copy when the last copy takes over or else from the consumption of a byte.
+  // Any BasicBlocks split off by GuideFunction() belong to their predecessor.
+  std::map<llvm::BasicBlock*, llvm::Value*> outgoing;
+  outgoing[entry] = start;
+  for (const auto& states : copies) {
+    for (const auto& state : states) {
+      outgoing[state.bb1] = state.next;
+    }
+  }
+  if (ncopies > 1) {
+    for (const auto& state : copies[0]) {
+      outgoing[state.bb0] = state.index;
+    }
+  }
+  for (const auto& states : copies) {
+    for (const auto& state : states) {
+      for (llvm::BasicBlock* pred : llvm::predecessors(state.bb0)) {
+        llvm::BasicBlock* owner = pred;
+        while (outgoing.find(owner) == outgoing.end()) {
+          owner = owner->getSinglePredecessor();
+        }
+        state.index->addIncoming(outgoing[owner], pred);
+      }
+    }
+  }
+}
+
+// Optimises the module for the target.
+static void OptimiseModule(llvm::Module* module, llvm::TargetMachine* target,
+                           OptLevel opt_level, CompileStats* stats) {
+  // NOTE(junyer): This was cargo-culted from Clang. Ordering matters!
+  llvm::LoopAnalysisManager lam;
   llvm::FunctionAnalysisManager fam;
   llvm::CGSCCAnalysisManager cam;
   llvm::ModuleAnalysisManager mam;
 
-  llvm::PassBuilder pb(fun->engine_->getTargetMachine());
+  llvm::PassBuilder pb(target);
   pb.registerModuleAnalyses(mam);
   pb.registerCGSCCAnalyses(cam);
   pb.registerFunctionAnalyses(fam);
@@ -1793,9 +3396,31 @@ static void GenerateFunction(const DFA& dfa, Fun* fun) {
   pb.registerModuleAnalyses(mam);
   pb.crossRegisterProxies(lam, fam, cam, mam);
 
-  llvm::ModulePassManager mpm =
-      pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
-  mpm.run(*fun->module_, mam);
+  StageTimer timer(&stats->optimize_time_);
+  llvm::ModulePassManager mpm;
+  switch (opt_level) {
+    case kOptNone:
+      break;
+
+    case kOptMinimal: {
+      // The function is already in SSA form, so just tidy up the control flow
+      // and fold the instructions.
+      llvm::FunctionPassManager fpm;
+      fpm.addPass(llvm::SimplifyCFGPass());
+      fpm.addPass(llvm::InstCombinePass());
+      mpm.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(fpm)));
+      break;
+    }
+
+    case kOptDefault:
+      mpm = pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
+      break;
+
+    case kOptAggressive:
+      mpm = pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3);
+      break;
+  }
+  mpm.run(*module, mam);
 }
 
 // This seems to be the only way to discover the machine code size.
@@ -1831,8 +3456,29 @@ class DiscoverMachineCodeSize : public llvm::JITEventListener {
   DiscoverMachineCodeSize& operator=(const DiscoverMachineCodeSize&) = delete;
 };
 
+// Sets the code generation level of the target.
+static void SetCodeGenLevel(llvm::TargetMachine* target, OptLevel opt_level) {
+  switch (opt_level) {
+    case kOptNone:
+      target->setOptLevel(llvm::CodeGenOpt::None);
+      target->setFastISel(true);
+      break;
+
+    case kOptMinimal:
+    case kOptDefault:
+      target->setOptLevel(llvm::CodeGenOpt::Default);
+      break;
+
+    case kOptAggressive:
+      target->setOptLevel(llvm::CodeGenOpt::Aggressive);
+      break;
+  }
+}
+
 // Generates the machine code for the function.
-static void GenerateMachineCode(Fun* fun) {
+static void GenerateMachineCode(Fun* fun, CompileStats* stats) {
+  StageTimer timer(&stats->codegen_time_);
+  SetCodeGenLevel(fun->engine_->getTargetMachine(), fun->opt_level_);
   DiscoverMachineCodeSize dmcs(fun);
   fun->engine_->RegisterJITEventListener(&dmcs);
   fun->engine_->finalizeObject();
@@ -1840,21 +3486,998 @@ static void GenerateMachineCode(Fun* fun) {
 }
 
 size_t Compile(const DFA& dfa, Fun* fun) {
-  GenerateFunction(dfa, fun);
-  GenerateMachineCode(fun);
+  CompileStats stats;
+  return Compile(dfa, fun, &stats);
+}
+
+size_t Compile(const DFA& dfa, Fun* fun, CompileStats* stats) {
+  if (fun->profile_ != nullptr &&
+      fun->profile_->visits_.size() < dfa.accepting_.size()) {
+    fun->profile_->visits_.resize(dfa.accepting_.size());
+    fun->profile_->transitions_.resize(dfa.accepting_.size() * 256);
+  }
+  Codegen codegen;
+  codegen.function = fun->function_;
+  codegen.profile = fun->profile_;
+  codegen.guide = fun->guide_;
+  codegen.unroll = fun->unroll_;
+  // Match() calls memchr(3) before calling the function.
+  codegen.call_memchr = false;
+  GenerateFunction(dfa, &codegen);
+  fun->memchr_byte_ = codegen.memchr_byte;
+  fun->memchr_fail_ = codegen.memchr_fail;
+  OptimiseModule(fun->module_, fun->engine_->getTargetMachine(),
+                 fun->opt_level_, stats);
+  GenerateMachineCode(fun, stats);
+  stats->nbytes_ += fun->machine_code_size_;
   return fun->machine_code_size_;
 }
 
 bool Match(const Fun& fun, llvm::StringRef str) {
+  Profile* profile = fun.profile_;
   if (fun.memchr_byte_ != -1) {
     const void* ptr = memchr(str.data(), fun.memchr_byte_, str.size());
     if (ptr == nullptr) {
+      if (profile != nullptr) {
+        ++profile->memchr_misses_;
+        profile->skipped_ += str.size();
+      }
       return fun.memchr_fail_;
     }
-    str = str.drop_front(reinterpret_cast<const char*>(ptr) - str.data());
+    size_t skipped = reinterpret_cast<const char*>(ptr) - str.data();
+    if (profile != nullptr) {
+      ++profile->memchr_hits_;
+      profile->skipped_ += skipped;
+    }
+    str = str.drop_front(skipped);
+  }
+  if (profile != nullptr) {
+    profile->consumed_ += str.size();
   }
   NativeMatch* match = reinterpret_cast<NativeMatch*>(fun.machine_code_addr_);
   return (*match)(str.data(), str.size());
 }
 
+Lib::Lib() {
+  static std::once_flag once_flag;
+  std::call_once(once_flag, []() {
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllAsmPrinters();
+  });
+  triple_ = llvm::sys::getDefaultTargetTriple();
+  cpu_ = "generic";
+  opt_level_ = kOptDefault;
+  unroll_ = 1;
+  context_.reset(new llvm::LLVMContext);
+  module_.reset(new llvm::Module("M", *context_));
+}
+
+Lib::~Lib() {}
+
+bool Compile(const DFA& dfa, llvm::StringRef name, Lib* lib) {
+  if (lib->target_ == nullptr) {
+    std::string error;
+    const llvm::Target* target =
+        llvm::TargetRegistry::lookupTarget(lib->triple_, error);
+    if (target == nullptr) {
+      return false;
+    }
+    lib->target_.reset(target->createTargetMachine(
+        lib->triple_, lib->cpu_, "", llvm::TargetOptions(),
+        llvm::Reloc::PIC_));
+    if (lib->target_ == nullptr) {
+      return false;
+    }
+    lib->module_->setTargetTriple(lib->triple_);
+    lib->module_->setDataLayout(lib->target_->createDataLayout());
+  }
+  if (lib->module_->getFunction(name) != nullptr) {
+    return false;
+  }
+  llvm::Function* function =
+      llvm::Function::Create(getNativeMatchFnTy(*lib->context_),
+                             llvm::GlobalValue::ExternalLinkage, name,
+                             lib->module_.get());
+  // C and C++ callers expect bool to be zero-extended.
+  function->addRetAttr(llvm::Attribute::ZExt);
+  function->addFnAttr(llvm::Attribute::NoUnwind);
+  Codegen codegen;
+  codegen.function = function;
+  codegen.profile = nullptr;
+  codegen.guide = nullptr;
+  codegen.unroll = lib->unroll_;
+  // There is no Match() to call memchr(3), so the function must do so.
+  codegen.call_memchr = true;
+  GenerateFunction(dfa, &codegen);
+  return true;
+}
+
+bool Emit(Lib* lib, std::string* object) {
+  if (lib->target_ == nullptr) {
+    return false;
+  }
+  CompileStats stats;
+  OptimiseModule(lib->module_.get(), lib->target_.get(), lib->opt_level_,
+                 &stats);
+  SetCodeGenLevel(lib->target_.get(), lib->opt_level_);
+  llvm::SmallVector<char, 0> buffer;
+  llvm::raw_svector_ostream os(buffer);
+  llvm::legacy::PassManager pm;
+  if (lib->target_->addPassesToEmitFile(pm, os, nullptr,
+                                        llvm::CGFT_ObjectFile)) {
+    return false;
+  }
+  pm.run(*lib->module_);
+  object->assign(buffer.begin(), buffer.end());
+  return true;
+}
+
+// The negative values in Table::lines_.
+enum {
+  kScanMatch = -1,    // The line ended and matched.
+  kScanNoMatch = -2,  // The line ended and did not match.
+  kScanAccept = -3,   // The rest of the line will match.
+  kScanReject = -4,   // The rest of the line will not match.
+};
+
+Table::Table() : nclasses_(0) {}
+
+Table::~Table() {}
+
+size_t Compile(const DFA& dfa, Table* table) {
+  CompileStats stats;
+  return Compile(dfa, table, &stats);
+}
+
+size_t Compile(const DFA& dfa, Table* table, CompileStats* stats) {
+  // Expand the transitions into a full row of 256 bytes per DFA state.
+  int nstates = dfa.accepting_.size();
+  std::vector<int> dense(nstates * 256, -1);
+  for (const auto& i : dfa.transition_) {
+    int curr = i.first.first;
+    int byte = i.first.second;
+    if (byte != -1) {
+      dense[curr * 256 + byte] = i.second;
+    }
+  }
+  for (const auto& i : dfa.transition_) {
+    int curr = i.first.first;
+    int byte = i.first.second;
+    if (byte == -1) {
+      // Apply the "default" transition.
+      for (int j = curr * 256; j < (curr + 1) * 256; ++j) {
+        if (dense[j] == -1) {
+          dense[j] = i.second;
+        }
+      }
+    }
+  }
+  // Refine the byte classes one DFA state at a time: two bytes remain in the
+  // same byte class iff every DFA state so far has the same next state for
+  // both of them. The newline byte starts off in a byte class of its own for
+  // the sake of Scan().
+  std::vector<int> classes(256, 0);
+  classes['\n'] = 1;
+  int nclasses = 2;
+  for (int curr = 0; curr < nstates; ++curr) {
+    std::map<std::pair<int, int>, int> refined;
+    for (int byte = 0; byte < 256; ++byte) {
+      auto key = std::make_pair(classes[byte], dense[curr * 256 + byte]);
+      auto it = refined.insert(std::make_pair(key, refined.size()));
+      classes[byte] = it.first->second;
+    }
+    nclasses = refined.size();
+  }
+  table->nclasses_ = nclasses;
+  stats->nclasses_ += nclasses;
+  for (int byte = 0; byte < 256; ++byte) {
+    table->classes_[byte] = classes[byte];
+  }
+  table->transition_.assign(nstates * nclasses, 0);
+  for (int curr = 0; curr < nstates; ++curr) {
+    for (int byte = 0; byte < 256; ++byte) {
+      int next = dense[curr * 256 + byte];
+      table->transition_[curr * nclasses + classes[byte]] = next * nclasses;
+    }
+  }
+  table->accepting_.resize(nstates);
+  for (const auto& i : dfa.accepting_) {
+    table->accepting_[i.first] = i.second;
+  }
+  // Determine which DFA states decide the rest of the line: any byte other
+  // than the newline byte loops, whereupon the outcome is the same whether
+  // the line ends with the newline byte or with the end of the string.
+  int newline = classes['\n'];
+  std::vector<int> decided(nstates, 0);
+  for (int curr = 0; curr < nstates; ++curr) {
+    const int* row = &table->transition_[curr * nclasses];
+    bool loops = true;
+    for (int i = 0; i < nclasses; ++i) {
+      if (i != newline && row[i] != curr * nclasses) {
+        loops = false;
+        break;
+      }
+    }
+    bool accepting = table->accepting_[curr];
+    if (loops && accepting == table->accepting_[row[newline] / nclasses]) {
+      decided[curr] = accepting ? kScanAccept : kScanReject;
+    }
+  }
+  table->lines_ = table->transition_;
+  for (int curr = 0; curr < nstates; ++curr) {
+    int* row = &table->lines_[curr * nclasses];
+    for (int i = 0; i < nclasses; ++i) {
+      if (i == newline) {
+        row[i] = table->accepting_[row[i] / nclasses] ? kScanMatch
+                                                      : kScanNoMatch;
+      } else if (decided[row[i] / nclasses] != 0) {
+        row[i] = decided[row[i] / nclasses];
+      }
+    }
+  }
+  return table->transition_.size() * sizeof(int);
+}
+
+bool Match(const Table& table, llvm::StringRef str) {
+  const int* transition = table.transition_.data();
+  const uint8_t* classes = table.classes_;
+  int curr = 0;
+  for (char c : str) {
+    curr = transition[curr + classes[static_cast<unsigned char>(c)]];
+  }
+  return table.accepting_[curr / table.nclasses_];
+}
+
+bool Match(const Table& table, llvm::StringRef str, Profile* profile) {
+  const int* transition = table.transition_.data();
+  const uint8_t* classes = table.classes_;
+  int nclasses = table.nclasses_;
+  if (profile->visits_.size() < table.accepting_.size()) {
+    profile->visits_.resize(table.accepting_.size());
+    profile->transitions_.resize(table.accepting_.size() * 256);
+  }
+  uint64_t* visits = profile->visits_.data();
+  uint64_t* transitions = profile->transitions_.data();
+  int curr = 0;
+  ++visits[0];
+  for (char c : str) {
+    int byte = static_cast<unsigned char>(c);
+    ++transitions[curr / nclasses * 256 + byte];
+    curr = transition[curr + classes[byte]];
+    ++visits[curr / nclasses];
+  }
+  profile->consumed_ += str.size();
+  return table.accepting_[curr / nclasses];
+}
+
+void Match(const Table& table, const std::vector<llvm::StringRef>& strs,
+           std::vector<bool>* matches) {
+  // Eight lanes are enough to cover the load latency without spilling.
+  static constexpr int kLanes = 8;
+  const int* transition = table.transition_.data();
+  const uint8_t* classes = table.classes_;
+  matches->resize(strs.size());
+  // Each lane holds the rest of one string. An idle lane holds nothing and
+  // its index is strs.size().
+  const unsigned char* data[kLanes];
+  size_t size[kLanes];
+  int curr[kLanes];
+  size_t index[kLanes];
+  for (int k = 0; k < kLanes; ++k) {
+    size[k] = 0;
+    curr[k] = 0;
+    index[k] = strs.size();
+  }
+  size_t next = 0;
+  for (;;) {
+    // Record the result for each lane that has finished its string and load
+    // the next pending string into it, so that no lane waits for the others.
+    size_t step = SIZE_MAX;
+    for (int k = 0; k < kLanes; ++k) {
+      while (size[k] == 0) {
+        if (index[k] < strs.size()) {
+          (*matches)[index[k]] = table.accepting_[curr[k] / table.nclasses_];
+          index[k] = strs.size();
+        }
+        if (next == strs.size()) {
+          break;
+        }
+        index[k] = next;
+        data[k] = reinterpret_cast<const unsigned char*>(strs[next].data());
+        size[k] = strs[next].size();
+        curr[k] = 0;
+        ++next;
+      }
+      step = std::min(step, size[k]);
+    }
+    if (step == 0) {
+      // There are no more pending strings, so some lane is idle.
+      break;
+    }
+    // Advance every lane as far as the one with the least remaining. The
+    // inner loop has a constant trip count, so it should be fully unrolled.
+    for (size_t j = 0; j < step; ++j) {
+      for (int k = 0; k < kLanes; ++k) {
+        curr[k] = transition[curr[k] + classes[data[k][j]]];
+      }
+    }
+    for (int k = 0; k < kLanes; ++k) {
+      data[k] += step;
+      size[k] -= step;
+    }
+  }
+  // Finish the remaining lanes individually.
+  for (int k = 0; k < kLanes; ++k) {
+    if (index[k] < strs.size()) {
+      for (size_t j = 0; j < size[k]; ++j) {
+        curr[k] = transition[curr[k] + classes[data[k][j]]];
+      }
+      (*matches)[index[k]] = table.accepting_[curr[k] / table.nclasses_];
+    }
+  }
+}
+
+void Scan(const Table& table, llvm::StringRef str,
+          std::vector<llvm::StringRef>* lines) {
+  const int* transition = table.lines_.data();
+  const uint8_t* classes = table.classes_;
+  const char* begin = str.data();
+  const char* end = str.data() + str.size();
+  const char* ptr = begin;
+  int curr = 0;
+  while (ptr < end) {
+    int next = transition[curr + classes[static_cast<unsigned char>(*ptr++)]];
+    if (next >= 0) {
+      curr = next;
+      continue;
+    }
+    if (next == kScanAccept || next == kScanReject) {
+      // Skip to the end of the line. We could keep stepping through the loop,
+      // but memchr(3) will almost certainly be vectorised and thus faster.
+      const void* eol = memchr(ptr, '\n', end - ptr);
+      ptr = eol == nullptr ? end : reinterpret_cast<const char*>(eol) + 1;
+    }
+    if (next == kScanMatch || next == kScanAccept) {
+      lines->push_back(llvm::StringRef(begin, ptr - begin));
+    }
+    begin = ptr;
+    curr = 0;
+  }
+  // Handle the last line if it didn't end with the newline byte.
+  if (begin < end && table.accepting_[curr / table.nclasses_]) {
+    lines->push_back(llvm::StringRef(begin, end - begin));
+  }
+}
+
+Prefilter::Prefilter()
+    : nbytes_(0), masks_(), nclasses_(0), classes_(), accepting_(0) {}
+
+Prefilter::~Prefilter() {}
+
+// The limits on the literals for a prefilter. Longer literals hardly rule out
+// any more strings. More literals make false positives more likely, so beyond
+// kMaxTeddyLiterals, only Disjunctions (e.g. of keywords) may add literals and
+// the literals must be at least kMinAhoCorasickLength bytes long. Even so, the
+// automaton must fit in kMaxAhoCorasickTransitions.
+static constexpr size_t kMaxTeddyLiterals = 64;
+static constexpr size_t kMaxPrefilterLiterals = 1 << 14;
+static constexpr size_t kMaxPrefilterLength = 16;
+static constexpr size_t kMinAhoCorasickLength = 3;
+static constexpr size_t kMaxAhoCorasickTransitions = 1 << 22;
+
+// Beyond this depth, PrefilterLiterals() gives up rather than recursing.
+// Concatenations are handled iteratively, so this is rarely reached.
+static constexpr int kMaxPrefilterDepth = 100;
+
+// Represents what the prefilter knows about an expression. If exact, its
+// language is exactly strings. Otherwise, every string in its language has
+// one of strings as a substring, which says nothing if strings contains "".
+struct PrefilterInfo {
+  bool exact;
+  std::set<std::string> strings;
+};
+
+static PrefilterInfo AnyString() {
+  return {false, {""}};
+}
+
+// Returns the better of x and y as literals for the prefilter: the one whose
+// shortest literal is longer or, failing that, the one with fewer literals.
+static const std::set<std::string>& Better(const std::set<std::string>& x,
+                                           const std::set<std::string>& y) {
+  auto shortest = [](const std::set<std::string>& strings) -> size_t {
+    size_t min = SIZE_MAX;
+    for (const std::string& str : strings) {
+      min = std::min(min, str.size());
+    }
+    return min;
+  };
+  size_t x_shortest = shortest(x);
+  size_t y_shortest = shortest(y);
+  if (x_shortest != y_shortest) {
+    return x_shortest > y_shortest ? x : y;
+  }
+  return x.size() <= y.size() ? x : y;
+}
+
+// Outputs the concatenation of every string in x with every string in y.
+// Returns false if there would be too many literals or they would be too long.
+// Concatenating with a single string (e.g. the prefix of a trie node) does not
+// make for more literals, so that is fine however many there are.
+static bool CrossProduct(const std::set<std::string>& x,
+                         const std::set<std::string>& y,
+                         std::set<std::string>* product) {
+  if (x.size() * y.size() >
+      std::max({kMaxTeddyLiterals, x.size(), y.size()})) {
+    return false;
+  }
+  for (const std::string& head : x) {
+    for (const std::string& tail : y) {
+      if (head.size() + tail.size() > kMaxPrefilterLength) {
+        return false;
+      }
+      product->insert(head + tail);
+    }
+  }
+  return true;
+}
+
+static PrefilterInfo PrefilterLiterals(Exp exp, int depth) {
+  if (depth > kMaxPrefilterDepth) {
+    return AnyString();
+  }
+  switch (exp->kind()) {
+    case kEmptySet:
+      return {true, {}};
+
+    case kEmptyString:
+      return {true, {""}};
+
+    case kGroup:
+      return PrefilterLiterals(std::get<1>(exp->group()), depth + 1);
+
+    case kAnyByte:
+      return AnyString();
+
+    case kByte:
+      return {true, {std::string(1, static_cast<char>(exp->byte()))}};
+
+    case kByteRange: {
+      int min, max;
+      std::tie(min, max) = exp->byte_range();
+      if (static_cast<size_t>(max - min + 1) > kMaxTeddyLiterals) {
+        return AnyString();
+      }
+      PrefilterInfo info = {true, {}};
+      for (int byte = min; byte <= max; ++byte) {
+        info.strings.insert(std::string(1, static_cast<char>(byte)));
+      }
+      return info;
+    }
+
+    case kKleeneClosure:
+    case kComplement:
+      return AnyString();
+
+    case kConcatenation: {
+      // Flatten the Concatenations (typically, a long spine of them) and then
+      // multiply out the runs of exact factors, keeping the best literals.
+      std::vector<Exp> factors;
+      std::vector<Exp> stack = {exp};
+      while (!stack.empty()) {
+        Exp factor = std::move(stack.back());
+        stack.pop_back();
+        if (factor->kind() == kConcatenation) {
+          stack.push_back(factor->tail());
+          stack.push_back(factor->head());
+        } else {
+          factors.push_back(std::move(factor));
+        }
+      }
+      bool exact = true;
+      std::set<std::string> run = {""};
+      std::set<std::string> best = {""};
+      for (const Exp& factor : factors) {
+        PrefilterInfo info = PrefilterLiterals(factor, depth + 1);
+        if (!info.exact) {
+          exact = false;
+          best = Better(best, Better(run, info.strings));
+          run = {""};
+          continue;
+        }
+        std::set<std::string> product;
+        if (CrossProduct(run, info.strings, &product)) {
+          run.swap(product);
+        } else {
+          exact = false;
+          best = Better(best, run);
+          run.swap(info.strings);
+        }
+      }
+      if (exact) {
+        return {true, run};
+      }
+      return {false, Better(best, run)};
+    }
+
+    case kConjunction: {
+      // Every string in the language is in the language of every subexpression.
+      std::set<std::string> best = {""};
+      for (Exp sub : exp->subexpressions()) {
+        best = Better(best, PrefilterLiterals(sub, depth + 1).strings);
+      }
+      return {false, best};
+    }
+
+    case kDisjunction: {
+      PrefilterInfo info = {true, {}};
+      for (Exp sub : exp->subexpressions()) {
+        PrefilterInfo tmp = PrefilterLiterals(sub, depth + 1);
+        info.exact = info.exact && tmp.exact;
+        info.strings.insert(tmp.strings.begin(), tmp.strings.end());
+        if (info.strings.size() > kMaxPrefilterLiterals) {
+          return AnyString();
+        }
+      }
+      return info;
+    }
+
+    case kCharacterClass:
+      break;
+
+    case kQuantifier: {
+      Exp sub; int min; int max;
+      std::tie(sub, min, max) = exp->quantifier();
+      if (min == 0) {
+        return AnyString();
+      }
+      PrefilterInfo info = PrefilterLiterals(sub, depth + 1);
+      if (!info.exact) {
+        return info;
+      }
+      // Multiply out the first min repetitions, as far as the limits allow.
+      std::set<std::string> power = info.strings;
+      for (int i = 1; i < min; ++i) {
+        std::set<std::string> product;
+        if (!CrossProduct(power, info.strings, &product)) {
+          return {false, power};
+        }
+        power.swap(product);
+      }
+      return {min == max, power};
+    }
+  }
+  abort();
+}
+
+// Builds the Aho-Corasick automaton for the literals. Returns false if it would
+// have too many transitions.
+static bool CompileAhoCorasick(Prefilter* prefilter) {
+  // Give each byte that occurs in some literal a byte class of its own.
+  bool occurs[256] = {};
+  for (const std::string& literal : prefilter->literals_) {
+    for (char c : literal) {
+      occurs[static_cast<unsigned char>(c)] = true;
+    }
+  }
+  int nclasses = std::count(occurs, occurs + 256, true);
+  int next_class = nclasses < 256 ? 1 : 0;
+  nclasses += next_class;
+  for (int byte = 0; byte < 256; ++byte) {
+    prefilter->classes_[byte] = occurs[byte] ? next_class++ : 0;
+  }
+  // Build the trie, in which -1 means that there is no such child yet.
+  std::vector<int> transition(nclasses, -1);
+  std::vector<int> lengths(1, 0);
+  for (const std::string& literal : prefilter->literals_) {
+    int curr = 0;
+    for (char c : literal) {
+      int i = curr * nclasses +
+              prefilter->classes_[static_cast<unsigned char>(c)];
+      if (transition[i] == -1) {
+        if (transition.size() + nclasses > kMaxAhoCorasickTransitions) {
+          return false;
+        }
+        transition[i] = lengths.size();
+        transition.resize(transition.size() + nclasses, -1);
+        lengths.push_back(0);
+      }
+      curr = transition[i];
+    }
+    lengths[curr] = literal.size();
+  }
+  // Visit the states in breadth-first order, so that the failure state of each
+  // state (the longest proper suffix of its prefix that is also in the trie)
+  // has been visited already. The missing transitions of each state are those
+  // of its failure state and so are its literals, unless it ends a literal,
+  // which is then longer than any of them.
+  int nstates = lengths.size();
+  std::vector<int> failure(nstates, 0);
+  std::vector<int> order = {0};
+  for (size_t j = 0; j < order.size(); ++j) {
+    int curr = order[j];
+    int* row = &transition[curr * nclasses];
+    const int* fail = &transition[failure[curr] * nclasses];
+    for (int i = 0; i < nclasses; ++i) {
+      if (row[i] == -1) {
+        row[i] = curr == 0 ? 0 : fail[i];
+        continue;
+      }
+      int next = row[i];
+      failure[next] = curr == 0 ? 0 : fail[i];
+      if (lengths[next] == 0) {
+        lengths[next] = lengths[failure[next]];
+      }
+      order.push_back(next);
+    }
+  }
+  // Renumber the states so that the accepting states come last.
+  std::stable_partition(order.begin(), order.end(),
+                        [&lengths](int state) { return lengths[state] == 0; });
+  std::vector<int> renumbered(nstates);
+  for (int state = 0; state < nstates; ++state) {
+    renumbered[order[state]] = state;
+  }
+  int naccepting = std::count_if(lengths.begin(), lengths.end(),
+                                 [](int length) { return length != 0; });
+  prefilter->nclasses_ = nclasses;
+  prefilter->transition_.resize(nstates * nclasses);
+  prefilter->accepting_ = (nstates - naccepting) * nclasses;
+  prefilter->lengths_.resize(naccepting);
+  for (int state = 0; state < nstates; ++state) {
+    int curr = renumbered[state];
+    for (int i = 0; i < nclasses; ++i) {
+      prefilter->transition_[curr * nclasses + i] =
+          renumbered[transition[state * nclasses + i]] * nclasses;
+    }
+    if (lengths[state] != 0) {
+      prefilter->lengths_[curr - (nstates - naccepting)] = lengths[state];
+    }
+  }
+  return true;
+}
+
+size_t Compile(Exp exp, Prefilter* prefilter) {
+  *prefilter = Prefilter();
+  std::set<std::string> strings = PrefilterLiterals(exp, 0).strings;
+  // An empty language would need no prefilter at all, so don't bother.
+  if (strings.empty() || strings.begin()->empty()) {
+    return 0;
+  }
+  prefilter->literals_.assign(strings.begin(), strings.end());
+  size_t nliterals = prefilter->literals_.size();
+  size_t shortest = SIZE_MAX;
+  for (const std::string& literal : prefilter->literals_) {
+    shortest = std::min(shortest, literal.size());
+  }
+  if (nliterals > kMaxTeddyLiterals) {
+    if (shortest < kMinAhoCorasickLength || !CompileAhoCorasick(prefilter)) {
+      *prefilter = Prefilter();
+      return 0;
+    }
+    return nliterals;
+  }
+  prefilter->nbytes_ = std::min<size_t>(shortest, 3);
+  // The literals are sorted, so putting neighbours into the same bucket tends
+  // to put literals with the same prefix into the same bucket.
+  for (size_t i = 0; i < nliterals; ++i) {
+    int bucket = i * 8 / nliterals;
+    prefilter->buckets_[bucket].push_back(i);
+    const std::string& literal = prefilter->literals_[i];
+    for (int j = 0; j < prefilter->nbytes_; ++j) {
+      int byte = static_cast<unsigned char>(literal[j]);
+      prefilter->masks_[j][0][byte & 0x0F] |= 1 << bucket;
+      prefilter->masks_[j][1][byte >> 4] |= 1 << bucket;
+    }
+  }
+  return nliterals;
+}
+
+// Returns true iff any of the literals in buckets occurs at data[pos].
+static bool Verify(const Prefilter& prefilter, const char* data, size_t size,
+                   size_t pos, int buckets) {
+  while (buckets != 0) {
+    int bucket = __builtin_ctz(buckets);
+    buckets &= buckets - 1;
+    for (int i : prefilter.buckets_[bucket]) {
+      const std::string& literal = prefilter.literals_[i];
+      if (literal.size() <= size - pos &&
+          memcmp(data + pos, literal.data(), literal.size()) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Searches one position at a time, starting from pos.
+static size_t SearchBytes(const Prefilter& prefilter, const char* data,
+                          size_t size, size_t pos) {
+  for (; pos + prefilter.nbytes_ <= size; ++pos) {
+    int buckets = 0xFF;
+    for (int j = 0; j < prefilter.nbytes_; ++j) {
+      int byte = static_cast<unsigned char>(data[pos + j]);
+      buckets &= (prefilter.masks_[j][0][byte & 0x0F] &
+                  prefilter.masks_[j][1][byte >> 4]);
+    }
+    if (buckets != 0 && Verify(prefilter, data, size, pos, buckets)) {
+      return pos;
+    }
+  }
+  return llvm::StringRef::npos;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Searches sixteen positions at a time: for each of the first nbytes_ bytes of
+// the literals, shuffle the masks by the nibbles of the bytes at that offset
+// and intersect the buckets, then verify the candidates in order.
+__attribute__((target("ssse3")))
+static size_t SearchSSSE3(const Prefilter& prefilter, const char* data,
+                          size_t size) {
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  __m128i lo[3];
+  __m128i hi[3];
+  for (int j = 0; j < prefilter.nbytes_; ++j) {
+    lo[j] = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(prefilter.masks_[j][0]));
+    hi[j] = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(prefilter.masks_[j][1]));
+  }
+  size_t pos = 0;
+  while (pos + 16 + prefilter.nbytes_ - 1 <= size) {
+    __m128i buckets = _mm_set1_epi8(-1);
+    for (int j = 0; j < prefilter.nbytes_; ++j) {
+      __m128i chunk = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(data + pos + j));
+      __m128i x = _mm_shuffle_epi8(lo[j], _mm_and_si128(chunk, nibble));
+      __m128i y = _mm_shuffle_epi8(
+          hi[j], _mm_and_si128(_mm_srli_epi16(chunk, 4), nibble));
+      buckets = _mm_and_si128(buckets, _mm_and_si128(x, y));
+    }
+    int candidates = ~_mm_movemask_epi8(
+        _mm_cmpeq_epi8(buckets, _mm_setzero_si128())) & 0xFFFF;
+    if (candidates != 0) {
+      uint8_t array[16];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(array), buckets);
+      while (candidates != 0) {
+        int i = __builtin_ctz(candidates);
+        candidates &= candidates - 1;
+        if (Verify(prefilter, data, size, pos + i, array[i])) {
+          return pos + i;
+        }
+      }
+    }
+    pos += 16;
+  }
+  return SearchBytes(prefilter, data, size, pos);
+}
+#endif
+
+// Searches one byte at a time with the Aho-Corasick automaton. That finds the
+// occurrence that ends first, so keep going for as long as another occurrence
+// could turn out to begin before it.
+static size_t SearchAhoCorasick(const Prefilter& prefilter, const char* data,
+                                size_t size) {
+  const int* transition = prefilter.transition_.data();
+  const uint8_t* classes = prefilter.classes_;
+  int accepting = prefilter.accepting_;
+  int curr = 0;
+  size_t pos = 0;
+  while (pos < size) {
+    curr = transition[curr + classes[static_cast<unsigned char>(data[pos++])]];
+    if (curr >= accepting) {
+      break;
+    }
+  }
+  if (curr < accepting) {
+    return llvm::StringRef::npos;
+  }
+  size_t found =
+      pos - prefilter.lengths_[(curr - accepting) / prefilter.nclasses_];
+  size_t end = std::min(size, found + kMaxPrefilterLength - 1);
+  while (pos < end) {
+    curr = transition[curr + classes[static_cast<unsigned char>(data[pos++])]];
+    if (curr >= accepting) {
+      found = std::min(
+          found,
+          pos - prefilter.lengths_[(curr - accepting) / prefilter.nclasses_]);
+    }
+  }
+  return found;
+}
+
+size_t Search(const Prefilter& prefilter, llvm::StringRef str) {
+  if (prefilter.nclasses_ != 0) {
+    return SearchAhoCorasick(prefilter, str.data(), str.size());
+  }
+  if (prefilter.literals_.size() == 1) {
+    const std::string& literal = prefilter.literals_.front();
+    const void* ptr = memmem(str.data(), str.size(),
+                             literal.data(), literal.size());
+    if (ptr == nullptr) {
+      return llvm::StringRef::npos;
+    }
+    return reinterpret_cast<const char*>(ptr) - str.data();
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool ssse3 = __builtin_cpu_supports("ssse3");
+  if (ssse3) {
+    return SearchSSSE3(prefilter, str.data(), str.size());
+  }
+#endif
+  return SearchBytes(prefilter, str.data(), str.size(), 0);
+}
+
+void Scan(const Table& table, const Prefilter& prefilter, llvm::StringRef str,
+          std::vector<llvm::StringRef>* lines) {
+  while (!str.empty()) {
+    size_t pos = Search(prefilter, str);
+    if (pos == llvm::StringRef::npos) {
+      break;
+    }
+    // Match the line in which the literal begins.
+    const void* bol = memrchr(str.data(), '\n', pos);
+    size_t begin =
+        bol == nullptr ? 0 : reinterpret_cast<const char*>(bol) - str.data() + 1;
+    const void* eol = memchr(str.data() + pos, '\n', str.size() - pos);
+    size_t end =
+        eol == nullptr ? str.size()
+                       : reinterpret_cast<const char*>(eol) - str.data() + 1;
+    Scan(table, str.slice(begin, end), lines);
+    str = str.drop_front(end);
+  }
+}
+
+void Generate(const DFA& dfa, llvm::StringRef name, std::string* source) {
+  Generate(dfa, name, kSourceTable, source);
+}
+
+void Generate(const DFA& dfa, llvm::StringRef name, SourceStyle style,
+              std::string* source) {
+  Table table;
+  Compile(dfa, &table);
+  int nstates = table.accepting_.size();
+  int nclasses = table.nclasses_;
+  auto Next = [&table, nclasses](int curr, int i) {
+    return table.transition_[curr * nclasses + i] / nclasses;
+  };
+  auto Return = [&table](int curr) {
+    return table.accepting_[curr] ? "return true;" : "return false;";
+  };
+  int memchr_byte;
+  bool memchr_fail;
+  FindMemchr(dfa, &memchr_byte, &memchr_fail);
+  // Labels that nothing jumps to would provoke warnings.
+  std::vector<bool> targets(nstates, false);
+  for (int curr = 0; curr < nstates; ++curr) {
+    for (int i = 0; i < nclasses; ++i) {
+      targets[Next(curr, i)] = true;
+    }
+  }
+
+  // Emits a constexpr array of n elements, several per line.
+  auto Array = [source](const std::string& declaration, int n, int per_line,
+                        auto element) {
+    *source += "  static constexpr " + declaration + "[" + std::to_string(n) +
+               "] = {";
+    for (int i = 0; i < n; ++i) {
+      *source += i % per_line == 0 ? "\n      " : " ";
+      *source += element(i) + ",";
+    }
+    *source += "\n  };\n";
+  };
+
+  source->clear();
+  *source += "bool " + name.str() + "(const char* data, size_t size) {\n";
+  Array("unsigned char kClasses", 256, 16, [&table](int i) {
+    return std::to_string(table.classes_[i]);
+  });
+  if (style == kSourceTable) {
+    // The transitions are premultiplied, as in the Table.
+    Array("int kTransition", nstates * nclasses, 8, [&table](int i) {
+      return std::to_string(table.transition_[i]);
+    });
+    Array("bool kAccepting", nstates, 8, [&table](int i) {
+      return std::string(table.accepting_[i] ? "true" : "false");
+    });
+  }
+  *source += "  const unsigned char* ptr =\n";
+  *source += "      reinterpret_cast<const unsigned char*>(data);\n";
+  *source += "  const unsigned char* end = ptr + size;\n";
+  if (memchr_byte != -1) {
+    // Skip to the byte that we are trying to find.
+    *source += "  ptr = static_cast<const unsigned char*>(\n";
+    *source += "      memchr(ptr, " + std::to_string(memchr_byte);
+    *source += ", size));\n";
+    *source += "  if (ptr == nullptr) {\n";
+    *source += memchr_fail ? "    return true;\n" : "    return false;\n";
+    *source += "  }\n";
+  }
+  if (style == kSourceTable) {
+    *source += "  int curr = 0;\n";
+    *source += "  while (ptr != end) {\n";
+    *source += "    curr = kTransition[curr + kClasses[*ptr++]];\n";
+    *source += "  }\n";
+    *source += "  return kAccepting[curr / " + std::to_string(nclasses) +
+               "];\n";
+    *source += "}\n";
+    return;
+  }
+  for (int curr = 0; curr < nstates; ++curr) {
+    std::string label = "s" + std::to_string(curr);
+    if (targets[curr]) {
+      *source += label + ":\n";
+    }
+    // Group the byte classes by next state. The most frequent next state
+    // becomes the default.
+    std::map<int, std::vector<int>> cases;
+    for (int i = 0; i < nclasses; ++i) {
+      cases[Next(curr, i)].push_back(i);
+    }
+    int fallback = cases.begin()->first;
+    for (const auto& i : cases) {
+      if (i.second.size() > cases[fallback].size()) {
+        fallback = i.first;
+      }
+    }
+    if (cases.size() == 1 && fallback == curr) {
+      // Every byte loops, so the outcome is already decided.
+      *source += std::string("  ") + Return(curr) + "\n";
+      continue;
+    }
+    *source += "  if (ptr == end) {\n";
+    *source += std::string("    ") + Return(curr) + "\n";
+    *source += "  }\n";
+    if (cases.size() == 1) {
+      *source += "  ++ptr;\n";
+      *source += "  goto s" + std::to_string(fallback) + ";\n";
+      continue;
+    }
+    *source += "  switch (kClasses[*ptr++]) {\n";
+    for (const auto& i : cases) {
+      if (i.first == fallback) {
+        continue;
+      }
+      for (int j : i.second) {
+        *source += "    case " + std::to_string(j) + ":\n";
+      }
+      *source += "      goto s" + std::to_string(i.first) + ";\n";
+    }
+    *source += "    default:\n";
+    *source += "      goto s" + std::to_string(fallback) + ";\n";
+    *source += "  }\n";
+  }
+  *source += "}\n";
+}
+
+void Serialize(const Table& table, llvm::StringRef name, std::string* source) {
+  int nstates = table.accepting_.size();
+  int nclasses = table.nclasses_;
+  // Emits the elements, several per line.
+  auto Elements = [source](int n, int per_line, auto element) {
+    *source += "    {";
+    for (int i = 0; i < n; ++i) {
+      *source += i % per_line == 0 ? "\n        " : " ";
+      *source += element(i) + ",";
+    }
+    *source += "\n    },\n";
+  };
+  source->clear();
+  *source += "inline constexpr redgrep::StaticTable<";
+  *source += std::to_string(nclasses) + ", " + std::to_string(nstates) + "> ";
+  *source += name.str() + " = {\n";
+  Elements(256, 16, [&table](int i) {
+    return std::to_string(table.classes_[i]);
+  });
+  Elements(nstates * nclasses, 8, [&table](int i) {
+    return std::to_string(table.transition_[i]);
+  });
+  Elements(nstates, 8, [&table](int i) {
+    return std::string(table.accepting_[i] ? "true" : "false");
+  });
+  *source += "};\n";
+}
+
 }  // namespace redgrep
@@ -24,6 +24,7 @@
 #include <map>
 #include <memory>
 #include <set>
+#include <string>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -36,6 +37,7 @@ class ExecutionEngine;
 class Function;
 class LLVMContext;
 class Module;
+class TargetMachine;
 }  // namespace llvm
 
 namespace redgrep {
@@ -89,7 +91,7 @@ enum Kind {
   kConjunction,
   kDisjunction,
   kCharacterClass,  // ephemeral
-  kQuantifier,      // ephemeral
+  kQuantifier,      // ephemeral on the TNFA path
 };
 
 enum Mode {
@@ -101,6 +103,9 @@ enum Mode {
 class Expression;
 typedef std::shared_ptr<Expression> Exp;
 
+// Represents a set of inclusive ranges of runes.
+typedef std::set<std::pair<Rune, Rune>> RuneRanges;
+
 // Represents a regular expression.
 // Note that the data members are const in order to guarantee immutability,
 // which will matter later when we use expressions as STL container keys.
@@ -111,21 +116,26 @@ class Expression {
   Expression(Kind kind, int byte);
   Expression(Kind kind, const std::pair<int, int>& byte_range);
   Expression(Kind kind, const std::list<Exp>& subexpressions, bool norm);
-  Expression(Kind kind, const std::pair<std::set<Rune>, bool>& character_class);
-  Expression(Kind kind, const std::tuple<Exp, int, int>& quantifier);
+  Expression(Kind kind, const std::pair<RuneRanges, bool>& character_class);
+  Expression(Kind kind, const std::tuple<Exp, int, int>& quantifier,
+             bool norm);
   ~Expression();
 
   Kind kind() const { return kind_; }
   intptr_t data() const { return data_; }
   bool norm() const { return norm_; }
 
+  // Returns the kinds of the expression and of all of its subexpressions as
+  // a bitmask of (1 << kind), so that rewrites can skip what they can't touch.
+  int kinds() const { return kinds_; }
+
   // Accessors for the expression data. Of course, if you call the wrong
   // function for the expression kind, you're gonna have a bad time.
   const std::tuple<int, Exp, Mode, bool>& group() const;
   int byte() const;
   const std::pair<int, int>& byte_range() const;
   const std::list<Exp>& subexpressions() const;
-  const std::pair<std::set<Rune>, bool>& character_class() const;
+  const std::pair<RuneRanges, bool>& character_class() const;
   const std::tuple<Exp, int, int>& quantifier() const;
 
   // A KleeneClosure or Complement expression has one subexpression.
@@ -153,6 +163,7 @@ class Expression {
   const Kind kind_;
   const intptr_t data_;
   const bool norm_;
+  const int kinds_;
 
   Expression(const Expression&) = delete;
   Expression& operator=(const Expression&) = delete;
@@ -173,8 +184,8 @@ Exp Concatenation(const std::list<Exp>& subexpressions, bool norm);
 Exp Complement(const std::list<Exp>& subexpressions, bool norm);
 Exp Conjunction(const std::list<Exp>& subexpressions, bool norm);
 Exp Disjunction(const std::list<Exp>& subexpressions, bool norm);
-Exp CharacterClass(const std::pair<std::set<Rune>, bool>& character_class);
-Exp Quantifier(const std::tuple<Exp, int, int>& quantifier);
+Exp CharacterClass(const std::pair<RuneRanges, bool>& character_class);
+Exp Quantifier(const std::tuple<Exp, int, int>& quantifier, bool norm);
 
 inline Exp Group(int num, Exp sub, Mode mode, bool capture) {
   return Group(std::make_tuple(num, sub, mode, capture));
@@ -211,17 +222,31 @@ inline Exp Disjunction(Exp x, Exp y, Variadic... z) {
   return Disjunction({x, y, z...}, false);
 }
 
-inline Exp CharacterClass(const std::set<Rune>& characters, bool complement) {
-  return CharacterClass(std::make_pair(characters, complement));
+inline Exp CharacterClass(const RuneRanges& ranges,
+                          bool complement) {
+  return CharacterClass(std::make_pair(ranges, complement));
 }
 
 inline Exp Quantifier(Exp sub, int min, int max) {
-  return Quantifier(std::make_tuple(sub, min, max));
+  return Quantifier(std::make_tuple(sub, min, max), false);
 }
 
+// AnyByte() and AnyCharacter() return interned, normalised expressions that
+// are shared across patterns (and threads) rather than built afresh.
 Exp AnyCharacter();
 Exp Character(Rune character);
 
+// Returns the bytes in ranges (or, if complement, the bytes not in ranges) as
+// a Disjunction of Bytes and ByteRanges. Runes above 0xFF are ignored.
+Exp ByteClass(const RuneRanges& ranges, bool complement);
+
+// Returns the class for the class escape (e.g. \w or \p{Lu}) identified by
+// key, which must distinguish the name, the negation and any flags that affect
+// the class. The first call for key uses build to construct the class, which
+// is then expanded, normalised and interned like AnyCharacter(); later calls
+// share it.
+Exp InternedClass(const std::string& key, const std::function<Exp()>& build);
+
 // Returns the normalised form of exp.
 Exp Normalised(Exp exp);
 
@@ -262,15 +287,62 @@ Outer Partial(Exp exp, int byte);
 // The first partition should be Σ-based. Any others should be ∅-based.
 void Partitions(Exp exp, std::list<std::bitset<256>>* partitions);
 
+// Represents statistics about compiling a regular expression. Each stage adds
+// to the statistics for its own work, so the same CompileStats can be passed
+// through Parse() and each Compile() in turn. Times are in seconds.
+struct CompileStats {
+  CompileStats();
+  ~CompileStats();
+
+  double parse_time_;        // parsing str (excluding the rewrites)
+  double rewrite_time_;      // the rewrites after parsing
+  double partitions_time_;   // Partitions()
+  double derivative_time_;   // Derivative() or Partial()
+  double normalised_time_;   // Normalised()
+  double optimize_time_;     // LLVM optimisation passes
+  double codegen_time_;      // LLVM machine code generation
+
+  size_t derivatives_;       // calls to Derivative() or Partial()
+  size_t cache_hits_;        // derivatives that were already states
+  size_t peak_expressions_;  // Expression nodes kept alive by a stage,
+                             // sampled between steps
+
+  size_t nstates_;           // states of the DFA or TNFA
+  size_t nclasses_;          // byte classes in the Table
+  size_t nbytes_;            // bytes of machine code
+};
+
+// Flags for Parse(), which may be combined using bitwise OR.
+enum ParseFlags {
+  kParseDefault = 0,
+  kFoldCase = 1 << 0,  // match characters using simple case folding
+  kLatin1 = 1 << 1,    // match bytes rather than UTF-8 encoded characters
+                       // (and read the pattern one byte at a time)
+};
+
+// Adds the simple case folding of each range to ranges.
+void FoldCase(RuneRanges* ranges);
+
 // Outputs the expression parsed from str.
 // Returns true on success, false on failure.
 bool Parse(llvm::StringRef str, Exp* exp);
+bool Parse(llvm::StringRef str, Exp* exp, CompileStats* stats);
+bool Parse(llvm::StringRef str, int flags, Exp* exp);
+bool Parse(llvm::StringRef str, int flags, Exp* exp, CompileStats* stats);
 
 // Outputs the expression parsed from str as well as the mode of each Group and
 // which Groups capture.
 // Returns true on success, false on failure.
 bool Parse(llvm::StringRef str, Exp* exp,
            std::vector<Mode>* modes, std::vector<int>* captures);
+bool Parse(llvm::StringRef str, Exp* exp,
+           std::vector<Mode>* modes, std::vector<int>* captures,
+           CompileStats* stats);
+bool Parse(llvm::StringRef str, int flags, Exp* exp,
+           std::vector<Mode>* modes, std::vector<int>* captures);
+bool Parse(llvm::StringRef str, int flags, Exp* exp,
+           std::vector<Mode>* modes, std::vector<int>* captures,
+           CompileStats* stats);
 
 // Returns the result of matching str using exp.
 bool Match(Exp exp, llvm::StringRef str);
@@ -336,10 +408,12 @@ class TNFA : public FA {
 // Outputs the DFA compiled from exp.
 // Returns the number of DFA states.
 size_t Compile(Exp exp, DFA* dfa);
+size_t Compile(Exp exp, DFA* dfa, CompileStats* stats);
 
 // Outputs the TNFA compiled from exp.
 // Returns the number of TNFA states.
 size_t Compile(Exp exp, TNFA* tnfa);
+size_t Compile(Exp exp, TNFA* tnfa, CompileStats* stats);
 
 // Returns the result of matching str using dfa.
 bool Match(const DFA& dfa, llvm::StringRef str);
@@ -350,11 +424,67 @@ bool Match(const DFA& dfa, llvm::StringRef str);
 bool Match(const TNFA& tnfa, llvm::StringRef str,
            std::vector<int>* offsets);
 
+// Represents a profile of matching: how many times each DFA state was entered
+// (including the initial DFA state) and left on each byte, how often the
+// memchr(3) prefilter found its byte, how many bytes it skipped and how many
+// bytes were consumed.
+// The counters are not atomic, so a Profile must only be updated by one thread
+// at a time: to profile matching on several threads, give each thread its own
+// Fun (or Table) and Profile, then sum the counters.
+struct Profile {
+  Profile();
+  ~Profile();
+
+  std::vector<uint64_t> visits_;  // Indexed by DFA state.
+  std::vector<uint64_t> transitions_;  // Indexed by DFA state * 256 + byte.
+  uint64_t memchr_hits_;
+  uint64_t memchr_misses_;
+  uint64_t skipped_;
+  uint64_t consumed_;
+};
+
+// Outputs the profile in a human-readable form: the totals, then the DFA
+// states in descending order of visits.
+void Dump(const Profile& profile, std::string* str);
+
+// Outputs the statistics in a human-readable form, one line per group.
+void Dump(const CompileStats& stats, std::string* str);
+
+// The optimisation levels for compiling a function. The time spent and the
+// resulting machine code size are reported in CompileStats.
+enum OptLevel {
+  kOptNone,        // no passes, fast instruction selection
+  kOptMinimal,     // SimplifyCFG and InstCombine only
+  kOptDefault,     // the O2 pipeline
+  kOptAggressive,  // the O3 pipeline
+};
+
 // Represents a function and its machine code.
 struct Fun {
   Fun();
   ~Fun();
 
+  // If set before Compile(), the function counts into profile_ as it goes.
+  // The counters are baked into the machine code, so profile_ must outlive
+  // the Fun and its visits_ must not be resized. For the same reason, the Fun
+  // must not be called on more than one thread at a time. Not owned.
+  Profile* profile_;
+
+  // If set before Compile(), the function is laid out and weighted according
+  // to guide_, which is typically the profile_ of an earlier Fun for the same
+  // DFA after a warmup run (or a profile from matching with a Table). Hot DFA
+  // states compare against their dominant bytes before switching. Not owned.
+  const Profile* guide_;
+
+  // If set before Compile(), the function consumes bytes in groups of unroll_
+  // with one bounds check per group. This multiplies the code size, so it is
+  // best kept small. Defaults to 1.
+  int unroll_;
+
+  // If set before Compile(), determines how hard to optimise. Defaults to
+  // kOptDefault; the lower levels compile much faster for large DFAs.
+  OptLevel opt_level_;
+
   std::unique_ptr<llvm::LLVMContext> context_;
   llvm::Module* module_;  // Not owned.
   std::unique_ptr<llvm::ExecutionEngine> engine_;
@@ -370,10 +500,158 @@ struct Fun {
 // Outputs the function compiled from dfa.
 // Returns the number of bytes of machine code.
 size_t Compile(const DFA& dfa, Fun* fun);
+size_t Compile(const DFA& dfa, Fun* fun, CompileStats* stats);
 
 // Returns the result of matching str using fun.
 bool Match(const Fun& fun, llvm::StringRef str);
 
+// Represents a library of functions compiled ahead of time, typically for
+// linking into some other program. Each function has the C signature
+//   bool name(const char* data, size_t size);
+// and calls memchr(3) itself where Match(const Fun&) would have done so.
+struct Lib {
+  Lib();
+  ~Lib();
+
+  // If set before the first Compile(), determine the target. The triple
+  // defaults to LLVM's default target triple, so set it when cross compiling.
+  // The CPU defaults to "generic" so that the output does not depend on the
+  // machine that happened to run the compiler; set it to tune for (and use
+  // the features of) a particular CPU.
+  std::string triple_;
+  std::string cpu_;
+
+  // If set before Emit(), determines how hard to optimise. Defaults to
+  // kOptDefault.
+  OptLevel opt_level_;
+
+  // If set before Compile(), as for Fun. Defaults to 1.
+  int unroll_;
+
+  std::unique_ptr<llvm::LLVMContext> context_;
+  std::unique_ptr<llvm::Module> module_;
+  std::unique_ptr<llvm::TargetMachine> target_;
+};
+
+// Adds the function compiled from dfa to lib as name.
+// Returns false if the target is unknown or name is already taken.
+bool Compile(const DFA& dfa, llvm::StringRef name, Lib* lib);
+
+// Outputs the relocatable object file for lib.
+// Returns false if the target cannot emit object files.
+bool Emit(Lib* lib, std::string* object);
+
+// Represents a deterministic finite automaton as a dense transition table.
+// Bytes that no DFA state distinguishes share a byte class, so each row has
+// nclasses_ columns. States are premultiplied by nclasses_, so the next state
+// is simply transition_[curr + classes_[byte]] and the initial state is zero.
+struct Table {
+  Table();
+  ~Table();
+
+  int nclasses_;
+  uint8_t classes_[256];
+  std::vector<int> transition_;
+  std::vector<bool> accepting_;  // Indexed by state, not premultiplied.
+
+  // As transition_, but for Scan(). The newline byte has a byte class of its
+  // own; its transitions and any transitions into states that are sure to
+  // accept or to reject the rest of the line have negative values instead.
+  std::vector<int> lines_;
+};
+
+// Outputs the table compiled from dfa.
+// Returns the number of bytes of transitions.
+size_t Compile(const DFA& dfa, Table* table);
+size_t Compile(const DFA& dfa, Table* table, CompileStats* stats);
+
+// Returns the result of matching str using table.
+bool Match(const Table& table, llvm::StringRef str);
+
+// As above, but also counts into profile.
+bool Match(const Table& table, llvm::StringRef str, Profile* profile);
+
+// Outputs the result of matching each of strs using table.
+// Several strings are advanced in lockstep so that their (independent) table
+// lookups overlap instead of forming one long serial dependency chain. When a
+// string finishes, the next pending string takes its place.
+void Match(const Table& table, const std::vector<llvm::StringRef>& strs,
+           std::vector<bool>* matches);
+
+// Outputs the lines of str that match using table. A line ends after each
+// newline (and includes it) or at the end of str. Each line is matched from
+// the initial state, but the scan itself runs over str in one tight loop.
+void Scan(const Table& table, llvm::StringRef str,
+          std::vector<llvm::StringRef>* lines);
+
+// Represents the literals of which every match contains at least one, so that
+// searching for them rules out most of the strings (or lines) that can't match
+// before the DFA sees them. As in Teddy (from Hyperscan), the literals are put
+// into eight buckets and each of the first nbytes_ bytes of each literal sets
+// its bucket's bit in masks_, which is indexed by the position of the byte,
+// then by its low (0) or high (1) nibble, then by the nibble itself.
+//
+// Eight buckets can't tell apart more than a few dozen literals, so for more
+// than that, the literals are found using an Aho-Corasick automaton instead.
+// It is packed like a Table: bytes that occur in no literal share byte class
+// zero and states are premultiplied by nclasses_. The initial state is zero
+// and the states from accepting_ onwards are those that end some literal.
+struct Prefilter {
+  Prefilter();
+  ~Prefilter();
+
+  std::vector<std::string> literals_;  // Sorted.
+  int nbytes_;
+  std::vector<int> buckets_[8];  // Indices into literals_.
+  uint8_t masks_[3][2][16];
+
+  int nclasses_;  // Zero unless the automaton is used.
+  uint8_t classes_[256];
+  std::vector<int> transition_;
+  int accepting_;
+  // The length of the longest literal that each accepting state ends.
+  // Indexed by (state - accepting_) / nclasses_.
+  std::vector<int> lengths_;
+};
+
+// Outputs the prefilter for exp, which must come from Parse() without modes
+// and captures. Returns the number of literals, which is zero if there are
+// none worth searching for, in which case the prefilter must not be used.
+size_t Compile(Exp exp, Prefilter* prefilter);
+
+// Returns the offset of the first occurrence in str of any of the literals or
+// llvm::StringRef::npos if there is none. One literal is left to memmem(3);
+// up to 64 are found sixteen bytes at a time with SSSE3 where available and
+// more than that one byte at a time with the Aho-Corasick automaton.
+size_t Search(const Prefilter& prefilter, llvm::StringRef str);
+
+// As above, but uses prefilter to find the lines that could match and matches
+// only those lines using table.
+void Scan(const Table& table, const Prefilter& prefilter, llvm::StringRef str,
+          std::vector<llvm::StringRef>* lines);
+
+// Styles of C++ source code for Generate().
+enum SourceStyle {
+  kSourceTable,   // a loop over constexpr transition and accepting tables
+  kSourceSwitch,  // a label per DFA state with a switch on the byte class
+};
+
+// Outputs the C++ source code of a function named name that is equivalent to
+// matching using dfa. The function has the signature
+//   bool name(const char* data, size_t size);
+// and needs only <stddef.h> and <string.h>, so it can be compiled by any C++17
+// compiler, with or without LLVM. Either way, the byte classes are looked up
+// in a constexpr table and a DFA that begins by scanning for a byte calls
+// memchr(3) first. Defaults to kSourceTable. With kSourceSwitch, the states
+// that loop on every byte also return at once, which costs more code.
+void Generate(const DFA& dfa, llvm::StringRef name, std::string* source);
+void Generate(const DFA& dfa, llvm::StringRef name, SourceStyle style,
+              std::string* source);
+
+// Outputs the C++ source code of a StaticTable (see static_table.h) named name
+// that is equivalent to table, as an inline constexpr variable.
+void Serialize(const Table& table, llvm::StringRef name, std::string* source);
+
 }  // namespace redgrep
 
 #endif  // REDGREP_REGEXP_H_
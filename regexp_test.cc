@@ -12,8 +12,13 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <pthread.h>
+
+#include <string>
+
 #include "gtest/gtest.h"
 #include "regexp.h"
+#include "static_table.h"
 
 namespace redgrep {
 
@@ -112,6 +117,16 @@ TEST(Compare, Disjunction) {
     EXPECT_EQ(expected, Normalised(exp)); \
   } while (0)
 
+TEST(Kinds, Subexpressions) {
+  EXPECT_EQ(1 << kByte,
+            Byte('a')->kinds());
+  EXPECT_EQ(1 << kConcatenation | 1 << kKleeneClosure | 1 << kByte,
+            Concatenation(Byte('a'), KleeneClosure(Byte('b')))->kinds());
+  EXPECT_EQ(1 << kQuantifier | 1 << kGroup | 1 << kByteRange,
+            Quantifier(Group(0, ByteRange('a', 'z'), kPassive, true),
+                       1, 2)->kinds());
+}
+
 TEST(Normalised, EmptySet) {
   EXPECT_NORMALISED(
       EmptySet(),
@@ -404,6 +419,65 @@ TEST(Derivative, Disjunction) {
       Disjunction(Byte('a'), Byte('b')));
 }
 
+TEST(Derivative, Literals) {
+  // A few thousand literals under .*( ).*, which is how redgrep searches for
+  // them. The literals are factored into a trie, so exp is .* · (trie · .*).
+  std::string str = ".*(";
+  uint32_t x = 1;
+  for (int i = 0; i < 3000; ++i) {
+    if (i > 0) {
+      str.push_back('|');
+    }
+    x = x * 1103515245 + 12345;
+    for (int len = 4 + (x >> 16) % 8; len > 0; --len) {
+      x = x * 1103515245 + 12345;
+      str.push_back('a' + (x >> 16) % 26);
+    }
+  }
+  str += ").*";
+  Exp exp;
+  ASSERT_TRUE(Parse(str, &exp));
+  exp = Normalised(exp);
+  // Each derivative must reuse the nodes of the trie rather than normalise
+  // them again: following the first literal, the state refers to the very
+  // node that the trie has for each prefix of it.
+  Exp state = exp;
+  Exp node = exp->tail()->head();
+  for (size_t i = 3; node->kind() == kDisjunction; ++i) {
+    Exp next;
+    for (const Exp& sub : node->subexpressions()) {
+      if (sub->kind() == kConcatenation &&
+          sub->head()->kind() == kByte &&
+          sub->head()->byte() == str[i]) {
+        next = sub->tail();
+      }
+    }
+    ASSERT_NE(nullptr, next);
+    state = Normalised(Derivative(state, str[i]));
+    ASSERT_EQ(kDisjunction, state->kind());
+    if (next->kind() == kDisjunction) {
+      bool found = false;
+      for (const Exp& sub : state->subexpressions()) {
+        found |= sub->kind() == kConcatenation &&
+                 sub->head().get() == next.get();
+      }
+      EXPECT_TRUE(found) << "prefix " << str.substr(3, i - 2);
+    }
+    node = next;
+  }
+  // Each state is the root plus, for each suffix of the input that is a
+  // prefix of some literal, the node that the trie has for it. Since the
+  // literals are at most 11 bytes long, so is the work for each derivative,
+  // no matter how many literals there are.
+  state = exp;
+  for (int i = 0; i < 1000; ++i) {
+    x = x * 1103515245 + 12345;
+    state = Normalised(Derivative(state, 'a' + (x >> 16) % 26));
+    ASSERT_EQ(kDisjunction, state->kind());
+    EXPECT_GE(12, state->subexpressions().size());
+  }
+}
+
 #define EXPECT_OUTERSET(expected, outer)  \
   do {                                    \
     std::list<Exp> subs;                  \
@@ -650,7 +724,56 @@ TEST(Partitions, Disjunction) {
       std::list<std::bitset<256>>({BitSet('a', 'b'),
                                    BitSet('b'),
                                    BitSet('a')}),
-      Disjunction(Byte('a'), Byte('b')));
+      Disjunction(Byte('a'), Concatenation(Byte('b'), Byte('c'))));
+  // A disjunction of bytes and byte ranges has just one set of bytes.
+  EXPECT_PARTITIONS(
+      std::list<std::bitset<256>>({BitSet('a', 'b', 'c', 'x'),
+                                   BitSet('a', 'b', 'c', 'x')}),
+      Disjunction(Byte('x'), ByteRange('a', 'c')));
+}
+
+TEST(Partitions, AnyCharacter) {
+  // AnyCharacter is interned, so its partitions are computed once and then
+  // copied from the cache; check that the copy matches the computation.
+  Exp exp = Disjunction(AnyCharacter()->subexpressions(), false);
+  std::list<std::bitset<256>> partitions;
+  Partitions(exp, &partitions);
+  EXPECT_PARTITIONS(partitions, AnyCharacter());
+  EXPECT_PARTITIONS(partitions, AnyCharacter());
+}
+
+TEST(Interned, AnyCharacter) {
+  EXPECT_EQ(AnyCharacter().get(), AnyCharacter().get());
+  EXPECT_TRUE(AnyCharacter()->norm());
+  EXPECT_EQ(AnyByte().get(), AnyByte().get());
+  // Patterns share the interned expressions rather than copies.
+  Exp exp;
+  ASSERT_TRUE(Parse("a.", &exp));
+  EXPECT_EQ(AnyCharacter().get(), exp->tail().get());
+  ASSERT_TRUE(Parse("[^a]", &exp));
+  EXPECT_EQ(AnyCharacter().get(), exp->tail().get());
+  std::vector<Mode> modes;
+  std::vector<int> captures;
+  ASSERT_TRUE(Parse("(.)", &exp, &modes, &captures));
+  EXPECT_EQ(AnyCharacter().get(), std::get<1>(exp->group()).get());
+  // So do the class escapes, keyed by name, negation and flags.
+  Exp w1, w2;
+  ASSERT_TRUE(Parse("a\\w", &w1));
+  ASSERT_TRUE(Parse("\\wb", &w2));
+  EXPECT_EQ(w1->tail().get(), w2->head().get());
+  EXPECT_TRUE(w1->tail()->norm());
+  ASSERT_TRUE(Parse("(\\w)", &exp, &modes, &captures));
+  EXPECT_EQ(w1->tail().get(), std::get<1>(exp->group()).get());
+  ASSERT_TRUE(Parse("\\W", &exp));
+  EXPECT_NE(w1->tail().get(), exp.get());
+  ASSERT_TRUE(Parse("\\w", kFoldCase, &exp));
+  EXPECT_NE(w1->tail().get(), exp.get());
+  ASSERT_TRUE(Parse("\\w", kLatin1, &exp));
+  EXPECT_NE(w1->tail().get(), exp.get());
+  Exp p1, p2;
+  ASSERT_TRUE(Parse("\\pL", &p1));
+  ASSERT_TRUE(Parse("\\P{^L}", &p2));
+  EXPECT_EQ(p1.get(), p2.get());
 }
 
 #define EXPECT_PARSE(expected, str) \
@@ -752,6 +875,26 @@ TEST(Parse, CharacterClass) {
                       Byte(0xA9)))),
           AnyCharacter()),
       "[^a¬兔💩]");
+  EXPECT_PARSE(
+      ByteRange('a', 'z'),
+      "[a-z]");
+  EXPECT_PARSE(
+      Disjunction(
+          Byte('-'),
+          ByteRange('a', 'c')),
+      "[a-c-]");
+  EXPECT_PARSE(
+      Disjunction(
+          Concatenation(
+              Byte(0xCE),
+              ByteRange(0xB1, 0xBF)),
+          Concatenation(
+              Byte(0xCF),
+              ByteRange(0x80, 0x89))),
+      "[α-ω]");
+  Exp exp;
+  EXPECT_FALSE(Parse("[z-a]", &exp));
+  EXPECT_FALSE(Parse("[a-", &exp));
 }
 
 TEST(Parse, Quantifiers) {
@@ -804,19 +947,20 @@ TEST(Parse, Quantifiers) {
               Byte('a'))),
       "a{1,}?");
   EXPECT_PARSE(
-      Concatenation(
-          Byte('a'),
-          Disjunction(
-              EmptyString(),
-              Byte('a'))),
+      Quantifier(
+          Byte('a'), 1, 2),
       "a{1,2}");
+  EXPECT_PARSE(
+      Quantifier(
+          Byte('a'), 1, 2),
+      "a{1,2}?");
   EXPECT_PARSE(
       Concatenation(
-          Byte('a'),
-          Disjunction(
-              EmptyString(),
+          Quantifier(
+              Byte('a'), 2, 2),
+          KleeneClosure(
               Byte('a'))),
-      "a{1,2}?");
+      "a{2,}");
 }
 
 TEST(Parse, KleeneClosure) {
@@ -924,6 +1068,38 @@ TEST(Parse, Disjunction) {
           Byte('b'),
           Byte('c')),
       "a|b|c");
+  // The Disjunctions are flattened before the Groups are stripped.
+  EXPECT_PARSE(
+      Disjunction(
+          Byte('a'),
+          Disjunction(
+              Byte('b'),
+              Byte('c')),
+          Byte('d')),
+      "a|(b|c)|d");
+  // The literals are factored into a trie.
+  EXPECT_PARSE(
+      Disjunction(
+          KleeneClosure(Byte('x')),
+          Concatenation(
+              Byte('a'),
+              Byte('b'),
+              Disjunction(
+                  Byte('c'),
+                  Byte('d'))),
+          Byte('b')),
+      "abd|x*|b|abc|abd");
+  EXPECT_PARSE(
+      Concatenation(
+          Byte('a'),
+          Disjunction(
+              EmptyString(),
+              Concatenation(
+                  Byte('a'),
+                  Disjunction(
+                      EmptyString(),
+                      Byte('b'))))),
+      "aab|a|aa");
 }
 
 TEST(Parse, CountedRepetition) {
@@ -938,11 +1114,18 @@ TEST(Parse, CountedRepetition) {
   // They are structured differently, so compare their normalised forms.
   EXPECT_EQ(Normalised(exp2), Normalised(exp3));
 
+  // The DFA path does not expand the repetition, so it has a higher limit.
   Exp exp4;
-  EXPECT_FALSE(Parse("a{1001}", &exp4));
-  EXPECT_FALSE(Parse("a{7}{11}{13}", &exp4));
+  EXPECT_TRUE(Parse("a{1001}", &exp4));
+  EXPECT_TRUE(Parse("a{7}{11}{13}", &exp4));
+  EXPECT_TRUE(Parse("a{100000}", &exp4));
+  std::vector<Mode> modes;
+  std::vector<int> captures;
+  EXPECT_FALSE(Parse("a{1001}", &exp4, &modes, &captures));
+  EXPECT_FALSE(Parse("a{7}{11}{13}", &exp4, &modes, &captures));
 
   Exp exp5;
+  EXPECT_FALSE(Parse("a{100001}", &exp5));
   EXPECT_FALSE(Parse("a{999999999}", &exp5));
   EXPECT_FALSE(Parse("a{10}{10}{10}{10}{10}{10}{10}{10}{10}{10}", &exp5));
 }
@@ -1126,20 +1309,14 @@ TEST(Parse_M_C, ApplyGroups) {
       std::vector<int>({}),
       ".");
   EXPECT_PARSE_M_C(
-      Disjunction(
-          Byte('a'),
-          Byte('b'),
-          Byte('c')),
+      ByteRange('a', 'c'),
       std::vector<Mode>({}),
       std::vector<int>({}),
       "[abc]");
   EXPECT_PARSE_M_C(
       Conjunction(
           Complement(
-              Disjunction(
-                  Byte('a'),
-                  Byte('b'),
-                  Byte('c'))),
+              ByteRange('a', 'c')),
           AnyCharacter()),
       std::vector<Mode>({}),
       std::vector<int>({}),
@@ -1178,12 +1355,16 @@ TEST(Parse_M_C, ApplyGroups) {
       EXPECT_TRUE(Match(exp1_, str));                 \
       EXPECT_TRUE(Match(dfa_, str));                  \
       EXPECT_TRUE(Match(fun1_, str));                 \
+      EXPECT_TRUE(Match(fun2_, str));                 \
+      EXPECT_TRUE(Match(table_, str));                \
       EXPECT_TRUE(Match(tnfa_, str, &values));        \
       EXPECT_EQ(expected_values, values);             \
     } else {                                          \
       EXPECT_FALSE(Match(exp1_, str));                \
       EXPECT_FALSE(Match(dfa_, str));                 \
       EXPECT_FALSE(Match(fun1_, str));                \
+      EXPECT_FALSE(Match(fun2_, str));                \
+      EXPECT_FALSE(Match(table_, str));               \
       EXPECT_FALSE(Match(tnfa_, str, &values));       \
     }                                                 \
   } while (0)
@@ -1198,12 +1379,17 @@ class MatchTest : public testing::Test {
   void CompileAll() {
     Compile(exp1_, &dfa_);
     Compile(dfa_, &fun1_);
+    fun2_.unroll_ = 3;
+    Compile(dfa_, &fun2_);
+    Compile(dfa_, &table_);
     Compile(exp2_, &tnfa_);
   }
 
   Exp exp1_;
   DFA dfa_;
   Fun fun1_;
+  Fun fun2_;  // unrolled
+  Table table_;
 
   Exp exp2_;
   TNFA tnfa_;
@@ -1302,6 +1488,273 @@ TEST_F(MatchTest, CharacterClass_2) {
   EXPECT_MATCH(true, std::vector<int>({0, 1}), "X");
 }
 
+TEST_F(MatchTest, CharacterClass_3) {
+  ParseAll("([一-龥])");
+  CompileAll();
+  EXPECT_MATCH(false, std::vector<int>({}), "");
+  EXPECT_MATCH(true, std::vector<int>({0, 3}), "一");
+  EXPECT_MATCH(true, std::vector<int>({0, 3}), "兔");
+  EXPECT_MATCH(true, std::vector<int>({0, 3}), "龥");
+  EXPECT_MATCH(false, std::vector<int>({}), "龦");
+  EXPECT_MATCH(false, std::vector<int>({}), "a");
+  EXPECT_MATCH(false, std::vector<int>({}), "💩");
+}
+
+TEST_F(MatchTest, ClassEscape_1) {
+  ParseAll("(\\d\\s\\w)");
+  CompileAll();
+  EXPECT_MATCH(false, std::vector<int>({}), "");
+  EXPECT_MATCH(true, std::vector<int>({0, 3}), "0 _");
+  EXPECT_MATCH(true, std::vector<int>({0, 3}), "9\tZ");
+  EXPECT_MATCH(false, std::vector<int>({}), "a b");
+  EXPECT_MATCH(false, std::vector<int>({}), "0 -");
+  EXPECT_MATCH(false, std::vector<int>({}), "٣ a");
+}
+
+TEST_F(MatchTest, ClassEscape_2) {
+  ParseAll("([\\D-])");
+  CompileAll();
+  EXPECT_MATCH(false, std::vector<int>({}), "");
+  EXPECT_MATCH(true, std::vector<int>({0, 1}), "a");
+  EXPECT_MATCH(true, std::vector<int>({0, 1}), "-");
+  EXPECT_MATCH(true, std::vector<int>({0, 2}), "٣");
+  EXPECT_MATCH(false, std::vector<int>({}), "3");
+}
+
+TEST_F(MatchTest, ClassEscape_3) {
+  ParseAll("(\\pL\\p{Nd})");
+  CompileAll();
+  EXPECT_MATCH(false, std::vector<int>({}), "");
+  EXPECT_MATCH(true, std::vector<int>({0, 2}), "a1");
+  EXPECT_MATCH(true, std::vector<int>({0, 4}), "Ω٣");
+  EXPECT_MATCH(true, std::vector<int>({0, 4}), "兔9");
+  EXPECT_MATCH(false, std::vector<int>({}), "1a");
+  EXPECT_MATCH(false, std::vector<int>({}), "a½");
+}
+
+TEST_F(MatchTest, ClassEscape_4) {
+  ParseAll("([^\\p{Lu}\\P{L}])");
+  CompileAll();
+  EXPECT_MATCH(false, std::vector<int>({}), "");
+  EXPECT_MATCH(true, std::vector<int>({0, 1}), "a");
+  EXPECT_MATCH(true, std::vector<int>({0, 2}), "ω");
+  EXPECT_MATCH(false, std::vector<int>({}), "A");
+  EXPECT_MATCH(false, std::vector<int>({}), "Ω");
+  EXPECT_MATCH(false, std::vector<int>({}), "1");
+}
+
+TEST(ClassEscape, Parse) {
+  Exp exp;
+  EXPECT_TRUE(Parse("\\p{^L}", &exp));
+  EXPECT_FALSE(Parse("\\p", &exp));
+  EXPECT_FALSE(Parse("\\p{}", &exp));
+  EXPECT_FALSE(Parse("\\p{L", &exp));
+  EXPECT_FALSE(Parse("\\pX", &exp));
+  EXPECT_FALSE(Parse("\\p{Lx}", &exp));
+  EXPECT_FALSE(Parse("[\\p{Greek}]", &exp));
+  // \W is the complement of the folded \w, so it matches neither k nor K.
+  DFA dfa;
+  ASSERT_TRUE(Parse("\\W", kFoldCase, &exp));
+  Compile(exp, &dfa);
+  EXPECT_TRUE(Match(dfa, "-"));
+  EXPECT_FALSE(Match(dfa, "k"));
+  EXPECT_FALSE(Match(dfa, "K"));
+  EXPECT_FALSE(Match(dfa, "K"));  // KELVIN SIGN
+}
+
+TEST(CharacterClass, Boundaries) {
+  auto Encode = [](Rune rune) -> std::string {
+    char buf[4];
+    return std::string(buf, runetochar(buf, &rune));
+  };
+  // Each of these ranges straddles one or more of the boundaries between
+  // encoding lengths or between continuation bytes, or the surrogates.
+  for (auto range : std::vector<std::pair<Rune, Rune>>({
+           {0x01, 0x10FFFF}, {0x7E, 0x81}, {0x7FE, 0x801}, {0x3B1, 0x3C9},
+           {0xFFE, 0x1001}, {0xD7FE, 0xE001}, {0xFFFE, 0x10001},
+           {0x3FFFE, 0x40001}, {0x10FFFE, 0x10FFFF}})) {
+    Rune lo = range.first;
+    Rune hi = range.second;
+    Exp exp;
+    ASSERT_TRUE(Parse("[" + Encode(lo) + "-" + Encode(hi) + "]", &exp));
+    DFA dfa;
+    Compile(exp, &dfa);
+    for (Rune rune : {lo - 1, lo, lo + 1, (lo + hi) / 2, hi - 1, hi, hi + 1}) {
+      if ((rune >= 0xD800 && rune <= 0xDFFF) || rune > 0x10FFFF) {
+        continue;
+      }
+      EXPECT_EQ(lo <= rune && rune <= hi, Match(dfa, Encode(rune)))
+          << std::hex << lo << "-" << hi << " " << rune;
+    }
+  }
+}
+
+TEST(FoldCase, Orbits) {
+  auto Folded = [](Rune lo, Rune hi) -> std::set<std::pair<Rune, Rune>> {
+    std::set<std::pair<Rune, Rune>> ranges = {{lo, hi}};
+    FoldCase(&ranges);
+    return ranges;
+  };
+  EXPECT_EQ((std::set<std::pair<Rune, Rune>>({{'1', '1'}})),
+            Folded('1', '1'));
+  EXPECT_EQ((std::set<std::pair<Rune, Rune>>({{'A', 'A'}, {'a', 'a'}})),
+            Folded('a', 'a'));
+  // KELVIN SIGN
+  EXPECT_EQ((std::set<std::pair<Rune, Rune>>({{'K', 'K'}, {'k', 'k'},
+                                              {0x212A, 0x212A}})),
+            Folded('k', 'k'));
+  EXPECT_EQ(Folded('K', 'K'), Folded(0x212A, 0x212A));
+  // LATIN SMALL LETTER SHARP S and LATIN CAPITAL LETTER SHARP S
+  EXPECT_EQ(Folded(0xDF, 0xDF), Folded(0x1E9E, 0x1E9E));
+  // GREEK SMALL LETTER FINAL SIGMA
+  EXPECT_EQ((std::set<std::pair<Rune, Rune>>({{0x3A3, 0x3A3}, {0x3C2, 0x3C2},
+                                              {0x3C3, 0x3C3}})),
+            Folded(0x3C2, 0x3C2));
+  // LATIN CAPITAL LETTER A WITH MACRON et cetera
+  std::set<std::pair<Rune, Rune>> ranges = Folded(0x101, 0x102);
+  EXPECT_TRUE(ranges.count({0x100, 0x103}) > 0);
+}
+
+TEST(FoldCase, Match) {
+  auto Encode = [](Rune rune) -> std::string {
+    char buf[4];
+    return std::string(buf, runetochar(buf, &rune));
+  };
+  {
+    Exp exp1, exp2;
+    DFA dfa1, dfa2;
+    Table table1, table2;
+    ASSERT_TRUE(Parse("error", kFoldCase, &exp1));
+    ASSERT_TRUE(Parse("error", &exp2));
+    // Folding case does not change the number of states or byte classes.
+    EXPECT_EQ(Compile(exp2, &dfa2), Compile(exp1, &dfa1));
+    Compile(dfa1, &table1);
+    Compile(dfa2, &table2);
+    EXPECT_EQ(table2.nclasses_, table1.nclasses_);
+    EXPECT_TRUE(Match(dfa1, "error"));
+    EXPECT_TRUE(Match(dfa1, "ERROR"));
+    EXPECT_TRUE(Match(table1, "ErRoR"));
+    EXPECT_FALSE(Match(table1, "errors"));
+  }
+  {
+    Exp exp;
+    DFA dfa;
+    ASSERT_TRUE(Parse("[^k]σ", kFoldCase, &exp));
+    Compile(exp, &dfa);
+    EXPECT_TRUE(Match(dfa, "xΣ"));
+    EXPECT_TRUE(Match(dfa, "xς"));
+    EXPECT_FALSE(Match(dfa, "kσ"));
+    EXPECT_FALSE(Match(dfa, "Kσ"));
+    EXPECT_FALSE(Match(dfa, Encode(0x212A) + "σ"));  // KELVIN SIGN
+  }
+  {
+    Exp exp;
+    DFA dfa;
+    ASSERT_TRUE(Parse("[à-å]", kFoldCase, &exp));
+    Compile(exp, &dfa);
+    EXPECT_TRUE(Match(dfa, "Ä"));
+    EXPECT_TRUE(Match(dfa, Encode(0x212B)));  // ANGSTROM SIGN
+    EXPECT_FALSE(Match(dfa, "Æ"));
+  }
+  {
+    Exp exp;
+    TNFA tnfa;
+    ASSERT_TRUE(Parse("(é)", kFoldCase, &exp, &tnfa.modes_, &tnfa.captures_));
+    Compile(exp, &tnfa);
+    std::vector<int> values;
+    EXPECT_TRUE(Match(tnfa, "É", &values));
+    EXPECT_EQ(std::vector<int>({0, 2}), values);
+  }
+}
+
+TEST(Latin1, Match) {
+  {
+    Exp exp1, exp2;
+    DFA dfa1, dfa2;
+    ASSERT_TRUE(Parse("a.*b", kLatin1, &exp1));
+    ASSERT_TRUE(Parse("a.*b", &exp2));
+    // Without the UTF-8 continuation states, the DFA is smaller.
+    EXPECT_LT(Compile(exp1, &dfa1), Compile(exp2, &dfa2));
+    EXPECT_TRUE(Match(dfa1, "ab"));
+    EXPECT_TRUE(Match(dfa1, llvm::StringRef("a\x00\xFF\x80" "b", 5)));
+    EXPECT_FALSE(Match(dfa2, llvm::StringRef("a\x00\xFF\x80" "b", 5)));
+  }
+  {
+    Exp exp;
+    DFA dfa;
+    ASSERT_TRUE(Parse("\xE9[^\\d]\\w", kLatin1, &exp));
+    Compile(exp, &dfa);
+    EXPECT_TRUE(Match(dfa, "\xE9\xFFz"));
+    EXPECT_FALSE(Match(dfa, "\xE9" "0z"));
+    EXPECT_FALSE(Match(dfa, "é\xFFz"));
+  }
+  {
+    Exp exp;
+    DFA dfa;
+    ASSERT_TRUE(Parse("\\p{Lu}", kLatin1 | kFoldCase, &exp));
+    Compile(exp, &dfa);
+    EXPECT_TRUE(Match(dfa, "\xC9"));
+    EXPECT_TRUE(Match(dfa, "\xE9"));
+    EXPECT_FALSE(Match(dfa, "\xD7"));
+  }
+  {
+    // The pattern is not UTF-8: each byte is one character.
+    Exp exp;
+    DFA dfa;
+    ASSERT_TRUE(Parse("a\xFF" "b[\x80-\xBF]", kLatin1, &exp));
+    Compile(exp, &dfa);
+    EXPECT_TRUE(Match(dfa, "a\xFF" "b\x80"));
+    EXPECT_TRUE(Match(dfa, "a\xFF" "b\xBF"));
+    EXPECT_FALSE(Match(dfa, "a\xFF" "b\xC0"));
+    EXPECT_FALSE(Match(dfa, "aÿb\x80"));
+  }
+  {
+    // A UTF-8 encoded character is just a sequence of bytes.
+    Exp exp;
+    DFA dfa;
+    ASSERT_TRUE(Parse("兔+", kLatin1, &exp));
+    Compile(exp, &dfa);
+    EXPECT_TRUE(Match(dfa, "兔"));
+    EXPECT_TRUE(Match(dfa, "\xE5\x85\x94\x94"));
+    EXPECT_FALSE(Match(dfa, "兔兔"));
+  }
+}
+
+// Runs fn on a thread with a small stack.
+static void RunOnSmallStack(void (*fn)()) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 256 << 10);
+  pthread_t thread;
+  ASSERT_EQ(0, pthread_create(&thread, &attr, [](void* arg) -> void* {
+    reinterpret_cast<void (*)()>(arg)();
+    return nullptr;
+  }, reinterpret_cast<void*>(fn)));
+  pthread_join(thread, nullptr);
+  pthread_attr_destroy(&attr);
+}
+
+TEST(Deep, Literal) {
+  // The Concatenations for a long literal are as deep as it is long, which
+  // used to overflow the stack when parsing, compiling or destroying them.
+  RunOnSmallStack([] {
+    std::string str;
+    uint32_t x = 1;
+    for (int i = 0; i < 20000; ++i) {
+      x = x * 1103515245 + 12345;
+      str.push_back('a' + (x >> 16) % 26);
+    }
+    Exp exp;
+    ASSERT_TRUE(Parse(str, &exp));
+    EXPECT_EQ(exp, Normalised(exp));
+    EXPECT_FALSE(IsNullable(exp));
+    DFA dfa;
+    EXPECT_EQ(20002, Compile(exp, &dfa));
+    EXPECT_TRUE(Match(dfa, str));
+    EXPECT_FALSE(Match(dfa, str + "a"));
+  });
+}
+
 TEST_F(MatchTest, Quantifiers_1) {
   ParseAll("(a*)");
   CompileAll();
@@ -1464,6 +1917,32 @@ TEST_F(MatchTest, Quantifiers_18) {
   EXPECT_MATCH(true, std::vector<int>({0, 1, 1, 3}), "aaa");
 }
 
+TEST_F(MatchTest, Quantifiers_19) {
+  ParseAll("((ab){2,3}c?){1,2}");
+  CompileAll();
+  EXPECT_MATCH(false, std::vector<int>({}), "ab");
+  EXPECT_MATCH(true, std::vector<int>({0, 4, 0, 4}), "abab");
+  EXPECT_MATCH(true, std::vector<int>({0, 5, 0, 4}), "ababc");
+  EXPECT_MATCH(true, std::vector<int>({0, 6, 0, 6}), "ababab");
+  EXPECT_MATCH(false, std::vector<int>({}), "abababcab");
+  EXPECT_MATCH(true, std::vector<int>({0, 10, 0, 8}), "ababcababc");
+}
+
+TEST(Quantifier, Linear) {
+  // Expanding a{0,n} would make every derivative a distinct disjunction of
+  // concatenations; keeping the quantifier makes the DFA grow linearly (with
+  // a constant factor for the states partway through matching "ERROR").
+  for (int n : {10, 100, 500}) {
+    Exp exp;
+    ASSERT_TRUE(Parse(".{0," + std::to_string(n) + "}ERROR", &exp));
+    DFA dfa;
+    EXPECT_GE(10 * n, Compile(exp, &dfa)) << n;
+    EXPECT_TRUE(Match(dfa, std::string(n, 'x') + "ERROR"));
+    EXPECT_FALSE(Match(dfa, std::string(n + 1, 'x') + "ERROR"));
+    EXPECT_TRUE(Match(dfa, "ERROR"));
+  }
+}
+
 TEST_F(MatchTest, Concatenation) {
   ParseAll("(aa)");
   CompileAll();
@@ -1535,6 +2014,19 @@ TEST_F(MatchTest, Disjunction_2) {
   EXPECT_MATCH(true, std::vector<int>({-1, -1, 0, 3}), "bXb");
 }
 
+TEST_F(MatchTest, Disjunction_3) {
+  ParseAll("(for|foreach|if|in|int)|(i.)");
+  CompileAll();
+  EXPECT_MATCH(true, std::vector<int>({0, 3, -1, -1}), "for");
+  EXPECT_MATCH(true, std::vector<int>({0, 7, -1, -1}), "foreach");
+  EXPECT_MATCH(true, std::vector<int>({0, 2, -1, -1}), "if");
+  EXPECT_MATCH(true, std::vector<int>({-1, -1, 0, 2}), "ix");
+  EXPECT_MATCH(true, std::vector<int>({0, 3, -1, -1}), "int");
+  EXPECT_MATCH(false, std::vector<int>({}), "fo");
+  EXPECT_MATCH(false, std::vector<int>({}), "fore");
+  EXPECT_MATCH(false, std::vector<int>({}), "i");
+}
+
 TEST_F(MatchTest, PerlSemantics_1) {
   ParseAll("(?:(a*?)|(a*))(a*)");
   CompileAll();
@@ -1560,4 +2052,390 @@ TEST_F(MatchTest, PerlSemantics_3) {
   EXPECT_MATCH(true, std::vector<int>({6, 7}), "abcdefg");
 }
 
+TEST_F(MatchTest, Batch) {
+  ParseAll("(a.*)&(.*b)");
+  CompileAll();
+  // Vary the lengths so that the lanes finish at different times and have to
+  // be refilled. The empty strings finish as soon as they are loaded.
+  std::vector<std::string> storage;
+  for (int i = 0; i < 50; ++i) {
+    if (i % 11 == 5) {
+      storage.push_back("");
+    }
+    storage.push_back("a" + std::string(i * 5 % 17, 'X') + (i % 3 ? "b" : "a"));
+  }
+  std::vector<llvm::StringRef> strs(storage.begin(), storage.end());
+  std::vector<bool> matches;
+  Match(table_, strs, &matches);
+  ASSERT_EQ(strs.size(), matches.size());
+  for (size_t i = 0; i < strs.size(); ++i) {
+    EXPECT_EQ(Match(dfa_, strs[i]), matches[i]) << strs[i].str();
+  }
+}
+
+TEST(Scan, Lines) {
+  Exp exp;
+  ASSERT_TRUE(Parse(".*a.*b\n|!(.*c.*)", &exp));
+  DFA dfa;
+  Compile(exp, &dfa);
+  Table table;
+  Compile(dfa, &table);
+  llvm::StringRef str("ab\nc\n\nXcXaXb\nXc\nXaXbXc");
+  std::vector<llvm::StringRef> lines;
+  Scan(table, str, &lines);
+  std::vector<llvm::StringRef> expected;
+  while (!str.empty()) {
+    llvm::StringRef line = str.split('\n').first;
+    line = str.take_front(line.size() + 1);
+    str = str.drop_front(line.size());
+    if (Match(dfa, line)) {
+      expected.push_back(line);
+    }
+  }
+  EXPECT_EQ(expected, lines);
+  EXPECT_EQ(3, lines.size());
+}
+
+#define EXPECT_PREFILTER(expected, str)                  \
+  do {                                                   \
+    Exp exp;                                             \
+    ASSERT_TRUE(Parse(str, &exp));                       \
+    Prefilter prefilter;                                 \
+    EXPECT_EQ(expected.size(), Compile(exp, &prefilter)); \
+    EXPECT_EQ(expected, prefilter.literals_);            \
+  } while (0)
+
+TEST(Prefilter, Literals) {
+  EXPECT_PREFILTER(std::vector<std::string>({"foo"}),
+                   ".*foo.*");
+  EXPECT_PREFILTER(std::vector<std::string>({"bar", "foo"}),
+                   ".*(foo|bar).*");
+  EXPECT_PREFILTER(std::vector<std::string>({"foobar", "foobaz"}),
+                   ".*foo(bar|baz).*");
+  EXPECT_PREFILTER(std::vector<std::string>({"quux"}),
+                   ".*foo.*quux.*");
+  EXPECT_PREFILTER(std::vector<std::string>({"foo", "o"}),
+                   ".*(fo)?o.*");
+  EXPECT_PREFILTER(std::vector<std::string>({"quux"}),
+                   ".*foo.*&.*quux.*");
+  EXPECT_PREFILTER(std::vector<std::string>({"bar", "foo"}),
+                   ".*foo.*|bar");
+  EXPECT_PREFILTER(std::vector<std::string>({"abab"}),
+                   ".*(ab){2,}.*");
+  EXPECT_PREFILTER(std::vector<std::string>({}),
+                   ".*");
+  EXPECT_PREFILTER(std::vector<std::string>({}),
+                   "!(.*foo.*)");
+  EXPECT_PREFILTER(std::vector<std::string>({}),
+                   ".*foo.*|.*");
+  EXPECT_PREFILTER(std::vector<std::string>({}),
+                   ".*(fo)?.*");
+  // More than 64 literals are fine so long as none of them is too short.
+  std::vector<std::string> literals;
+  std::string str;
+  for (int i = 0; i < 100; ++i) {
+    literals.push_back(std::string("key") + static_cast<char>('0' + i / 10) +
+                       static_cast<char>('0' + i % 10));
+    str += (i == 0 ? "" : "|") + literals.back();
+  }
+  EXPECT_PREFILTER(literals, ".*(" + str + ").*");
+  EXPECT_PREFILTER(std::vector<std::string>({}),
+                   ".*(" + str + "|ke).*");
+}
+
+TEST(Prefilter, Search) {
+  std::string str;
+  uint32_t x = 1;
+  for (int i = 0; i < 300; ++i) {
+    x = x * 1103515245 + 12345;
+    str.push_back('a' + (x >> 16) % 6);
+  }
+  // Enough literals that they are found using the Aho-Corasick automaton.
+  std::string many;
+  for (int i = 0; i < 200; ++i) {
+    x = x * 1103515245 + 12345;
+    many += i == 0 ? ".*(" : "|";
+    for (int len = 3 + (x >> 16) % 4; len > 0; --len) {
+      x = x * 1103515245 + 12345;
+      many.push_back('a' + (x >> 16) % 6);
+    }
+  }
+  many += ").*";
+  for (const std::string& re :
+       {std::string(".*(cab|dad|bad|abba|ace|bead|dab|ebb|fed|decaf).*"),
+        std::string(".*abba.*"), many}) {
+    Exp exp;
+    ASSERT_TRUE(Parse(re, &exp));
+    Prefilter prefilter;
+    ASSERT_NE(0, Compile(exp, &prefilter));
+    EXPECT_EQ(re == many, prefilter.nclasses_ != 0);
+    for (size_t i = 0; i <= str.size(); ++i) {
+      llvm::StringRef suffix = llvm::StringRef(str).drop_front(i);
+      size_t expected = llvm::StringRef::npos;
+      for (const std::string& literal : prefilter.literals_) {
+        expected = std::min(expected, suffix.find(literal));
+      }
+      EXPECT_EQ(expected, Search(prefilter, suffix)) << re << " " << i;
+    }
+  }
+}
+
+TEST(Prefilter, Scan) {
+  Exp exp;
+  ASSERT_TRUE(Parse(".*(foo|bar)x.*\n|.*ba[rz]\n", &exp));
+  DFA dfa;
+  Compile(exp, &dfa);
+  Table table;
+  Compile(dfa, &table);
+  Prefilter prefilter;
+  ASSERT_EQ(4, Compile(exp, &prefilter));
+  llvm::StringRef str("foo\nfoox\nXbarx\nbaz\n\nbar\nfoo bar\nXfooxbar");
+  std::vector<llvm::StringRef> expected;
+  Scan(table, str, &expected);
+  std::vector<llvm::StringRef> lines;
+  Scan(table, prefilter, str, &lines);
+  EXPECT_EQ(expected, lines);
+  EXPECT_EQ(5, lines.size());
+}
+
+TEST(Profile, Visits) {
+  Exp exp;
+  ASSERT_TRUE(Parse("(a|b)*c", &exp));
+  DFA dfa;
+  Compile(exp, &dfa);
+  Profile profile1;
+  Fun fun;
+  fun.profile_ = &profile1;
+  Compile(dfa, &fun);
+  Profile profile2;
+  Table table;
+  Compile(dfa, &table);
+  for (llvm::StringRef str : {"", "c", "abc", "abba", "bbbbc", "cab"}) {
+    EXPECT_EQ(Match(dfa, str), Match(fun, str));
+    EXPECT_EQ(Match(dfa, str), Match(table, str, &profile2));
+  }
+  EXPECT_EQ(profile1.visits_, profile2.visits_);
+  EXPECT_EQ(profile1.transitions_, profile2.transitions_);
+  EXPECT_EQ(profile1.consumed_, profile2.consumed_);
+  uint64_t visits = 0;
+  for (uint64_t i : profile1.visits_) {
+    visits += i;
+  }
+  EXPECT_EQ(profile1.consumed_ + 6, visits);
+}
+
+TEST(Profile, Memchr) {
+  Exp exp;
+  ASSERT_TRUE(Parse("\\C*x", &exp));
+  DFA dfa;
+  Compile(exp, &dfa);
+  Profile profile;
+  Fun fun;
+  fun.profile_ = &profile;
+  Compile(dfa, &fun);
+  ASSERT_NE(-1, fun.memchr_byte_);
+  EXPECT_FALSE(Match(fun, "abc"));
+  EXPECT_TRUE(Match(fun, "abcx"));
+  EXPECT_FALSE(Match(fun, "xa"));
+  EXPECT_EQ(2, profile.memchr_hits_);
+  EXPECT_EQ(1, profile.memchr_misses_);
+  EXPECT_EQ(6, profile.skipped_);
+  EXPECT_EQ(3, profile.consumed_);
+  std::string str;
+  Dump(profile, &str);
+  EXPECT_EQ(0, str.find("memchr hits 2 misses 1 skipped 6 consumed 3\n"));
+}
+
+TEST(Profile, Guide) {
+  Exp exp;
+  ASSERT_TRUE(Parse(".*(error|warn).*", &exp));
+  DFA dfa;
+  Compile(exp, &dfa);
+  Table table;
+  Compile(dfa, &table);
+  std::vector<llvm::StringRef> strs = {
+      "", "error", "warn", "an error occurred", "a warning", "all is well",
+      "erro", "warm", "the errors were warnings", "nothing to see here",
+  };
+  Profile profile;
+  for (int i = 0; i < 100; ++i) {
+    Match(table, "nothing to see here", &profile);
+  }
+  Fun fun;
+  fun.guide_ = &profile;
+  Compile(dfa, &fun);
+  for (llvm::StringRef str : strs) {
+    EXPECT_EQ(Match(dfa, str), Match(fun, str)) << str.str();
+  }
+}
+
+TEST(Fun, OptLevels) {
+  Exp exp;
+  ASSERT_TRUE(Parse(".*(error|warn).*&!(.*ok.*)", &exp));
+  DFA dfa;
+  Compile(exp, &dfa);
+  for (OptLevel opt_level :
+       {kOptNone, kOptMinimal, kOptDefault, kOptAggressive}) {
+    CompileStats stats;
+    Fun fun;
+    fun.opt_level_ = opt_level;
+    EXPECT_LT(0, Compile(dfa, &fun, &stats));
+    EXPECT_EQ(fun.machine_code_size_, stats.nbytes_);
+    for (llvm::StringRef str : {"", "error", "warn ok", "a warning", "ok"}) {
+      EXPECT_EQ(Match(dfa, str), Match(fun, str))
+          << opt_level << " " << str.str();
+    }
+  }
+}
+
+TEST(Lib, Emit) {
+  Lib lib;
+  for (auto i : {std::make_pair("match_error", ".*(error|warn).*"),
+                 std::make_pair("match_memchr", "\\C*x")}) {
+    Exp exp;
+    ASSERT_TRUE(Parse(i.second, &exp));
+    DFA dfa;
+    Compile(exp, &dfa);
+    ASSERT_TRUE(Compile(dfa, i.first, &lib));
+  }
+  // Names must be unique.
+  EXPECT_FALSE(Compile(DFA(), "match_error", &lib));
+  std::string object;
+  ASSERT_TRUE(Emit(&lib, &object));
+  EXPECT_FALSE(object.empty());
+
+  Lib bogus;
+  bogus.triple_ = "bogus";
+  EXPECT_FALSE(Compile(DFA(), "match", &bogus));
+}
+
+TEST(Generate, Source) {
+  Exp exp;
+  ASSERT_TRUE(Parse("\\C*x(a|b)", &exp));
+  DFA dfa;
+  Compile(exp, &dfa);
+  std::string source;
+  Generate(dfa, "match_x", &source);
+  EXPECT_EQ(0, source.find("bool match_x(const char* data, size_t size) {\n"));
+  EXPECT_NE(std::string::npos,
+            source.find("static constexpr unsigned char kClasses[256]"));
+  // By default, the transitions and accepting states are constexpr tables.
+  Table table;
+  Compile(dfa, &table);
+  EXPECT_NE(std::string::npos,
+            source.find("static constexpr int kTransition[" +
+                        std::to_string(table.transition_.size()) + "]"));
+  EXPECT_NE(std::string::npos,
+            source.find("static constexpr bool kAccepting[" +
+                        std::to_string(dfa.accepting_.size()) + "]"));
+  // The DFA begins by scanning memory for 'x'.
+  EXPECT_NE(std::string::npos, source.find("memchr(ptr, 120, size)"));
+  EXPECT_EQ(std::string::npos, source.find("goto"));
+
+  Generate(dfa, "match_x", kSourceSwitch, &source);
+  EXPECT_EQ(0, source.find("bool match_x(const char* data, size_t size) {\n"));
+  EXPECT_EQ(std::string::npos, source.find("kTransition"));
+  EXPECT_NE(std::string::npos, source.find("memchr(ptr, 120, size)"));
+  // Each DFA state has a label.
+  for (int i = 0; i < static_cast<int>(dfa.accepting_.size()); ++i) {
+    EXPECT_NE(std::string::npos, source.find("s" + std::to_string(i) + ":"));
+  }
+}
+
+// Serialize() outputs this for "(a|b)*c".
+inline constexpr StaticTable<4, 3> kTable = {
+    {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 2, 2, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    },
+    {
+        4, 4, 0, 8, 4, 4, 4, 4,
+        4, 4, 4, 4,
+    },
+    {
+        false, false, true,
+    },
+};
+
+static_assert(StaticMatch(kTable, "abbac"));
+static_assert(!StaticMatch(kTable, "abbaca"));
+
+TEST(StaticTable, Serialize) {
+  Exp exp;
+  ASSERT_TRUE(Parse("(a|b)*c", &exp));
+  DFA dfa;
+  Compile(exp, &dfa);
+  Table table;
+  Compile(dfa, &table);
+  std::string source;
+  Serialize(table, "kTable", &source);
+  EXPECT_EQ(0, source.find(
+                   "inline constexpr redgrep::StaticTable<4, 3> kTable = {\n"));
+  for (int byte = 0; byte < 256; ++byte) {
+    EXPECT_EQ(table.classes_[byte], kTable.classes[byte]) << byte;
+  }
+  for (size_t i = 0; i < table.transition_.size(); ++i) {
+    EXPECT_EQ(table.transition_[i], kTable.transition[i]) << i;
+  }
+  for (size_t i = 0; i < table.accepting_.size(); ++i) {
+    EXPECT_EQ(table.accepting_[i], kTable.accepting[i]) << i;
+  }
+  for (llvm::StringRef str : {"", "c", "abc", "abca", "\nc", "bbbbc"}) {
+    EXPECT_EQ(Match(dfa, str), StaticMatch<kTable>(str.data(), str.size()))
+        << str.str();
+  }
+}
+
+TEST(CompileStats, Accumulate) {
+  CompileStats stats;
+  Exp exp;
+  ASSERT_TRUE(Parse("(a|b)*c", &exp, &stats));
+  DFA dfa;
+  size_t nstates = Compile(exp, &dfa, &stats);
+  Table table;
+  Compile(dfa, &table, &stats);
+  EXPECT_EQ(nstates, stats.nstates_);
+  EXPECT_EQ(table.nclasses_, stats.nclasses_);
+  // Each DFA state computes one derivative per partition. Every derivative
+  // is either a new DFA state or a cache hit; only the initial DFA state is
+  // not a derivative.
+  size_t npartitions = 0;
+  for (const auto& i : dfa.partitions_) {
+    npartitions += i.second.size();
+  }
+  EXPECT_EQ(npartitions, stats.derivatives_);
+  EXPECT_EQ(npartitions, stats.cache_hits_ + nstates - 1);
+  EXPECT_LT(0, stats.peak_expressions_);
+  EXPECT_LE(0, stats.parse_time_);
+  EXPECT_LE(0, stats.derivative_time_);
+}
+
+TEST(CompileStats, PeakExpressions) {
+  // Keep a large expression alive: it must not count towards the peak for
+  // compiling some other, much smaller expression.
+  Exp large;
+  ASSERT_TRUE(Parse(std::string(1000, 'a'), &large));
+  CompileStats stats;
+  Exp exp;
+  ASSERT_TRUE(Parse("(a|b)*c", &exp, &stats));
+  DFA dfa;
+  Compile(exp, &dfa, &stats);
+  EXPECT_LT(0, stats.peak_expressions_);
+  EXPECT_GT(100, stats.peak_expressions_);
+}
+
 }  // namespace redgrep
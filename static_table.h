@@ -0,0 +1,72 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REDGREP_STATIC_TABLE_H_
+#define REDGREP_STATIC_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string_view>
+
+// This header has no dependencies on LLVM or on the rest of redgrep, so that
+// patterns known at build time can be matched without any runtime compilation.
+// The tables are output by Serialize() in regexp.h (e.g. via redcc).
+
+namespace redgrep {
+
+// Represents a Table as a constant expression. The layout is the same: states
+// are premultiplied by NClasses, so the next state is simply
+// transition[curr + classes[byte]] and the initial state is zero.
+template <int NClasses, int NStates>
+struct StaticTable {
+  uint8_t classes[256];
+  int transition[NStates * NClasses];
+  bool accepting[NStates];  // Indexed by state, not premultiplied.
+};
+
+// Returns the result of matching the data using table.
+// When table is a constant expression, so is the result.
+template <int NClasses, int NStates>
+constexpr bool StaticMatch(const StaticTable<NClasses, NStates>& table,
+                           const char* data, size_t size) {
+  int curr = 0;
+  for (size_t i = 0; i < size; ++i) {
+    uint8_t byte = static_cast<uint8_t>(data[i]);
+    curr = table.transition[curr + table.classes[byte]];
+  }
+  return table.accepting[curr / NClasses];
+}
+
+template <int NClasses, int NStates>
+constexpr bool StaticMatch(const StaticTable<NClasses, NStates>& table,
+                           std::string_view str) {
+  return StaticMatch(table, str.data(), str.size());
+}
+
+// As above, but specialised for the table, which lets the compiler fold the
+// transitions into the code and inline the result into the caller.
+template <const auto& kTable>
+constexpr bool StaticMatch(const char* data, size_t size) {
+  return StaticMatch(kTable, data, size);
+}
+
+template <const auto& kTable>
+constexpr bool StaticMatch(std::string_view str) {
+  return StaticMatch(kTable, str.data(), str.size());
+}
+
+}  // namespace redgrep
+
+#endif  // REDGREP_STATIC_TABLE_H_
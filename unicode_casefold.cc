@@ -0,0 +1,389 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The table was generated from the simple case mappings in Unicode 14.0.0.
+
+#include "unicode_casefold.h"
+
+namespace redgrep {
+
+const CaseFold kCaseFold[] = {
+  { 0x0041, 0x005A, 32 },
+  { 0x0061, 0x006A, -32 },
+  { 0x006B, 0x006B, 8383 },
+  { 0x006C, 0x0072, -32 },
+  { 0x0073, 0x0073, 268 },
+  { 0x0074, 0x007A, -32 },
+  { 0x00B5, 0x00B5, 743 },
+  { 0x00C0, 0x00D6, 32 },
+  { 0x00D8, 0x00DE, 32 },
+  { 0x00DF, 0x00DF, 7615 },
+  { 0x00E0, 0x00E4, -32 },
+  { 0x00E5, 0x00E5, 8262 },
+  { 0x00E6, 0x00F6, -32 },
+  { 0x00F8, 0x00FE, -32 },
+  { 0x00FF, 0x00FF, 121 },
+  { 0x0100, 0x012F, kEvenOdd },
+  { 0x0132, 0x0137, kEvenOdd },
+  { 0x0139, 0x0148, kOddEven },
+  { 0x014A, 0x0177, kEvenOdd },
+  { 0x0178, 0x0178, -121 },
+  { 0x0179, 0x017E, kOddEven },
+  { 0x017F, 0x017F, -300 },
+  { 0x0180, 0x0180, 195 },
+  { 0x0181, 0x0181, 210 },
+  { 0x0182, 0x0185, kEvenOdd },
+  { 0x0186, 0x0186, 206 },
+  { 0x0187, 0x0188, kOddEven },
+  { 0x0189, 0x018A, 205 },
+  { 0x018B, 0x018C, kOddEven },
+  { 0x018E, 0x018E, 79 },
+  { 0x018F, 0x018F, 202 },
+  { 0x0190, 0x0190, 203 },
+  { 0x0191, 0x0192, kOddEven },
+  { 0x0193, 0x0193, 205 },
+  { 0x0194, 0x0194, 207 },
+  { 0x0195, 0x0195, 97 },
+  { 0x0196, 0x0196, 211 },
+  { 0x0197, 0x0197, 209 },
+  { 0x0198, 0x0199, kEvenOdd },
+  { 0x019A, 0x019A, 163 },
+  { 0x019C, 0x019C, 211 },
+  { 0x019D, 0x019D, 213 },
+  { 0x019E, 0x019E, 130 },
+  { 0x019F, 0x019F, 214 },
+  { 0x01A0, 0x01A5, kEvenOdd },
+  { 0x01A6, 0x01A6, 218 },
+  { 0x01A7, 0x01A8, kOddEven },
+  { 0x01A9, 0x01A9, 218 },
+  { 0x01AC, 0x01AD, kEvenOdd },
+  { 0x01AE, 0x01AE, 218 },
+  { 0x01AF, 0x01B0, kOddEven },
+  { 0x01B1, 0x01B2, 217 },
+  { 0x01B3, 0x01B6, kOddEven },
+  { 0x01B7, 0x01B7, 219 },
+  { 0x01B8, 0x01B9, kEvenOdd },
+  { 0x01BC, 0x01BD, kEvenOdd },
+  { 0x01BF, 0x01BF, 56 },
+  { 0x01C4, 0x01C5, 1 },
+  { 0x01C6, 0x01C6, -2 },
+  { 0x01C7, 0x01C8, 1 },
+  { 0x01C9, 0x01C9, -2 },
+  { 0x01CA, 0x01CB, 1 },
+  { 0x01CC, 0x01CC, -2 },
+  { 0x01CD, 0x01DC, kOddEven },
+  { 0x01DD, 0x01DD, -79 },
+  { 0x01DE, 0x01EF, kEvenOdd },
+  { 0x01F1, 0x01F2, 1 },
+  { 0x01F3, 0x01F3, -2 },
+  { 0x01F4, 0x01F5, kEvenOdd },
+  { 0x01F6, 0x01F6, -97 },
+  { 0x01F7, 0x01F7, -56 },
+  { 0x01F8, 0x021F, kEvenOdd },
+  { 0x0220, 0x0220, -130 },
+  { 0x0222, 0x0233, kEvenOdd },
+  { 0x023A, 0x023A, 10795 },
+  { 0x023B, 0x023C, kOddEven },
+  { 0x023D, 0x023D, -163 },
+  { 0x023E, 0x023E, 10792 },
+  { 0x023F, 0x0240, 10815 },
+  { 0x0241, 0x0242, kOddEven },
+  { 0x0243, 0x0243, -195 },
+  { 0x0244, 0x0244, 69 },
+  { 0x0245, 0x0245, 71 },
+  { 0x0246, 0x024F, kEvenOdd },
+  { 0x0250, 0x0250, 10783 },
+  { 0x0251, 0x0251, 10780 },
+  { 0x0252, 0x0252, 10782 },
+  { 0x0253, 0x0253, -210 },
+  { 0x0254, 0x0254, -206 },
+  { 0x0256, 0x0257, -205 },
+  { 0x0259, 0x0259, -202 },
+  { 0x025B, 0x025B, -203 },
+  { 0x025C, 0x025C, 42319 },
+  { 0x0260, 0x0260, -205 },
+  { 0x0261, 0x0261, 42315 },
+  { 0x0263, 0x0263, -207 },
+  { 0x0265, 0x0265, 42280 },
+  { 0x0266, 0x0266, 42308 },
+  { 0x0268, 0x0268, -209 },
+  { 0x0269, 0x0269, -211 },
+  { 0x026A, 0x026A, 42308 },
+  { 0x026B, 0x026B, 10743 },
+  { 0x026C, 0x026C, 42305 },
+  { 0x026F, 0x026F, -211 },
+  { 0x0271, 0x0271, 10749 },
+  { 0x0272, 0x0272, -213 },
+  { 0x0275, 0x0275, -214 },
+  { 0x027D, 0x027D, 10727 },
+  { 0x0280, 0x0280, -218 },
+  { 0x0282, 0x0282, 42307 },
+  { 0x0283, 0x0283, -218 },
+  { 0x0287, 0x0287, 42282 },
+  { 0x0288, 0x0288, -218 },
+  { 0x0289, 0x0289, -69 },
+  { 0x028A, 0x028B, -217 },
+  { 0x028C, 0x028C, -71 },
+  { 0x0292, 0x0292, -219 },
+  { 0x029D, 0x029D, 42261 },
+  { 0x029E, 0x029E, 42258 },
+  { 0x0345, 0x0345, 84 },
+  { 0x0370, 0x0373, kEvenOdd },
+  { 0x0376, 0x0377, kEvenOdd },
+  { 0x037B, 0x037D, 130 },
+  { 0x037F, 0x037F, 116 },
+  { 0x0386, 0x0386, 38 },
+  { 0x0388, 0x038A, 37 },
+  { 0x038C, 0x038C, 64 },
+  { 0x038E, 0x038F, 63 },
+  { 0x0391, 0x03A1, 32 },
+  { 0x03A3, 0x03A3, 31 },
+  { 0x03A4, 0x03AB, 32 },
+  { 0x03AC, 0x03AC, -38 },
+  { 0x03AD, 0x03AF, -37 },
+  { 0x03B1, 0x03B1, -32 },
+  { 0x03B2, 0x03B2, 30 },
+  { 0x03B3, 0x03B4, -32 },
+  { 0x03B5, 0x03B5, 64 },
+  { 0x03B6, 0x03B7, -32 },
+  { 0x03B8, 0x03B8, 25 },
+  { 0x03B9, 0x03B9, 7173 },
+  { 0x03BA, 0x03BA, 54 },
+  { 0x03BB, 0x03BB, -32 },
+  { 0x03BC, 0x03BC, -775 },
+  { 0x03BD, 0x03BF, -32 },
+  { 0x03C0, 0x03C0, 22 },
+  { 0x03C1, 0x03C1, 48 },
+  { 0x03C2, 0x03C2, 1 },
+  { 0x03C3, 0x03C5, -32 },
+  { 0x03C6, 0x03C6, 15 },
+  { 0x03C7, 0x03C8, -32 },
+  { 0x03C9, 0x03C9, 7517 },
+  { 0x03CA, 0x03CB, -32 },
+  { 0x03CC, 0x03CC, -64 },
+  { 0x03CD, 0x03CE, -63 },
+  { 0x03CF, 0x03CF, 8 },
+  { 0x03D0, 0x03D0, -62 },
+  { 0x03D1, 0x03D1, 35 },
+  { 0x03D5, 0x03D5, -47 },
+  { 0x03D6, 0x03D6, -54 },
+  { 0x03D7, 0x03D7, -8 },
+  { 0x03D8, 0x03EF, kEvenOdd },
+  { 0x03F0, 0x03F0, -86 },
+  { 0x03F1, 0x03F1, -80 },
+  { 0x03F2, 0x03F2, 7 },
+  { 0x03F3, 0x03F3, -116 },
+  { 0x03F4, 0x03F4, -92 },
+  { 0x03F5, 0x03F5, -96 },
+  { 0x03F7, 0x03F8, kOddEven },
+  { 0x03F9, 0x03F9, -7 },
+  { 0x03FA, 0x03FB, kEvenOdd },
+  { 0x03FD, 0x03FF, -130 },
+  { 0x0400, 0x040F, 80 },
+  { 0x0410, 0x042F, 32 },
+  { 0x0430, 0x0431, -32 },
+  { 0x0432, 0x0432, 6222 },
+  { 0x0433, 0x0433, -32 },
+  { 0x0434, 0x0434, 6221 },
+  { 0x0435, 0x043D, -32 },
+  { 0x043E, 0x043E, 6212 },
+  { 0x043F, 0x0440, -32 },
+  { 0x0441, 0x0442, 6210 },
+  { 0x0443, 0x0449, -32 },
+  { 0x044A, 0x044A, 6204 },
+  { 0x044B, 0x044F, -32 },
+  { 0x0450, 0x045F, -80 },
+  { 0x0460, 0x0462, kEvenOdd },
+  { 0x0463, 0x0463, 6180 },
+  { 0x0464, 0x0481, kEvenOdd },
+  { 0x048A, 0x04BF, kEvenOdd },
+  { 0x04C0, 0x04C0, 15 },
+  { 0x04C1, 0x04CE, kOddEven },
+  { 0x04CF, 0x04CF, -15 },
+  { 0x04D0, 0x052F, kEvenOdd },
+  { 0x0531, 0x0556, 48 },
+  { 0x0561, 0x0586, -48 },
+  { 0x10A0, 0x10C5, 7264 },
+  { 0x10C7, 0x10C7, 7264 },
+  { 0x10CD, 0x10CD, 7264 },
+  { 0x10D0, 0x10FA, 3008 },
+  { 0x10FD, 0x10FF, 3008 },
+  { 0x13A0, 0x13EF, 38864 },
+  { 0x13F0, 0x13F5, 8 },
+  { 0x13F8, 0x13FD, -8 },
+  { 0x1C80, 0x1C80, -6254 },
+  { 0x1C81, 0x1C81, -6253 },
+  { 0x1C82, 0x1C82, -6244 },
+  { 0x1C83, 0x1C83, -6242 },
+  { 0x1C84, 0x1C84, 1 },
+  { 0x1C85, 0x1C85, -6243 },
+  { 0x1C86, 0x1C86, -6236 },
+  { 0x1C87, 0x1C87, -6181 },
+  { 0x1C88, 0x1C88, 35266 },
+  { 0x1C90, 0x1CBA, -3008 },
+  { 0x1CBD, 0x1CBF, -3008 },
+  { 0x1D79, 0x1D79, 35332 },
+  { 0x1D7D, 0x1D7D, 3814 },
+  { 0x1D8E, 0x1D8E, 35384 },
+  { 0x1E00, 0x1E60, kEvenOdd },
+  { 0x1E61, 0x1E61, 58 },
+  { 0x1E62, 0x1E95, kEvenOdd },
+  { 0x1E9B, 0x1E9B, -59 },
+  { 0x1E9E, 0x1E9E, -7615 },
+  { 0x1EA0, 0x1EFF, kEvenOdd },
+  { 0x1F00, 0x1F07, 8 },
+  { 0x1F08, 0x1F0F, -8 },
+  { 0x1F10, 0x1F15, 8 },
+  { 0x1F18, 0x1F1D, -8 },
+  { 0x1F20, 0x1F27, 8 },
+  { 0x1F28, 0x1F2F, -8 },
+  { 0x1F30, 0x1F37, 8 },
+  { 0x1F38, 0x1F3F, -8 },
+  { 0x1F40, 0x1F45, 8 },
+  { 0x1F48, 0x1F4D, -8 },
+  { 0x1F51, 0x1F51, 8 },
+  { 0x1F53, 0x1F53, 8 },
+  { 0x1F55, 0x1F55, 8 },
+  { 0x1F57, 0x1F57, 8 },
+  { 0x1F59, 0x1F59, -8 },
+  { 0x1F5B, 0x1F5B, -8 },
+  { 0x1F5D, 0x1F5D, -8 },
+  { 0x1F5F, 0x1F5F, -8 },
+  { 0x1F60, 0x1F67, 8 },
+  { 0x1F68, 0x1F6F, -8 },
+  { 0x1F70, 0x1F71, 74 },
+  { 0x1F72, 0x1F75, 86 },
+  { 0x1F76, 0x1F77, 100 },
+  { 0x1F78, 0x1F79, 128 },
+  { 0x1F7A, 0x1F7B, 112 },
+  { 0x1F7C, 0x1F7D, 126 },
+  { 0x1F80, 0x1F87, 8 },
+  { 0x1F88, 0x1F8F, -8 },
+  { 0x1F90, 0x1F97, 8 },
+  { 0x1F98, 0x1F9F, -8 },
+  { 0x1FA0, 0x1FA7, 8 },
+  { 0x1FA8, 0x1FAF, -8 },
+  { 0x1FB0, 0x1FB1, 8 },
+  { 0x1FB3, 0x1FB3, 9 },
+  { 0x1FB8, 0x1FB9, -8 },
+  { 0x1FBA, 0x1FBB, -74 },
+  { 0x1FBC, 0x1FBC, -9 },
+  { 0x1FBE, 0x1FBE, -7289 },
+  { 0x1FC3, 0x1FC3, 9 },
+  { 0x1FC8, 0x1FCB, -86 },
+  { 0x1FCC, 0x1FCC, -9 },
+  { 0x1FD0, 0x1FD1, 8 },
+  { 0x1FD8, 0x1FD9, -8 },
+  { 0x1FDA, 0x1FDB, -100 },
+  { 0x1FE0, 0x1FE1, 8 },
+  { 0x1FE5, 0x1FE5, 7 },
+  { 0x1FE8, 0x1FE9, -8 },
+  { 0x1FEA, 0x1FEB, -112 },
+  { 0x1FEC, 0x1FEC, -7 },
+  { 0x1FF3, 0x1FF3, 9 },
+  { 0x1FF8, 0x1FF9, -128 },
+  { 0x1FFA, 0x1FFB, -126 },
+  { 0x1FFC, 0x1FFC, -9 },
+  { 0x2126, 0x2126, -7549 },
+  { 0x212A, 0x212A, -8415 },
+  { 0x212B, 0x212B, -8294 },
+  { 0x2132, 0x2132, 28 },
+  { 0x214E, 0x214E, -28 },
+  { 0x2160, 0x216F, 16 },
+  { 0x2170, 0x217F, -16 },
+  { 0x2183, 0x2184, kOddEven },
+  { 0x24B6, 0x24CF, 26 },
+  { 0x24D0, 0x24E9, -26 },
+  { 0x2C00, 0x2C2F, 48 },
+  { 0x2C30, 0x2C5F, -48 },
+  { 0x2C60, 0x2C61, kEvenOdd },
+  { 0x2C62, 0x2C62, -10743 },
+  { 0x2C63, 0x2C63, -3814 },
+  { 0x2C64, 0x2C64, -10727 },
+  { 0x2C65, 0x2C65, -10795 },
+  { 0x2C66, 0x2C66, -10792 },
+  { 0x2C67, 0x2C6C, kOddEven },
+  { 0x2C6D, 0x2C6D, -10780 },
+  { 0x2C6E, 0x2C6E, -10749 },
+  { 0x2C6F, 0x2C6F, -10783 },
+  { 0x2C70, 0x2C70, -10782 },
+  { 0x2C72, 0x2C73, kEvenOdd },
+  { 0x2C75, 0x2C76, kOddEven },
+  { 0x2C7E, 0x2C7F, -10815 },
+  { 0x2C80, 0x2CE3, kEvenOdd },
+  { 0x2CEB, 0x2CEE, kOddEven },
+  { 0x2CF2, 0x2CF3, kEvenOdd },
+  { 0x2D00, 0x2D25, -7264 },
+  { 0x2D27, 0x2D27, -7264 },
+  { 0x2D2D, 0x2D2D, -7264 },
+  { 0xA640, 0xA64A, kEvenOdd },
+  { 0xA64B, 0xA64B, -35267 },
+  { 0xA64C, 0xA66D, kEvenOdd },
+  { 0xA680, 0xA69B, kEvenOdd },
+  { 0xA722, 0xA72F, kEvenOdd },
+  { 0xA732, 0xA76F, kEvenOdd },
+  { 0xA779, 0xA77C, kOddEven },
+  { 0xA77D, 0xA77D, -35332 },
+  { 0xA77E, 0xA787, kEvenOdd },
+  { 0xA78B, 0xA78C, kOddEven },
+  { 0xA78D, 0xA78D, -42280 },
+  { 0xA790, 0xA793, kEvenOdd },
+  { 0xA794, 0xA794, 48 },
+  { 0xA796, 0xA7A9, kEvenOdd },
+  { 0xA7AA, 0xA7AA, -42308 },
+  { 0xA7AB, 0xA7AB, -42319 },
+  { 0xA7AC, 0xA7AC, -42315 },
+  { 0xA7AD, 0xA7AD, -42305 },
+  { 0xA7AE, 0xA7AE, -42308 },
+  { 0xA7B0, 0xA7B0, -42258 },
+  { 0xA7B1, 0xA7B1, -42282 },
+  { 0xA7B2, 0xA7B2, -42261 },
+  { 0xA7B3, 0xA7B3, 928 },
+  { 0xA7B4, 0xA7C3, kEvenOdd },
+  { 0xA7C4, 0xA7C4, -48 },
+  { 0xA7C5, 0xA7C5, -42307 },
+  { 0xA7C6, 0xA7C6, -35384 },
+  { 0xA7C7, 0xA7CA, kOddEven },
+  { 0xA7D0, 0xA7D1, kEvenOdd },
+  { 0xA7D6, 0xA7D9, kEvenOdd },
+  { 0xA7F5, 0xA7F6, kOddEven },
+  { 0xAB53, 0xAB53, -928 },
+  { 0xAB70, 0xABBF, -38864 },
+  { 0xFF21, 0xFF3A, 32 },
+  { 0xFF41, 0xFF5A, -32 },
+  { 0x10400, 0x10427, 40 },
+  { 0x10428, 0x1044F, -40 },
+  { 0x104B0, 0x104D3, 40 },
+  { 0x104D8, 0x104FB, -40 },
+  { 0x10570, 0x1057A, 39 },
+  { 0x1057C, 0x1058A, 39 },
+  { 0x1058C, 0x10592, 39 },
+  { 0x10594, 0x10595, 39 },
+  { 0x10597, 0x105A1, -39 },
+  { 0x105A3, 0x105B1, -39 },
+  { 0x105B3, 0x105B9, -39 },
+  { 0x105BB, 0x105BC, -39 },
+  { 0x10C80, 0x10CB2, 64 },
+  { 0x10CC0, 0x10CF2, -64 },
+  { 0x118A0, 0x118BF, 32 },
+  { 0x118C0, 0x118DF, -32 },
+  { 0x16E40, 0x16E5F, 32 },
+  { 0x16E60, 0x16E7F, -32 },
+  { 0x1E900, 0x1E921, 34 },
+  { 0x1E922, 0x1E943, -34 },
+};
+
+const int kNumCaseFold = sizeof(kCaseFold) / sizeof(kCaseFold[0]);
+
+}  // namespace redgrep
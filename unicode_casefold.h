@@ -0,0 +1,46 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REDGREP_UNICODE_CASEFOLD_H_
+#define REDGREP_UNICODE_CASEFOLD_H_
+
+#include "utf.h"
+
+namespace redgrep {
+
+// Represents the simple case folding of the runes in [lo, hi]. The runes that
+// fold to one another form an orbit; adding delta to a rune yields the next
+// rune in its orbit, which eventually cycles back to the rune itself.
+struct CaseFold {
+  Rune lo;
+  Rune hi;
+  int delta;
+};
+
+// Special values of delta for ranges in which the orbits are pairs of adjacent
+// runes: kEvenOdd pairs each even rune with the odd rune after it, whereas
+// kOddEven pairs each odd rune with the even rune after it.
+enum {
+  kEvenOdd = 0x110000,
+  kOddEven = -0x110000,
+};
+
+// Sorted by lo. The ranges do not overlap.
+// Derived from the simple case mappings in Unicode 14.0.0.
+extern const CaseFold kCaseFold[];
+extern const int kNumCaseFold;
+
+}  // namespace redgrep
+
+#endif  // REDGREP_UNICODE_CASEFOLD_H_
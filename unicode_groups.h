@@ -0,0 +1,49 @@
+// Copyright 2024 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REDGREP_UNICODE_GROUPS_H_
+#define REDGREP_UNICODE_GROUPS_H_
+
+#include "utf.h"
+
+namespace redgrep {
+
+// Represents the runes in [lo, hi].
+struct RuneRange {
+  Rune lo;
+  Rune hi;
+};
+
+// Represents a named class of runes as a static table of rune ranges, which
+// are sorted by lo and neither overlap nor abut.
+struct RuneGroup {
+  const char* name;
+  const RuneRange* ranges;
+  int nranges;
+};
+
+// The Perl classes (\d, \s and \w), which match only ASCII as in RE2.
+extern const RuneGroup kPerlGroups[];
+extern const int kNumPerlGroups;
+
+// The Unicode general categories (e.g. \p{Lu}), sorted by name. The one-letter
+// categories (e.g. \p{L}) are the unions of the two-letter categories that
+// begin with that letter, so they do not have tables of their own.
+// Derived from the general categories in Unicode 14.0.0.
+extern const RuneGroup kUnicodeGroups[];
+extern const int kNumUnicodeGroups;
+
+}  // namespace redgrep
+
+#endif  // REDGREP_UNICODE_GROUPS_H_